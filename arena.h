@@ -0,0 +1,303 @@
+#ifndef _arena_h_
+#define _arena_h_
+
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+
+#include "thread_pool.h"
+
+/*
+ * Step arena for tensor storage.
+ *
+ * A step is everything allocated while the arena is active on the calling
+ * thread (see Scope) between two begin_step() calls. The first step after
+ * reset() is served from the heap and records the size, allocation index
+ * and release time of every buffer. The next begin_step() turns the
+ * record into a static plan:
+ *
+ * - a buffer lives from its allocation to its release, or to the end of
+ *   the step if it is still alive then
+ * - buffers are placed greedily by decreasing size at the lowest offset
+ *   not used by a buffer with an overlapping lifetime
+ *
+ * and a single block of the planned size is preallocated. Later steps get
+ * the i-th allocation of the step as a view at the planned offset of the
+ * i-th buffer. If that memory is still referenced (someone held on to a
+ * buffer longer than in the recorded step) the allocation falls back to
+ * the heap, and if the sizes stop matching the plan the next step is
+ * recorded again.
+ */
+
+// offsets are multiples of 64 bytes into a 64 byte aligned block
+static const size_t arena_alignment = 16;
+
+inline std::shared_ptr<float> heap_storage(size_t n) {
+  return std::shared_ptr<float>(new float[n](), std::default_delete<float[]>());
+}
+
+// n floats starting at a multiple of arena_alignment floats, the pointer
+// shares ownership of the slightly larger allocation
+inline std::shared_ptr<float> aligned_heap_storage(size_t n) {
+  auto raw = heap_storage(n + arena_alignment - 1);
+  size_t bytes = arena_alignment * sizeof(float);
+  size_t skew = reinterpret_cast<uintptr_t>(raw.get()) % bytes;
+  size_t begin = skew == 0 ? 0 : (bytes - skew) / sizeof(float);
+  return std::shared_ptr<float>(raw, raw.get() + begin);
+}
+
+class MemoryArena {
+  public:
+    struct Stats {
+      // allocations of a planned step
+      size_t buffers = 0;
+      // bytes of those allocations without any reuse
+      size_t total_bytes = 0;
+      // preallocated arena, i.e. the peak memory of a planned step
+      size_t arena_bytes = 0;
+      // allocations of the last step which did not come from the arena
+      size_t misses = 0;
+    };
+
+    // routes allocate_storage() on this thread to arena while alive,
+    // a nullptr arena means the heap
+    class Scope {
+      public:
+        explicit Scope(MemoryArena* arena) : prev_(current()) {
+          current() = arena;
+        }
+
+        ~Scope() {
+          current() = prev_;
+        }
+
+      private:
+        Scope(const Scope&) = delete;
+        const Scope& operator=(const Scope&) = delete;
+
+        MemoryArena* prev_;
+    };
+
+    static MemoryArena*& current() {
+      thread_local MemoryArena* arena = nullptr;
+      return arena;
+    }
+
+    MemoryArena() {
+      reset();
+    }
+
+    ~MemoryArena() {
+      close_record();
+    }
+
+    // forget the plan, the next step is recorded again
+    void reset() {
+      close_record();
+      record_ = std::make_shared<Record>();
+      recording_ = true;
+      stale_ = false;
+      started_ = false;
+    }
+
+    // ends the current step (planning it if it was recorded) and starts
+    // the next one
+    void begin_step() {
+      if (recording_ && started_) {
+        plan();
+      } else if (stale_) {
+        reset();
+      }
+
+      index_ = 0;
+      stats_.misses = 0;
+      started_ = true;
+    }
+
+    const Stats& stats() const {
+      return stats_;
+    }
+
+    // zero filled storage for n floats
+    std::shared_ptr<float> allocate(size_t n) {
+      if (recording_) {
+        return record(n);
+      }
+
+      size_t i = index_++;
+      if (i >= slots_.size() || slots_[i].size != n) {
+        stale_ = true;
+        stats_.misses++;
+        return heap_storage(n);
+      }
+
+      for (auto j : slots_[i].overlaps) {
+        if (!live_[j].expired()) {
+          stats_.misses++;
+          return heap_storage(n);
+        }
+      }
+
+      float* ptr = block_.get() + slots_[i].offset;
+      std::fill_n(ptr, n, 0.0f);
+
+      // the view keeps the block alive, not the other way around
+      auto block = block_;
+      std::shared_ptr<float> storage(ptr, [block](float*) { });
+      live_[i] = storage;
+      return storage;
+    }
+
+  private:
+    MemoryArena(const MemoryArena&) = delete;
+    const MemoryArena& operator=(const MemoryArena&) = delete;
+
+    // release time of buffers which outlived the recorded step
+    enum : size_t { alive = static_cast<size_t>(-1) };
+
+    // shared with the deleters of recorded buffers, which may run after
+    // the step or the arena are gone
+    struct Record {
+      std::mutex mutex;
+      bool closed = false;
+      size_t count = 0;
+      std::vector<size_t> size;
+      std::vector<size_t> release;
+    };
+
+    struct Slot {
+      size_t size;
+      size_t offset;
+      // slots sharing memory with this one, including itself
+      std::vector<size_t> overlaps;
+    };
+
+    std::shared_ptr<float> record(size_t n) {
+      auto rec = record_;
+      size_t i;
+      {
+        std::lock_guard<std::mutex> lock(rec->mutex);
+        i = rec->count++;
+        rec->size.push_back(n);
+        rec->release.push_back(alive);
+      }
+
+      return std::shared_ptr<float>(new float[n](), [rec, i](float* p) {
+        {
+          std::lock_guard<std::mutex> lock(rec->mutex);
+          if (!rec->closed) {
+            rec->release[i] = rec->count;
+          }
+        }
+        delete[] p;
+      });
+    }
+
+    void close_record() {
+      if (record_) {
+        std::lock_guard<std::mutex> lock(record_->mutex);
+        record_->closed = true;
+      }
+    }
+
+    void plan() {
+      close_record();
+
+      size_t n = record_->size.size();
+      std::vector<size_t> begin(n), end(n), padded(n);
+      for (size_t i = 0; i < n; ++i) {
+        begin[i] = i;
+        end[i] = record_->release[i];
+        padded[i] = (record_->size[i] + arena_alignment - 1)
+          / arena_alignment * arena_alignment;
+      }
+
+      std::vector<size_t> order(n);
+      for (size_t i = 0; i < n; ++i) {
+        order[i] = i;
+      }
+      std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return padded[a] > padded[b];
+      });
+
+      slots_.assign(n, Slot());
+      std::vector<size_t> placed;
+      size_t arena_size = 0;
+      stats_.total_bytes = 0;
+
+      for (auto i : order) {
+        // memory taken by placed buffers alive at the same time, by offset
+        std::vector<std::pair<size_t, size_t>> taken;
+        for (auto j : placed) {
+          if (begin[i] < end[j] && begin[j] < end[i]) {
+            taken.emplace_back(slots_[j].offset, slots_[j].offset + padded[j]);
+          }
+        }
+        std::sort(taken.begin(), taken.end());
+
+        size_t offset = 0;
+        for (auto& t : taken) {
+          if (offset + padded[i] <= t.first) {
+            break;
+          }
+          offset = std::max(offset, t.second);
+        }
+
+        slots_[i].size = record_->size[i];
+        slots_[i].offset = offset;
+        placed.push_back(i);
+        arena_size = std::max(arena_size, offset + padded[i]);
+        stats_.total_bytes += record_->size[i] * sizeof(float);
+      }
+
+      for (size_t i = 0; i < n; ++i) {
+        for (size_t j = 0; j < n; ++j) {
+          if (slots_[i].offset < slots_[j].offset + padded[j] &&
+              slots_[j].offset < slots_[i].offset + padded[i]) {
+            slots_[i].overlaps.push_back(j);
+          }
+        }
+      }
+
+      block_ = aligned_heap_storage(std::max<size_t>(arena_size, 1));
+      live_.assign(n, std::weak_ptr<float>());
+      stats_.buffers = n;
+      stats_.arena_bytes = arena_size * sizeof(float);
+      recording_ = false;
+      stale_ = false;
+    }
+
+    std::shared_ptr<Record> record_;
+    bool recording_ = true;
+    bool stale_ = false;
+    bool started_ = false;
+    size_t index_ = 0;
+
+    std::vector<Slot> slots_;
+    std::vector<std::weak_ptr<float>> live_;
+    std::shared_ptr<float> block_;
+    Stats stats_;
+};
+
+// bytes of tensor storage allocated by this thread so far
+inline size_t& allocated_bytes() {
+  thread_local size_t bytes = 0;
+  return bytes;
+}
+
+// zero filled storage for n floats, from the arena active on this thread
+// if there is one. Chunks of a parallel_for() always use the heap, the
+// sequence of arena allocations must not depend on the scheduling.
+inline std::shared_ptr<float> allocate_storage(size_t n) {
+  allocated_bytes() += n * sizeof(float);
+  auto arena = MemoryArena::current();
+  if (arena == nullptr || ThreadPool::in_parallel()) {
+    return heap_storage(n);
+  }
+  return arena->allocate(n);
+}
+
+#endif // _arena_h_
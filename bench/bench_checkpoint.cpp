@@ -0,0 +1,81 @@
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+
+#include "../ndarray.cpp"
+#include "../graph.cpp"
+#include "../kernel.cpp"
+
+// Training steps of a deep MLP with a checkpoint every k layers: the
+// activation memory forward() leaves for backward() against the forward
+// work backward() repeats.
+
+OpRef linear(OpRef x, size_t inp_size, size_t out_size) {
+  auto W = Variable::create(x->graph(), Shape({inp_size, out_size}), true);
+  auto b = Variable::create(x->graph(), {out_size}, true);
+  W->set_value(NDArray({inp_size, out_size},
+        random_normal_vec<float>(inp_size * out_size, 0.0f, 0.05f)));
+  return x->mm(W)->add(b);
+}
+
+int main() {
+  using clock = std::chrono::steady_clock;
+  size_t batch_size = 256;
+  size_t width = 512;
+  size_t depth = 16;
+  size_t steps = 10;
+
+  std::cout << std::setw(8) << "every"
+    << std::setw(10) << "segments"
+    << std::setw(10) << "kept MB"
+    << std::setw(12) << "recomputed"
+    << std::setw(10) << "ms/step" << std::endl;
+
+  for (size_t every : {0, 8, 4, 2, 1}) {
+    GraphRef g = std::make_shared<Graph>();
+    auto x = Variable::create(g, {width});
+    auto y = Variable::create(g, {10});
+
+    OpRef h = x;
+    for (size_t i = 0; i < depth; ++i) {
+      h = linear(h, width, width)->relu();
+      if (every != 0 && (i + 1) % every == 0) {
+        g->checkpoint(h);
+      }
+    }
+    auto loss = linear(h, width, 10)->softmax_ce(y);
+
+    x->set_value(NDArray({batch_size, width},
+          random_vec<float>(batch_size * width, 0.0f, 1.0f)));
+    NDArray labels({batch_size, 10});
+    for (size_t i = 0; i < batch_size; ++i) {
+      labels.set({i, i % 10}, 1.0f);
+    }
+    y->set_value(labels);
+
+    auto step = [&]() {
+      // as if a new batch came in, so forward() runs every node
+      x->set_value(x->get_value());
+      g->forward();
+      g->backward(loss);
+    };
+
+    step();
+    auto start = clock::now();
+    for (size_t i = 0; i < steps; ++i) {
+      step();
+    }
+    double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+
+    const auto& stats = g->checkpoint_stats();
+    std::cout << std::setw(8) << (every ? std::to_string(every) : "-")
+      << std::setw(10) << stats.segments
+      << std::fixed << std::setprecision(2)
+      << std::setw(10) << stats.kept_bytes / double(1 << 20)
+      << std::setw(6) << stats.recomputed_nodes << "/"
+      << std::setw(5) << std::left << stats.forward_nodes << std::right
+      << std::setw(10) << elapsed / steps * 1e3 << std::endl;
+  }
+
+  return 0;
+}
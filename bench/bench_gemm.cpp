@@ -0,0 +1,80 @@
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+
+#include "../ndarray.h"
+#include "../ndarray.cpp"
+
+// The i-j-l loop NDArray::mm used before the blocked engine.
+void naive_mm(size_t m, size_t n, size_t k,
+    const float* A, const float* B, float* AB) {
+  for (size_t i = 0; i < m; ++i) {
+    for (size_t j = 0; j < k; ++j) {
+      auto& AB_ij = AB[i * k + j];
+      auto A_i = &A[i * n];
+      auto B_j = &B[j];
+
+      for (size_t l = 0; l < n; ++l) {
+        AB_ij += A_i[l] * B_j[l * k];
+      }
+    }
+  }
+}
+
+template <class F>
+double seconds_per_call(F fn) {
+  using clock = std::chrono::steady_clock;
+  fn();  // warm up
+
+  size_t iters = 0;
+  auto start = clock::now();
+  double elapsed = 0.0;
+  while (elapsed < 0.5) {
+    fn();
+    ++iters;
+    elapsed = std::chrono::duration<double>(clock::now() - start).count();
+  }
+
+  return elapsed / iters;
+}
+
+int main() {
+  // (m, n) x (n, k) shapes of the MLP in main.cpp at batch size 100,
+  // forward and the two backward products of each layer
+  std::vector<std::vector<size_t>> shapes = {
+    {100, 784, 512}, {784, 100, 512}, {100, 512, 784},
+    {100, 512, 512}, {512, 100, 512},
+    {100, 512, 10}, {512, 100, 10}, {100, 10, 512},
+  };
+
+  std::cout << std::setw(18) << "shape"
+    << std::setw(14) << "naive GF/s"
+    << std::setw(14) << "sgemm GF/s"
+    << std::setw(10) << "speedup" << std::endl;
+
+  for (auto& s : shapes) {
+    size_t m = s[0], n = s[1], k = s[2];
+    NDArray A({m, n}, random_vec<float>(m * n, -1.0f, 1.0f));
+    NDArray B({n, k}, random_vec<float>(n * k, -1.0f, 1.0f));
+    auto a = A.vec();
+    auto b = B.vec();
+    std::vector<float> c(m * k);
+
+    double flops = 2.0 * m * n * k;
+    double t_naive = seconds_per_call([&]() {
+        std::fill(c.begin(), c.end(), 0.0f);
+        naive_mm(m, n, k, a.data(), b.data(), c.data());
+        });
+    double t_gemm = seconds_per_call([&]() {
+        auto res = A.mm(B);
+        });
+
+    std::cout << std::setw(18) << vstr(s)
+      << std::fixed << std::setprecision(2)
+      << std::setw(14) << flops / t_naive * 1e-9
+      << std::setw(14) << flops / t_gemm * 1e-9
+      << std::setw(9) << t_naive / t_gemm << "x" << std::endl;
+  }
+
+  return 0;
+}
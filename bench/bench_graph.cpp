@@ -0,0 +1,94 @@
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+
+#include "../ndarray.cpp"
+#include "../graph.cpp"
+#include "../kernel.cpp"
+
+// Per step overhead of the graph machinery on models small enough that the
+// math is cheap: a deep and narrow MLP at batch size 1.
+
+OpRef linear(OpRef x, size_t inp_size, size_t out_size) {
+  auto W = Variable::create(x->graph(), Shape({inp_size, out_size}), true);
+  auto b = Variable::create(x->graph(), {out_size}, true);
+  W->set_value(NDArray({inp_size, out_size},
+        random_normal_vec<float>(inp_size * out_size, 0.0f, 0.1f)));
+  return x->mm(W)->add(b);
+}
+
+template <class F>
+double seconds_per_call(F fn) {
+  using clock = std::chrono::steady_clock;
+  fn();  // warm up
+
+  size_t iters = 0;
+  auto start = clock::now();
+  double elapsed = 0.0;
+  while (elapsed < 0.5) {
+    fn();
+    ++iters;
+    elapsed = std::chrono::duration<double>(clock::now() - start).count();
+  }
+
+  return elapsed / iters;
+}
+
+int main() {
+  std::cout << std::setw(14) << "depth x width"
+    << std::setw(8) << "nodes"
+    << std::setw(16) << "replan fw us"
+    << std::setw(16) << "plan fw us"
+    << std::setw(16) << "replan fw+bw"
+    << std::setw(16) << "plan fw+bw" << std::endl;
+
+  for (size_t depth : {4, 16, 64}) {
+    for (size_t width : {4, 32}) {
+      GraphRef g = std::make_shared<Graph>();
+      // X stays the same, so time full passes rather than cache hits
+      g->set_incremental(false);
+      auto X = Variable::create(g, {width});
+      auto y = Variable::create(g, {10});
+
+      OpRef h = X;
+      for (size_t i = 0; i < depth; ++i) {
+        h = linear(h, width, width)->relu();
+      }
+      auto loss = linear(h, width, 10)->softmax_ce(y);
+
+      X->set_value(NDArray({1, width}, random_vec<float>(width, 0.0f, 1.0f)));
+      NDArray target({1, 10});
+      target.set({0, 3}, 1.0f);
+      y->set_value(target);
+
+      // X, y, depth x (W, b, mm, add, relu), W, b, mm, add, softmax_ce
+      size_t nodes = 5 * depth + 7;
+      double replan_fw = seconds_per_call([&]() {
+          g->compile();
+          g->forward();
+          });
+      double plan_fw = seconds_per_call([&]() {
+          g->forward();
+          });
+      double replan_fwbw = seconds_per_call([&]() {
+          g->compile();
+          g->forward();
+          g->backward(loss);
+          });
+      double plan_fwbw = seconds_per_call([&]() {
+          g->forward();
+          g->backward(loss);
+          });
+
+      std::cout << std::setw(9) << depth << " x " << std::setw(2) << width
+        << std::setw(8) << nodes
+        << std::fixed << std::setprecision(1)
+        << std::setw(16) << replan_fw * 1e6
+        << std::setw(16) << plan_fw * 1e6
+        << std::setw(16) << replan_fwbw * 1e6
+        << std::setw(16) << plan_fwbw * 1e6 << std::endl;
+    }
+  }
+
+  return 0;
+}
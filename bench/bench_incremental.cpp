@@ -0,0 +1,74 @@
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+
+#include "../ndarray.cpp"
+#include "../graph.cpp"
+#include "../kernel.cpp"
+
+// Repeated evaluation of a model with a frozen backbone over a constant
+// input and a small head over an input which changes every pass, with and
+// without incremental evaluation.
+
+OpRef linear(OpRef x, size_t inp_size, size_t out_size) {
+  auto W = Variable::create(x->graph(), Shape({inp_size, out_size}));
+  auto b = Variable::create(x->graph(), {out_size});
+  W->set_value(NDArray({inp_size, out_size},
+        random_normal_vec<float>(inp_size * out_size, 0.0f, 0.05f)));
+  return x->mm(W)->add(b);
+}
+
+int main() {
+  using clock = std::chrono::steady_clock;
+  size_t batch_size = 100;
+  size_t width = 512;
+  size_t passes = 20;
+
+  std::cout << std::setw(12) << "incremental"
+    << std::setw(11) << "inference"
+    << std::setw(12) << "ms/pass" << std::endl;
+
+  for (bool inference : {false, true})
+  for (bool incremental : {false, true}) {
+    GraphRef g = std::make_shared<Graph>();
+    auto features = Variable::create(g, {width});
+    auto query = Variable::create(g, {width});
+
+    OpRef backbone = features;
+    for (size_t i = 0; i < 4; ++i) {
+      backbone = linear(backbone, width, width)->relu();
+    }
+    auto scores = linear(query, width, width)->mul(backbone)->softmax();
+
+    features->set_value(NDArray({batch_size, width},
+          random_vec<float>(batch_size * width, 0.0f, 1.0f)));
+    g->set_incremental(incremental);
+    g->set_inference(inference);
+
+    auto pass = [&]() {
+      query->set_value(NDArray({batch_size, width},
+            random_vec<float>(batch_size * width, 0.0f, 1.0f)));
+      g->forward({scores});
+    };
+
+    pass();
+    pass();
+
+    double elapsed = 0.0;
+    for (size_t i = 0; i < passes; ++i) {
+      // only time forward(), not the random input
+      query->set_value(NDArray({batch_size, width},
+            random_vec<float>(batch_size * width, 0.0f, 1.0f)));
+      auto start = clock::now();
+      g->forward({scores});
+      elapsed += std::chrono::duration<double>(clock::now() - start).count();
+    }
+
+    std::cout << std::setw(12) << (incremental ? "on" : "off")
+      << std::setw(11) << (inference ? "on" : "off")
+      << std::fixed << std::setprecision(2)
+      << std::setw(12) << elapsed / passes * 1e3 << std::endl;
+  }
+
+  return 0;
+}
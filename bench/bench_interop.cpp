@@ -0,0 +1,105 @@
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+
+#include "../ndarray.cpp"
+#include "../graph.cpp"
+#include "../kernel.cpp"
+
+// Training step of a multi-branch model (independent towers over the same
+// input, joined before the loss) with serial and inter-op execution. The
+// towers are small, so intra-op parallelism alone leaves threads idle.
+
+OpRef linear(OpRef x, size_t inp_size, size_t out_size) {
+  auto W = Variable::create(x->graph(), Shape({inp_size, out_size}), true);
+  auto b = Variable::create(x->graph(), {out_size}, true);
+  W->set_value(NDArray({inp_size, out_size},
+        random_normal_vec<float>(inp_size * out_size, 0.0f, 0.05f)));
+  return x->mm(W)->add(b);
+}
+
+template <class F>
+double seconds_per_call(F fn) {
+  using clock = std::chrono::steady_clock;
+  fn();  // warm up
+
+  size_t iters = 0;
+  auto start = clock::now();
+  double elapsed = 0.0;
+  while (elapsed < 0.5) {
+    fn();
+    ++iters;
+    elapsed = std::chrono::duration<double>(clock::now() - start).count();
+  }
+
+  return elapsed / iters;
+}
+
+int main() {
+  size_t batch_size = 32;
+  size_t width = 256;
+  size_t depth = 3;
+
+  std::cout << std::setw(8) << "towers"
+    << std::setw(9) << "threads"
+    << std::setw(14) << "serial ms"
+    << std::setw(14) << "inter-op ms"
+    << std::setw(10) << "speedup" << std::endl;
+
+  for (size_t towers : {2, 8}) {
+    GraphRef g = std::make_shared<Graph>();
+    auto X = Variable::create(g, {width});
+    auto y = Variable::create(g, {10});
+
+    OpRef joined;
+    for (size_t t = 0; t < towers; ++t) {
+      OpRef h = X;
+      for (size_t i = 0; i < depth; ++i) {
+        h = linear(h, width, width)->relu();
+      }
+      h = linear(h, width, 10);
+      joined = joined ? joined->sub(h) : h;
+    }
+    auto loss = joined->softmax_ce(y);
+
+    X->set_value(NDArray({batch_size, width},
+          random_vec<float>(batch_size * width, 0.0f, 1.0f)));
+    NDArray target({batch_size, 10});
+    for (size_t i = 0; i < batch_size; ++i) {
+      target.set({i, i % 10}, 1.0f);
+    }
+    y->set_value(target);
+    // nothing changes between steps, recompute everything anyway
+    g->set_incremental(false);
+
+    auto step = [&]() {
+      g->forward();
+      g->backward(loss);
+    };
+
+    size_t hw = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<size_t> thread_counts;
+    for (size_t threads = 1; threads < hw; threads *= 2) {
+      thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(hw);
+
+    for (auto threads : thread_counts) {
+      ThreadPool::get().set_num_threads(threads);
+      g->set_inter_op(false);
+      double serial = seconds_per_call(step);
+      g->set_inter_op(true);
+      double inter_op = seconds_per_call(step);
+
+      std::cout << std::setw(8) << towers
+        << std::setw(9) << threads
+        << std::fixed << std::setprecision(3)
+        << std::setw(14) << serial * 1e3
+        << std::setw(14) << inter_op * 1e3
+        << std::setprecision(2)
+        << std::setw(9) << serial / inter_op << "x" << std::endl;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,157 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <functional>
+
+#include "../ndarray.cpp"
+#include "../graph.cpp"
+#include "../kernel.cpp"
+#include "../mnist.h"
+
+// Training batches of 100 from a synthetic dataset of MNIST size: drawn the
+// way get_train_batch did before the sampler, through the sampler, and
+// from the prefetching loader, alone and in front of a training step of a
+// 784-512-10 MLP.
+
+void write_u32(std::ofstream& os, uint32_t v) {
+  unsigned char bytes[4] = {
+    static_cast<unsigned char>(v >> 24), static_cast<unsigned char>(v >> 16),
+    static_cast<unsigned char>(v >> 8), static_cast<unsigned char>(v)};
+  os.write(reinterpret_cast<char*>(bytes), 4);
+}
+
+std::string write_dataset(size_t n) {
+  char dir[] = "/tmp/uflow_benchXXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    throw RuntimeError("cannot create a temporary directory");
+  }
+
+  std::ofstream images(std::string(dir) + "/train-images-idx3-ubyte",
+      std::ios::binary);
+  write_u32(images, 0x803);
+  write_u32(images, n);
+  write_u32(images, 28);
+  write_u32(images, 28);
+  std::string pixels(MNIST::img_size, '\0');
+  for (size_t i = 0; i < n; ++i) {
+    for (size_t j = 0; j < pixels.size(); ++j) {
+      pixels[j] = static_cast<char>((i + j) % 256);
+    }
+    images.write(pixels.data(), pixels.size());
+  }
+
+  std::ofstream labels(std::string(dir) + "/train-labels-idx1-ubyte",
+      std::ios::binary);
+  write_u32(labels, 0x801);
+  write_u32(labels, n);
+  for (size_t i = 0; i < n; ++i) {
+    labels.put(static_cast<char>(i % 10));
+  }
+  return dir;
+}
+
+// a fresh engine and a shuffle of every index per batch, as before
+std::vector<size_t> legacy_indices(size_t train_size, size_t size) {
+  std::vector<size_t> idx(train_size);
+  for (size_t i = 0; i < train_size; ++i) {
+    idx[i] = i;
+  }
+  std::random_device rd;
+  std::mt19937 g(rd());
+  std::shuffle(idx.begin(), idx.end(), g);
+  idx.resize(size);
+  return idx;
+}
+
+OpRef linear(OpRef x, size_t inp_size, size_t out_size) {
+  auto W = Variable::create(x->graph(), Shape({inp_size, out_size}), true);
+  auto b = Variable::create(x->graph(), {out_size}, true);
+  W->set_value(NDArray({inp_size, out_size},
+        random_normal_vec<float>(inp_size * out_size, 0.0f, 0.05f)));
+  return x->mm(W)->add(b);
+}
+
+int main() {
+  using clock = std::chrono::steady_clock;
+  size_t batch_size = 100;
+  size_t steps = 200;
+
+  std::string dir = write_dataset(60000);
+  MNIST mnist;
+  mnist.load(dir, true);
+  std::remove((dir + "/train-images-idx3-ubyte").c_str());
+  std::remove((dir + "/train-labels-idx1-ubyte").c_str());
+  std::remove(dir.c_str());
+
+  GraphRef g = std::make_shared<Graph>();
+  auto X = Variable::create(g, {784});
+  auto y = Variable::create(g, {10});
+  auto loss = linear(linear(X, 784, 512)->relu(), 512, 10)->softmax_ce(y);
+
+  std::vector<size_t> idx(batch_size);
+  std::vector<int> labels(batch_size);
+  NDArray images({batch_size, MNIST::img_size});
+  NDArray targets({batch_size, MNIST::classes});
+  MNISTLoader loader(mnist, batch_size);
+
+  auto legacy = [&]() {
+    auto i = legacy_indices(mnist.train_size, batch_size);
+    std::vector<float> data(batch_size * MNIST::img_size);
+    std::vector<float> one_hot(batch_size * MNIST::classes);
+    mnist.gather_train(i.data(), batch_size, data.data(), one_hot.data(),
+        labels.data());
+    X->set_value(NDArray({batch_size, MNIST::img_size}, data));
+    y->set_value(NDArray({batch_size, MNIST::classes}, one_hot));
+  };
+  auto sampled = [&]() {
+    auto batch = mnist.get_train_batch(batch_size);
+    std::vector<float> one_hot(batch_size * MNIST::classes);
+    for (size_t i = 0; i < batch_size; ++i) {
+      one_hot[i * MNIST::classes + std::get<1>(batch)[i]] = 1.0f;
+    }
+    X->set_value(NDArray({batch_size, MNIST::img_size}, std::get<0>(batch)));
+    y->set_value(NDArray({batch_size, MNIST::classes}, one_hot));
+  };
+  auto prefetched = [&]() {
+    const auto& batch = loader.next();
+    X->set_value(batch.images);
+    y->set_value(batch.targets);
+  };
+  auto train = [&]() {
+    g->forward({loss});
+    g->backward(loss);
+  };
+
+  std::vector<std::pair<std::string, std::function<void()>>> runs = {
+    {"legacy", legacy},
+    {"sampler", sampled},
+    {"loader", prefetched},
+    {"legacy+step", [&]() { legacy(); train(); }},
+    {"sampler+step", [&]() { sampled(); train(); }},
+    {"loader+step", [&]() { prefetched(); train(); }},
+  };
+
+  std::cout << std::setw(14) << "batches"
+    << std::setw(12) << "batches/s"
+    << std::setw(12) << "us/batch" << std::endl;
+
+  for (const auto& run : runs) {
+    run.second();
+    auto start = clock::now();
+    for (size_t i = 0; i < steps; ++i) {
+      run.second();
+    }
+    double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+
+    std::cout << std::setw(14) << run.first
+      << std::fixed << std::setprecision(0)
+      << std::setw(12) << steps / elapsed
+      << std::setprecision(1)
+      << std::setw(12) << elapsed / steps * 1e6 << std::endl;
+  }
+
+  return 0;
+}
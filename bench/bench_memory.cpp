@@ -0,0 +1,148 @@
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+
+#include "../ndarray.cpp"
+#include "../graph.cpp"
+#include "../kernel.cpp"
+
+// Heap traffic and time of a training step of the MLP in main.cpp with and
+// without the memory planner and the mm -> add -> relu fusion, and of a
+// forward pass with and without inference mode.
+
+static std::atomic<size_t> heap_allocs(0);
+static std::atomic<size_t> heap_bytes(0);
+
+void* operator new(size_t n) {
+  heap_allocs++;
+  heap_bytes += n;
+  if (void* p = std::malloc(n)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  std::free(p);
+}
+
+OpRef linear(OpRef x, size_t inp_size, size_t out_size) {
+  auto W = Variable::create(x->graph(), Shape({inp_size, out_size}), true);
+  auto b = Variable::create(x->graph(), {out_size}, true);
+  W->set_value(NDArray({inp_size, out_size},
+        random_normal_vec<float>(inp_size * out_size, 0.0f, 0.05f)));
+  return x->mm(W)->add(b);
+}
+
+struct Mlp {
+  GraphRef g;
+  OpRef loss;
+  OpRef pred;
+};
+
+Mlp mlp(size_t batch_size) {
+  GraphRef g = std::make_shared<Graph>();
+  auto X = Variable::create(g, {28 * 28});
+  auto y = Variable::create(g, {10});
+  auto l1 = linear(X, 28 * 28, 512)->relu();
+  auto l2 = linear(l1, 512, 512)->relu();
+  auto l3 = linear(l2, 512, 10);
+
+  X->set_value(NDArray({batch_size, 28 * 28},
+        random_vec<float>(batch_size * 28 * 28, 0.0f, 1.0f)));
+  NDArray target({batch_size, 10});
+  for (size_t i = 0; i < batch_size; ++i) {
+    target.set({i, i % 10}, 1.0f);
+  }
+  y->set_value(target);
+
+  return Mlp{g, l3->softmax_ce(y), l3->softmax()};
+}
+
+// heap allocations, MB and ms per call of step
+template <class F>
+void measure(size_t steps, const F& step) {
+  using clock = std::chrono::steady_clock;
+
+  // recording and first planned step
+  step();
+  step();
+
+  heap_allocs = 0;
+  heap_bytes = 0;
+  auto start = clock::now();
+  for (size_t i = 0; i < steps; ++i) {
+    step();
+  }
+  double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+
+  std::cout << std::setw(14) << heap_allocs / steps
+    << std::fixed << std::setprecision(2)
+    << std::setw(14) << heap_bytes / steps / 1e6
+    << std::setw(12) << elapsed / steps * 1e3;
+}
+
+int main() {
+  size_t batch_size = 100;
+  size_t steps = 20;
+
+  std::cout << std::setw(8) << "fusion"
+    << std::setw(10) << "planning"
+    << std::setw(14) << "allocs/step"
+    << std::setw(14) << "MB/step"
+    << std::setw(12) << "ms/step"
+    << std::setw(14) << "arena MB"
+    << std::setw(14) << "unshared MB"
+    << std::setw(8) << "misses" << std::endl;
+
+  for (bool fusion : {false, true})
+  for (bool planning : {false, true}) {
+    auto net = mlp(batch_size);
+    net.g->set_memory_planning(planning);
+    net.g->set_fusion(fusion);
+    // the inputs never change, recompute everything anyway
+    net.g->set_incremental(false);
+
+    std::cout << std::setw(8) << (fusion ? "on" : "off")
+      << std::setw(10) << (planning ? "on" : "off");
+    measure(steps, [&]() {
+      net.g->forward();
+      net.g->backward(net.loss);
+    });
+
+    const auto& stats = net.g->memory_stats();
+    std::cout << std::setw(14) << stats.arena_bytes / 1e6
+      << std::setw(14) << stats.total_bytes / 1e6
+      << std::setw(8) << stats.misses << std::endl;
+  }
+
+  // forward only (serving pred), planned so that arena MB is the peak
+  std::cout << std::endl << std::setw(10) << "inference"
+    << std::setw(14) << "allocs/fwd"
+    << std::setw(14) << "MB/fwd"
+    << std::setw(12) << "ms/fwd"
+    << std::setw(14) << "arena MB" << std::endl;
+
+  for (bool inference : {false, true}) {
+    auto net = mlp(batch_size);
+    net.g->set_memory_planning(true);
+    net.g->set_inference(inference);
+    net.g->set_incremental(false);
+
+    std::cout << std::setw(10) << (inference ? "on" : "off");
+    measure(steps, [&]() {
+      net.g->forward();
+    });
+    std::cout << std::setw(14) << net.g->memory_stats().arena_bytes / 1e6
+      << std::endl;
+  }
+
+  return 0;
+}
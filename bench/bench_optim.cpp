@@ -0,0 +1,105 @@
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <functional>
+
+#include "../ndarray.cpp"
+#include "../graph.cpp"
+#include "../kernel.cpp"
+#include "../optim.h"
+
+// Optimizer steps and gradient clipping over the parameters of a
+// 784-512-512-10 MLP (about 670k floats), against the sgd() main.cpp used
+// before the optimizers, with separate and with flat parameter buffers.
+
+OpRef linear(OpRef x, size_t inp_size, size_t out_size) {
+  auto W = Variable::create(x->graph(), Shape({inp_size, out_size}), true);
+  auto b = Variable::create(x->graph(), {out_size}, true);
+  W->set_value(NDArray({inp_size, out_size},
+        random_normal_vec<float>(inp_size * out_size, 0.0f, 0.05f)));
+  return x->mm(W)->add(b);
+}
+
+// copies every value, allocates the scaled gradient and sets the result
+void legacy_sgd(GraphRef g, float learning_rate) {
+  for (auto& var : g->get_variables()) {
+    auto v = var->get_value();
+    v.sub_(g->gradient(var).muls(learning_rate));
+    var->set_value(v);
+  }
+}
+
+// the model with gradients from one step
+GraphRef model(bool flat) {
+  size_t batch_size = 100;
+  GraphRef g = std::make_shared<Graph>();
+  auto x = Variable::create(g, {784});
+  auto y = Variable::create(g, {10});
+  auto h = linear(linear(x, 784, 512)->relu(), 512, 512)->relu();
+  auto loss = linear(h, 512, 10)->softmax_ce(y);
+
+  x->set_value(NDArray({batch_size, 784},
+        random_vec<float>(batch_size * 784, 0.0f, 1.0f)));
+  NDArray labels({batch_size, 10});
+  for (size_t i = 0; i < batch_size; ++i) {
+    labels.set({i, i % 10}, 1.0f);
+  }
+  y->set_value(labels);
+
+  if (flat) {
+    g->flatten_parameters();
+  }
+  g->forward();
+  g->backward(loss);
+  return g;
+}
+
+int main() {
+  using clock = std::chrono::steady_clock;
+  size_t steps = 200;
+
+  // the steps below only time the update
+  GraphRef g = model(false);
+  GraphRef f = model(true);
+
+  SGD sgd(g, 1e-4f);
+  SGD momentum(g, 1e-4f, 0.9f);
+  Adam adam(g, 1e-4f);
+  AdamW adamw(g, 1e-4f);
+  SGD flat_sgd(f, 1e-4f);
+  Adam flat_adam(f, 1e-4f);
+
+  std::vector<std::pair<std::string, std::function<void()>>> runs = {
+    {"legacy sgd", [&]() { legacy_sgd(g, 1e-4f); }},
+    {"SGD", [&]() { sgd.step(); }},
+    {"SGD momentum", [&]() { momentum.step(); }},
+    {"Adam", [&]() { adam.step(); }},
+    {"AdamW", [&]() { adamw.step(); }},
+    {"SGD flat", [&]() { flat_sgd.step(); }},
+    {"Adam flat", [&]() { flat_adam.step(); }},
+    // a norm above any gradient's, so nothing is scaled
+    {"clip", [&]() { g->clip_gradients(1e9f); }},
+    {"clip flat", [&]() { f->clip_gradients(1e9f); }},
+  };
+
+  std::cout << std::setw(14) << "step"
+    << std::setw(12) << "steps/s"
+    << std::setw(12) << "us/step" << std::endl;
+
+  for (const auto& run : runs) {
+    run.second();
+    auto start = clock::now();
+    for (size_t i = 0; i < steps; ++i) {
+      run.second();
+    }
+    double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+
+    std::cout << std::setw(14) << run.first
+      << std::fixed << std::setprecision(0)
+      << std::setw(12) << steps / elapsed
+      << std::setprecision(1)
+      << std::setw(12) << elapsed / steps * 1e6 << std::endl;
+  }
+
+  return 0;
+}
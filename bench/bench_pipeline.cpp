@@ -0,0 +1,149 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <functional>
+
+#include "../ndarray.cpp"
+#include "../graph.cpp"
+#include "../kernel.cpp"
+#include "../dataset.h"
+
+// One pass over 6 synthetic IDX shards of 10000 MNIST sized images
+// through source -> map -> shuffle -> batch(100) [-> prefetch], with the
+// map on 0 to 4 workers, alone and in front of a training step of a
+// 784-512-10 MLP, and the per stage counters of the last run.
+
+void write_u32(std::ofstream& os, uint32_t v) {
+  unsigned char bytes[4] = {
+    static_cast<unsigned char>(v >> 24), static_cast<unsigned char>(v >> 16),
+    static_cast<unsigned char>(v >> 8), static_cast<unsigned char>(v)};
+  os.write(reinterpret_cast<char*>(bytes), 4);
+}
+
+void write_shard(const std::string& prefix, size_t n) {
+  std::ofstream images(prefix + "-images", std::ios::binary);
+  write_u32(images, 0x803);
+  write_u32(images, n);
+  write_u32(images, 28);
+  write_u32(images, 28);
+  std::string pixels(784, '\0');
+  for (size_t i = 0; i < n; ++i) {
+    for (size_t j = 0; j < pixels.size(); ++j) {
+      pixels[j] = static_cast<char>((i + j) % 256);
+    }
+    images.write(pixels.data(), pixels.size());
+  }
+
+  std::ofstream labels(prefix + "-labels", std::ios::binary);
+  write_u32(labels, 0x801);
+  write_u32(labels, n);
+  for (size_t i = 0; i < n; ++i) {
+    labels.put(static_cast<char>(i % 10));
+  }
+}
+
+// standardizes the pixels, a typical per sample transform
+Sample standardize(Sample s) {
+  float mean = 0.0f;
+  for (float v : s.x) {
+    mean += v;
+  }
+  mean /= s.x.size();
+  float var = 0.0f;
+  for (float v : s.x) {
+    var += (v - mean) * (v - mean);
+  }
+  float scale = 1.0f / std::sqrt(var / s.x.size() + 1e-5f);
+  for (float& v : s.x) {
+    v = (v - mean) * scale;
+  }
+  return s;
+}
+
+OpRef linear(OpRef x, size_t inp_size, size_t out_size) {
+  auto W = Variable::create(x->graph(), Shape({inp_size, out_size}), true);
+  auto b = Variable::create(x->graph(), {out_size}, true);
+  W->set_value(NDArray({inp_size, out_size},
+        random_normal_vec<float>(inp_size * out_size, 0.0f, 0.05f)));
+  return x->mm(W)->add(b);
+}
+
+int main() {
+  using clock = std::chrono::steady_clock;
+  size_t shards = 6;
+
+  char dir[] = "/tmp/uflow_benchXXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    throw RuntimeError("cannot create a temporary directory");
+  }
+  std::vector<std::string> images, labels;
+  for (size_t i = 0; i < shards; ++i) {
+    std::string prefix = std::string(dir) + "/" + std::to_string(i);
+    write_shard(prefix, 10000);
+    images.push_back(prefix + "-images");
+    labels.push_back(prefix + "-labels");
+  }
+
+  GraphRef g = std::make_shared<Graph>();
+  auto X = Variable::create(g, {784});
+  auto y = Variable::create(g, {10});
+  auto loss = linear(linear(X, 784, 512)->relu(), 512, 10)->softmax_ce(y);
+
+  auto pipeline = [&](size_t workers, bool prefetch) {
+    auto batches = idx_source(images, labels)
+      ->map(standardize, workers)
+      ->shuffle(10000, 1)
+      ->batch(100, 10);
+    return prefetch ? batches->prefetch(4) : batches;
+  };
+
+  std::cout << std::setw(22) << "pipeline"
+    << std::setw(12) << "batches/s"
+    << std::setw(12) << "us/batch" << std::endl;
+
+  DatasetRef<Batch> last;
+  for (bool step : {false, true}) {
+    for (size_t workers : {0, 1, 2, 4}) {
+      for (bool prefetch : {false, true}) {
+        auto batches = pipeline(workers, prefetch);
+        size_t n = 0;
+        Batch batch;
+        auto start = clock::now();
+        // step through a third of the epoch
+        while (n < 200 && batches->next(batch)) {
+          if (step) {
+            X->set_value(batch.x);
+            y->set_value(batch.targets);
+            g->forward({loss});
+            g->backward(loss);
+          }
+          n++;
+        }
+        double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+
+        std::string name = "map " + std::to_string(workers)
+          + (prefetch ? " +prefetch" : "") + (step ? " +step" : "");
+        std::cout << std::setw(22) << name
+          << std::fixed << std::setprecision(0)
+          << std::setw(12) << n / elapsed
+          << std::setprecision(1)
+          << std::setw(12) << elapsed / n * 1e6 << std::endl;
+        last = batches;
+      }
+    }
+  }
+
+  std::cout << std::endl;
+  last->write_stats(std::cout);
+  last.reset();
+
+  for (size_t i = 0; i < shards; ++i) {
+    std::remove(images[i].c_str());
+    std::remove(labels[i].c_str());
+  }
+  std::remove(dir);
+  return 0;
+}
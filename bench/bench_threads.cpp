@@ -0,0 +1,74 @@
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+
+#include "../ndarray.h"
+#include "../ndarray.cpp"
+
+template <class F>
+double seconds_per_call(F fn) {
+  using clock = std::chrono::steady_clock;
+  fn();  // warm up
+
+  size_t iters = 0;
+  auto start = clock::now();
+  double elapsed = 0.0;
+  while (elapsed < 0.5) {
+    fn();
+    ++iters;
+    elapsed = std::chrono::duration<double>(clock::now() - start).count();
+  }
+
+  return elapsed / iters;
+}
+
+int main() {
+  std::vector<size_t> thread_counts = {1, 2, 4, 8, 16};
+
+  NDArray A({100, 784}, random_vec<float>(100 * 784, -1.0f, 1.0f));
+  NDArray W({784, 512}, random_vec<float>(784 * 512, -1.0f, 1.0f));
+  NDArray S({512, 512}, random_vec<float>(512 * 512, -1.0f, 1.0f));
+  NDArray X({1024, 1024}, random_vec<float>(1024 * 1024, -1.0f, 1.0f));
+  NDArray Y({1024, 1024}, random_vec<float>(1024 * 1024, -1.0f, 1.0f));
+  NDArray b({1024}, random_vec<float>(1024, -1.0f, 1.0f));
+  NDArray batched({64, 64, 64}, random_vec<float>(64 * 64 * 64, -1.0f, 1.0f));
+
+  std::vector<std::pair<std::string, std::function<void()>>> ops = {
+    {"mm 100x784x512", [&]() { A.mm(W); }},
+    {"mm 512x512x512", [&]() { S.mm(S); }},
+    {"bmm 64x(64x64x64)", [&]() { batched.bmm(batched); }},
+    {"add_ 1M", [&]() { X.add(Y); }},
+    {"add_ 1M bcast", [&]() { X.add(b); }},
+    {"mul_ 1M", [&]() { X.mul(Y); }},
+    {"exp_ 1M", [&]() { X.exp(); }},
+    {"reduce_sum(1) 1M", [&]() { X.reduce_sum(1, true); }},
+    {"reduce_sum(0) 1M", [&]() { X.reduce_sum(0, true); }},
+    {"transpose 1M", [&]() { X.transpose(); }},
+    {"expand 1M", [&]() { b.expand({1024, 1024}); }},
+  };
+
+  std::cout << std::setw(20) << "op";
+  for (auto t : thread_counts) {
+    std::cout << std::setw(9) << t << "T";
+  }
+  std::cout << "   (ms, speedup vs 1T)" << std::endl;
+
+  for (auto& op : ops) {
+    std::cout << std::setw(20) << op.first;
+
+    double base = 0.0;
+    for (auto t : thread_counts) {
+      ThreadPool::get().set_num_threads(t);
+      double sec = seconds_per_call(op.second);
+      if (t == 1) {
+        base = sec;
+      }
+      std::cout << std::fixed << std::setprecision(2)
+        << std::setw(6) << sec * 1e3
+        << "/" << std::setprecision(1) << std::setw(3) << base / sec;
+    }
+    std::cout << std::endl;
+  }
+
+  return 0;
+}
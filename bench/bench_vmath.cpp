@@ -0,0 +1,78 @@
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+
+#include "../ndarray.h"
+#include "../ndarray.cpp"
+
+// Throughput of the exp/log/recip kernels per instruction set on a single
+// thread, plus the softmax of a large vocabulary head through NDArray
+// (pool sized threads, dispatching to the widest supported kernels).
+
+template <class F>
+double seconds_per_call(F fn) {
+  using clock = std::chrono::steady_clock;
+  fn();  // warm up
+
+  size_t iters = 0;
+  auto start = clock::now();
+  double elapsed = 0.0;
+  while (elapsed < 0.5) {
+    fn();
+    ++iters;
+    elapsed = std::chrono::duration<double>(clock::now() - start).count();
+  }
+
+  return elapsed / iters;
+}
+
+int main() {
+  size_t n = 1 << 16;
+  auto in = random_vec<float>(n, -20.0f, 20.0f);
+  std::vector<float> out(n);
+
+  std::vector<std::pair<std::string, SimdIsa>> isas = {
+    {"scalar", SimdIsa::scalar},
+    {"avx2", SimdIsa::avx2},
+    {"avx512", SimdIsa::avx512},
+  };
+
+  std::vector<std::pair<std::string,
+    void (*)(const float*, float*, size_t, SimdIsa)>> fns = {
+    {"exp", vexp},
+    {"log", vlog},
+    {"recip", vrecip},
+  };
+
+  std::cout << std::setw(10) << "fn";
+  for (auto& isa : isas) {
+    std::cout << std::setw(12) << isa.first;
+  }
+  std::cout << "   (ns/element, 64k elements)" << std::endl;
+
+  for (auto& fn : fns) {
+    std::cout << std::setw(10) << fn.first;
+    for (auto& isa : isas) {
+      if (!simd_supported(isa.second)) {
+        std::cout << std::setw(12) << "-";
+        continue;
+      }
+      double sec = seconds_per_call([&]() {
+          fn.second(in.data(), out.data(), n, isa.second);
+          });
+      std::cout << std::fixed << std::setprecision(3)
+        << std::setw(12) << sec / n * 1e9;
+    }
+    std::cout << std::endl;
+  }
+
+  NDArray logits({64, 10000}, random_vec<float>(64 * 10000, -5.0f, 5.0f));
+  double sec = seconds_per_call([&]() {
+      auto e = logits.sub(logits.reduce_max(1, true)).exp_();
+      e.mul_(e.reduce_sum(1, true).recip_()).log_();
+      });
+  std::cout << std::endl << "log softmax 64x10000: "
+    << std::setprecision(3) << sec * 1e3 << " ms" << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,721 @@
+#ifndef _dataset_h_
+#define _dataset_h_
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <iomanip>
+#include <ostream>
+#include <exception>
+#include <type_traits>
+#include <condition_variable>
+
+#include "idx.h"
+#include "vmath.h"
+#include "ndarray.h"
+
+/*
+ * Pull based streaming input pipelines.
+ *
+ * A pipeline is a chain of stages, each a Dataset<T> which hands out its
+ * elements one at a time from next() and pulls what it needs from the
+ * stage before it, e.g.
+ *
+ *   auto batches = idx_source({"a-images", "b-images"}, {"a-labels", ...})
+ *     ->map(augment, 4)
+ *     ->shuffle(10000)
+ *     ->batch(100, 10)
+ *     ->prefetch(4);
+ *
+ * Nothing is read before it is pulled and every stage holds a bounded
+ * number of elements, so datasets larger than memory stream through:
+ *
+ * - sources: IDXSource walks over IDX files one at a time, VectorSource
+ *   over elements in memory
+ * - map(fn, workers) applies fn on workers threads, in order
+ * - shuffle(n) draws at random from a buffer of the next n elements
+ * - batch(size, classes) copies Samples into the rows of NDArrays
+ * - prefetch(depth) runs the stages before it on a background thread,
+ *   up to depth elements ahead
+ *
+ * A pipeline is consumed from one thread, stages with threads of their
+ * own pull from the stage before them under a lock. Errors raised by
+ * any stage come out of the next() of the last one.
+ *
+ * Every stage counts the elements it handed out and the time it spent on
+ * them itself (without the stages before it), so items / seconds is the
+ * throughput the stage alone could sustain. Threaded stages count the time
+ * their consumer waited for them separately. write_stats() prints the
+ * counters of the whole chain. Times are wall clock, with more threads
+ * than cores they include time a thread was preempted.
+ */
+
+// one element of a labeled dataset
+struct Sample {
+  std::vector<float> x;
+  int label = 0;
+};
+
+// batch_size rows of samples, the last batch of a stream may be smaller
+struct Batch {
+  // batch_size x sample size
+  NDArray x;
+  // batch_size x classes, one-hot, empty without classes
+  NDArray targets;
+  std::vector<int> labels;
+};
+
+template <class T> class Dataset;
+template <class T> using DatasetRef = std::shared_ptr<Dataset<T>>;
+
+class DatasetBase {
+  public:
+    struct Stats {
+      // handed out by next()
+      size_t items = 0;
+      // spent producing them, without the stages before
+      double seconds = 0.0;
+      // the consumer waited on a threaded stage
+      double wait_seconds = 0.0;
+    };
+
+    DatasetBase(const std::string& name, std::shared_ptr<DatasetBase> upstream)
+      : name_(name), upstream_(upstream) { }
+
+    virtual ~DatasetBase() { }
+
+    const std::string& name() const {
+      return name_;
+    }
+
+    Stats stats() const {
+      Stats s;
+      s.items = items_.load();
+      s.seconds = seconds_.load();
+      s.wait_seconds = wait_seconds_.load();
+      return s;
+    }
+
+    // the stage this one pulls from, nullptr for a source
+    std::shared_ptr<DatasetBase> upstream() const {
+      return upstream_;
+    }
+
+    // counters of this stage and all before it, source first
+    void write_stats(std::ostream& os) const {
+      std::vector<const DatasetBase*> chain;
+      for (const DatasetBase* d = this; d != nullptr; d = d->upstream_.get()) {
+        chain.push_back(d);
+      }
+
+      os << std::setw(12) << "stage"
+        << std::setw(12) << "items"
+        << std::setw(14) << "items/s"
+        << std::setw(12) << "busy ms"
+        << std::setw(12) << "wait ms" << std::endl;
+      for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+        Stats s = (*it)->stats();
+        os << std::setw(12) << (*it)->name()
+          << std::setw(12) << s.items
+          << std::fixed << std::setprecision(0)
+          << std::setw(14) << (s.seconds > 0.0 ? s.items / s.seconds : 0.0)
+          << std::setprecision(1)
+          << std::setw(12) << s.seconds * 1e3
+          << std::setw(12) << s.wait_seconds * 1e3 << std::endl;
+      }
+    }
+
+  protected:
+    typedef std::chrono::steady_clock clock;
+
+    static double since(clock::time_point start) {
+      return std::chrono::duration<double>(clock::now() - start).count();
+    }
+
+    // seconds spent in nested next() calls on this thread, see
+    // Dataset::next()
+    static double& nested_seconds() {
+      thread_local double seconds = 0.0;
+      return seconds;
+    }
+
+    // counters may be read from any thread and map workers add to them
+    // concurrently with the consumer
+    static void add(std::atomic<double>& counter, double v) {
+      double old = counter.load(std::memory_order_relaxed);
+      while (!counter.compare_exchange_weak(old, old + v,
+            std::memory_order_relaxed)) { }
+    }
+
+    std::string name_;
+    std::shared_ptr<DatasetBase> upstream_;
+    std::atomic<size_t> items_{0};
+    std::atomic<double> seconds_{0.0};
+    std::atomic<double> wait_seconds_{0.0};
+};
+
+template <class T>
+class Dataset : public DatasetBase,
+    public std::enable_shared_from_this<Dataset<T>> {
+  public:
+    typedef T value_type;
+
+    using DatasetBase::DatasetBase;
+
+    // the next element into out, false once the stream is exhausted
+    bool next(T& out) {
+      double& nested = nested_seconds();
+      double outer = nested;
+      nested = 0.0;
+      waited_ = 0.0;
+
+      auto start = clock::now();
+      bool more;
+      try {
+        more = produce(out);
+      } catch (...) {
+        nested = outer + since(start);
+        throw;
+      }
+      double total = since(start);
+
+      add(seconds_, std::max(total - nested - waited_, 0.0));
+      add(wait_seconds_, waited_);
+      if (more) {
+        items_.store(items_.load(std::memory_order_relaxed) + 1,
+            std::memory_order_relaxed);
+      }
+      nested = outer + total;
+      return more;
+    }
+
+    // fn(T) on workers threads (0 runs it inline), in order
+    template <class F>
+    DatasetRef<typename std::result_of<F(T)>::type> map(F fn,
+        size_t workers = 0);
+
+    // a random element of the next buffer_size ones at a time
+    DatasetRef<T> shuffle(size_t buffer_size,
+        unsigned seed = std::random_device()());
+
+    // runs this stage and the ones before on a background thread
+    DatasetRef<T> prefetch(size_t depth = 2);
+
+    // batches of size samples, with one-hot targets of classes columns
+    // unless classes is 0, only for Dataset<Sample>
+    DatasetRef<Batch> batch(size_t size, size_t classes = 0,
+        bool drop_last = false);
+
+  protected:
+    virtual bool produce(T& out) = 0;
+
+    // for threaded stages: time produce() blocked on other threads, it is
+    // counted as waiting instead of as busy
+    void waited(double seconds) {
+      waited_ += seconds;
+    }
+
+  private:
+    double waited_ = 0.0;
+};
+
+// the elements of a vector, in order
+template <class T>
+class VectorSource : public Dataset<T> {
+  public:
+    explicit VectorSource(std::vector<T> elements)
+      : Dataset<T>("vector", nullptr), elements_(std::move(elements)) { }
+
+  protected:
+    virtual bool produce(T& out) override {
+      if (pos_ == elements_.size()) {
+        return false;
+      }
+      out = elements_[pos_++];
+      return true;
+    }
+
+  private:
+    std::vector<T> elements_;
+    size_t pos_ = 0;
+};
+
+template <class T>
+DatasetRef<T> vector_source(std::vector<T> elements) {
+  return std::make_shared<VectorSource<T>>(std::move(elements));
+}
+
+/*
+ * The samples of pairs of IDX files, one file at a time.
+ *
+ * images[i] and labels[i] hold the same number of items, an item of the
+ * images becomes Sample::x (uint8 values scaled by scale, other types
+ * decoded) and the labels are 1-D. Only the current pair is mapped.
+ * Every pass goes through all files in order, epochs passes are made (0
+ * for an endless stream).
+ */
+class IDXSource : public Dataset<Sample> {
+  public:
+    IDXSource(std::vector<std::string> images, std::vector<std::string> labels,
+        float scale = 1.0f / 255.0f, size_t epochs = 1)
+      : Dataset<Sample>("idx", nullptr), images_(std::move(images)),
+        labels_(std::move(labels)), scale_(scale), epochs_(epochs) {
+      if (images_.size() != labels_.size()) {
+        throw ValueError("IDXSource: " + std::to_string(images_.size())
+            + " image files for " + std::to_string(labels_.size())
+            + " label files");
+      }
+    }
+
+  protected:
+    virtual bool produce(Sample& out) override {
+      while (pos_ == image_file_.items()) {
+        if (!open_next()) {
+          return false;
+        }
+      }
+
+      size_t n = image_file_.item_size();
+      out.x.resize(n);
+      if (image_file_.type() == IDXFile::u8) {
+        vscale_u8(image_file_.item(pos_), out.x.data(), n, scale_);
+      } else {
+        for (size_t j = 0; j < n; ++j) {
+          out.x[j] = static_cast<float>(image_file_.value(pos_ * n + j));
+        }
+      }
+      out.label = static_cast<int>(label_file_.value(pos_));
+      pos_++;
+      return true;
+    }
+
+  private:
+    // false once all epochs are done
+    bool open_next() {
+      if (images_.empty() || (epochs_ > 0 && epoch_ == epochs_)) {
+        return false;
+      }
+
+      image_file_ = IDXFile(images_[file_]);
+      label_file_ = IDXFile(labels_[file_]);
+      if (label_file_.dims().size() != 1
+          || label_file_.items() != image_file_.items()) {
+        throw ValueError(labels_[file_] + ": expected "
+            + std::to_string(image_file_.items()) + " labels, got "
+            + vstr(label_file_.dims()));
+      }
+      pos_ = 0;
+
+      if (++file_ == images_.size()) {
+        file_ = 0;
+        epoch_++;
+      }
+      return true;
+    }
+
+    std::vector<std::string> images_;
+    std::vector<std::string> labels_;
+    float scale_;
+    size_t epochs_;
+
+    // the pair after the current one
+    size_t file_ = 0;
+    size_t epoch_ = 0;
+    IDXFile image_file_;
+    IDXFile label_file_;
+    size_t pos_ = 0;
+};
+
+inline DatasetRef<Sample> idx_source(std::vector<std::string> images,
+    std::vector<std::string> labels, float scale = 1.0f / 255.0f,
+    size_t epochs = 1) {
+  return std::make_shared<IDXSource>(std::move(images), std::move(labels),
+      scale, epochs);
+}
+
+/*
+ * fn over the elements of upstream.
+ *
+ * Without workers fn runs inside next(). Otherwise each worker pulls the
+ * next element (under a lock, so elements are numbered in stream order),
+ * applies fn and files the result under its number, next() hands them
+ * out by number. Workers stay at most 2 * workers elements ahead. An
+ * error is raised by next() once the elements before it are handed out.
+ */
+template <class T, class U>
+class MapStage : public Dataset<U> {
+  public:
+    MapStage(DatasetRef<T> upstream, std::function<U(T)> fn, size_t workers)
+      : Dataset<U>("map", upstream), input_(upstream), fn_(fn),
+        capacity_(2 * workers) {
+      for (size_t i = 0; i < workers; ++i) {
+        threads_.emplace_back([this]() { run(); });
+      }
+    }
+
+    ~MapStage() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+      }
+      cv_.notify_all();
+      for (auto& t : threads_) {
+        t.join();
+      }
+    }
+
+  protected:
+    virtual bool produce(U& out) override {
+      if (threads_.empty()) {
+        T in;
+        if (!input_->next(in)) {
+          return false;
+        }
+        out = fn_(std::move(in));
+        return true;
+      }
+
+      auto start = DatasetBase::clock::now();
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [&]() {
+          return done_.count(next_) || (error_ && next_ == error_seq_)
+            || (end_ && next_ == pulled_);
+        });
+      this->waited(DatasetBase::since(start));
+
+      if (done_.count(next_)) {
+        out = std::move(done_[next_]);
+        done_.erase(next_++);
+        cv_.notify_all();
+        return true;
+      }
+      if (error_ && next_ == error_seq_) {
+        std::rethrow_exception(error_);
+      }
+      return false;
+    }
+
+  private:
+    MapStage(const MapStage&) = delete;
+    const MapStage& operator=(const MapStage&) = delete;
+
+    void run() {
+      while (true) {
+        T in;
+        size_t seq;
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          cv_.wait(lock, [&]() {
+              return stop_ || end_ || pulled_ < next_ + capacity_;
+            });
+          if (stop_ || end_) {
+            return;
+          }
+
+          try {
+            if (!input_->next(in)) {
+              end_ = true;
+              cv_.notify_all();
+              return;
+            }
+          } catch (...) {
+            fail(pulled_);
+            return;
+          }
+          seq = pulled_++;
+        }
+
+        U result;
+        auto start = DatasetBase::clock::now();
+        try {
+          result = fn_(std::move(in));
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(mutex_);
+          fail(seq);
+          return;
+        }
+        double busy = DatasetBase::since(start);
+
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          DatasetBase::add(this->seconds_, busy);
+          done_.emplace(seq, std::move(result));
+        }
+        cv_.notify_all();
+      }
+    }
+
+    // with mutex_ held, the first error in stream order wins
+    void fail(size_t seq) {
+      if (!error_ || seq < error_seq_) {
+        error_ = std::current_exception();
+        error_seq_ = seq;
+      }
+      end_ = true;
+      cv_.notify_all();
+    }
+
+    DatasetRef<T> input_;
+    std::function<U(T)> fn_;
+    size_t capacity_;
+    std::vector<std::thread> threads_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    // finished results by number
+    std::map<size_t, U> done_;
+    // number of the next result handed out and of the next element pulled
+    size_t next_ = 0;
+    size_t pulled_ = 0;
+    bool end_ = false;
+    bool stop_ = false;
+    // raised for element error_seq_
+    std::exception_ptr error_;
+    size_t error_seq_ = 0;
+};
+
+/*
+ * A random element out of a buffer of the next buffer_size elements of
+ * upstream, refilled from upstream one for one. A buffer as large as the
+ * stream is a full shuffle, a smaller one only moves elements by about
+ * buffer_size positions (shuffle the file order as well for those).
+ */
+template <class T>
+class ShuffleStage : public Dataset<T> {
+  public:
+    ShuffleStage(DatasetRef<T> upstream, size_t buffer_size, unsigned seed)
+      : Dataset<T>("shuffle", upstream), input_(upstream),
+        buffer_size_(std::max<size_t>(buffer_size, 1)), engine_(seed) {
+      buffer_.reserve(buffer_size_);
+    }
+
+  protected:
+    virtual bool produce(T& out) override {
+      while (!end_ && buffer_.size() < buffer_size_) {
+        T in;
+        if (!input_->next(in)) {
+          end_ = true;
+          break;
+        }
+        buffer_.push_back(std::move(in));
+      }
+      if (buffer_.empty()) {
+        return false;
+      }
+
+      std::uniform_int_distribution<size_t> dist(0, buffer_.size() - 1);
+      std::swap(buffer_[dist(engine_)], buffer_.back());
+      out = std::move(buffer_.back());
+      buffer_.pop_back();
+      return true;
+    }
+
+  private:
+    DatasetRef<T> input_;
+    size_t buffer_size_;
+    std::mt19937 engine_;
+    std::vector<T> buffer_;
+    bool end_ = false;
+};
+
+// Samples copied straight into the rows of a freshly allocated NDArray
+class BatchStage : public Dataset<Batch> {
+  public:
+    BatchStage(DatasetRef<Sample> upstream, size_t size, size_t classes,
+        bool drop_last)
+      : Dataset<Batch>("batch", upstream), input_(upstream), size_(size),
+        classes_(classes), drop_last_(drop_last) {
+      if (size_ == 0) {
+        throw ValueError("batch size must be positive");
+      }
+    }
+
+  protected:
+    virtual bool produce(Batch& out) override {
+      Sample sample;
+      if (!input_->next(sample)) {
+        return false;
+      }
+
+      size_t dim = sample.x.size();
+      NDArray x({size_, dim});
+      float* rows = x.mutable_data();
+      std::vector<int> labels;
+      labels.reserve(size_);
+
+      size_t n = 0;
+      do {
+        if (sample.x.size() != dim) {
+          throw IncompatibleShapes("batch", {{dim}, {sample.x.size()}});
+        }
+        if (classes_ > 0 && (sample.label < 0
+              || sample.label >= int(classes_))) {
+          throw ValueError("label " + std::to_string(sample.label)
+              + " out of range");
+        }
+        std::copy(sample.x.begin(), sample.x.end(), rows + n * dim);
+        labels.push_back(sample.label);
+        n++;
+      } while (n < size_ && input_->next(sample));
+
+      if (n < size_) {
+        if (drop_last_) {
+          return false;
+        }
+        // the short last batch
+        NDArray rest({n, dim});
+        std::copy(rows, rows + n * dim, rest.mutable_data());
+        x = rest;
+      }
+
+      out.x = x;
+      out.targets = NDArray();
+      if (classes_ > 0) {
+        out.targets = NDArray({n, classes_});
+        float* targets = out.targets.mutable_data();
+        for (size_t i = 0; i < n; ++i) {
+          targets[i * classes_ + labels[i]] = 1.0f;
+        }
+      }
+      out.labels = std::move(labels);
+      return true;
+    }
+
+  private:
+    DatasetRef<Sample> input_;
+    size_t size_;
+    size_t classes_;
+    bool drop_last_;
+};
+
+/*
+ * Up to depth elements of upstream, pulled by a background thread.
+ *
+ * The thread runs the whole chain before this stage, so for a pipeline
+ * ending in prefetch() the consumer only waits if the chain cannot keep
+ * up. The end of the stream and errors are handed out in order after the
+ * elements before them.
+ */
+template <class T>
+class PrefetchStage : public Dataset<T> {
+  public:
+    PrefetchStage(DatasetRef<T> upstream, size_t depth)
+      : Dataset<T>("prefetch", upstream), input_(upstream),
+        depth_(std::max<size_t>(depth, 1)) {
+      thread_ = std::thread([this]() { run(); });
+    }
+
+    ~PrefetchStage() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+      }
+      cv_.notify_all();
+      thread_.join();
+    }
+
+  protected:
+    virtual bool produce(T& out) override {
+      auto start = DatasetBase::clock::now();
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [&]() { return !queue_.empty() || end_; });
+      this->waited(DatasetBase::since(start));
+
+      if (!queue_.empty()) {
+        out = std::move(queue_.front());
+        queue_.pop_front();
+        cv_.notify_all();
+        return true;
+      }
+      if (error_) {
+        std::rethrow_exception(error_);
+      }
+      return false;
+    }
+
+  private:
+    PrefetchStage(const PrefetchStage&) = delete;
+    const PrefetchStage& operator=(const PrefetchStage&) = delete;
+
+    void run() {
+      try {
+        while (true) {
+          {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [&]() { return stop_ || queue_.size() < depth_; });
+            if (stop_) {
+              return;
+            }
+          }
+
+          T element;
+          bool more = input_->next(element);
+
+          std::lock_guard<std::mutex> lock(mutex_);
+          if (!more) {
+            end_ = true;
+            cv_.notify_all();
+            return;
+          }
+          queue_.push_back(std::move(element));
+          cv_.notify_all();
+        }
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        error_ = std::current_exception();
+        end_ = true;
+        cv_.notify_all();
+      }
+    }
+
+    DatasetRef<T> input_;
+    size_t depth_;
+    std::thread thread_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<T> queue_;
+    bool end_ = false;
+    bool stop_ = false;
+    std::exception_ptr error_;
+};
+
+template <class T>
+template <class F>
+DatasetRef<typename std::result_of<F(T)>::type> Dataset<T>::map(F fn,
+    size_t workers) {
+  typedef typename std::result_of<F(T)>::type U;
+  return std::make_shared<MapStage<T, U>>(this->shared_from_this(),
+      std::function<U(T)>(fn), workers);
+}
+
+template <class T>
+DatasetRef<T> Dataset<T>::shuffle(size_t buffer_size, unsigned seed) {
+  return std::make_shared<ShuffleStage<T>>(this->shared_from_this(),
+      buffer_size, seed);
+}
+
+template <class T>
+DatasetRef<T> Dataset<T>::prefetch(size_t depth) {
+  return std::make_shared<PrefetchStage<T>>(this->shared_from_this(), depth);
+}
+
+template <class T>
+DatasetRef<Batch> Dataset<T>::batch(size_t size, size_t classes,
+    bool drop_last) {
+  static_assert(std::is_same<T, Sample>::value,
+      "batch() needs a Dataset<Sample>");
+  return std::make_shared<BatchStage>(this->shared_from_this(), size,
+      classes, drop_last);
+}
+
+#endif // _dataset_h_
@@ -10,15 +10,16 @@
 class Exception : public std::exception {
   public:
     Exception(const std::string& type, const std::string& msg)
-      : type_(type), msg_(msg) { }
+      : type_(type), msg_(msg), what_(type + " => " + msg) { }
 
     virtual const char* what() const throw() {
-      return (type_ + " => " + msg_).c_str();
+      return what_.c_str();
     }
   
   protected:
     std::string type_;
     std::string msg_;
+    std::string what_;
 
 };
 
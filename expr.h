@@ -0,0 +1,383 @@
+#ifndef _expr_h_
+#define _expr_h_
+
+#include <vector>
+#include <cstddef>
+#include <algorithm>
+
+#include "ndarray.h"
+
+/*
+ * Lazy elementwise expressions over NDArrays.
+ *
+ *   auto X = lazy::ref(x);
+ *   auto M = lazy::ref(x.reduce_max(1, true));
+ *   NDArray s = lazy::sum(exp(X - M), 1, true);
+ *   NDArray p = lazy::eval(exp(X - M) / lazy::ref(s));
+ *
+ * The operators only build a tree of small nodes. eval() and the trailing
+ * reductions walk the result row by row (last axis) in blocks of
+ * lazy::block elements, every node computes its block into a buffer of
+ * its own which stays in L1. A chain therefore reads its inputs and writes
+ * its result once no matter how many ops it has, and only the result is
+ * allocated. Operands broadcast like in NDArray::add, exp, log and recip
+ * use the vmath kernels.
+ *
+ * Nodes hold their arrays by value (sharing the storage), an expression
+ * stays valid after the arrays it was built from go out of scope.
+ */
+namespace lazy {
+
+static const size_t block = 256;
+
+// E is the node type, operators take any Expr<E>
+template <class E>
+struct Expr {
+  const E& self() const {
+    return static_cast<const E&>(*this);
+  }
+};
+
+/*
+ * Every node implements:
+ *
+ * - shape(s): broadcasts s with the shapes of its leaves
+ * - bind(shape): prepares to produce shape
+ * - row(r): moves to row r of the result
+ * - eval(j, n): pointer to elements [j, j + n) of the row, n <= block,
+ *   valid until the next call
+ */
+
+class Ref : public Expr<Ref> {
+  public:
+    explicit Ref(const NDArray& array) : array_(array) { }
+
+    void shape(std::vector<size_t>& s) const {
+      auto common = NDArray::common_shape(s, array_.shape());
+      if (common.empty()) {
+        throw IncompatibleShapes("lazy expression", {s, array_.shape()});
+      }
+      s = common;
+    }
+
+    void bind(const std::vector<size_t>& shape) {
+      view_ = array_.expand(shape);
+      base_ = view_.data();
+      stride_ = view_.strides().back();
+      row_ = base_;
+    }
+
+    void row(size_t r) {
+      const auto& shape = view_.shape();
+      const auto& strides = view_.strides();
+
+      size_t offset = 0;
+      for (size_t i = shape.size() - 1; i > 0; --i) {
+        offset += (r % shape[i - 1]) * strides[i - 1];
+        r /= shape[i - 1];
+      }
+
+      bool moved = row_ != base_ + offset;
+      row_ = base_ + offset;
+
+      if (stride_ == 0 && (moved || !filled_)) {
+        std::fill(buf_, buf_ + block, *row_);
+        filled_ = true;
+      }
+    }
+
+    const float* eval(size_t j, size_t n) {
+      if (stride_ == 1) {
+        return row_ + j;
+      }
+      if (stride_ != 0) {
+        for (size_t k = 0; k < n; ++k) {
+          buf_[k] = row_[(j + k) * stride_];
+        }
+      }
+      return buf_;
+    }
+
+  private:
+    NDArray array_;
+    NDArray view_;
+    const float* base_ = nullptr;
+    const float* row_ = nullptr;
+    size_t stride_ = 1;
+    bool filled_ = false;
+    float buf_[block];
+};
+
+class Scalar : public Expr<Scalar> {
+  public:
+    explicit Scalar(float value) : value_(value) { }
+
+    void shape(std::vector<size_t>&) const { }
+
+    void bind(const std::vector<size_t>&) {
+      std::fill(buf_, buf_ + block, value_);
+    }
+
+    void row(size_t) { }
+
+    const float* eval(size_t, size_t) {
+      return buf_;
+    }
+
+  private:
+    float value_;
+    float buf_[block];
+};
+
+template <class Op, class A>
+class Unary : public Expr<Unary<Op, A>> {
+  public:
+    explicit Unary(const A& a) : a_(a) { }
+
+    void shape(std::vector<size_t>& s) const {
+      a_.shape(s);
+    }
+
+    void bind(const std::vector<size_t>& shape) {
+      a_.bind(shape);
+    }
+
+    void row(size_t r) {
+      a_.row(r);
+    }
+
+    const float* eval(size_t j, size_t n) {
+      Op::apply(a_.eval(j, n), buf_, n);
+      return buf_;
+    }
+
+  private:
+    A a_;
+    float buf_[block];
+};
+
+template <class Op, class A, class B>
+class Binary : public Expr<Binary<Op, A, B>> {
+  public:
+    Binary(const A& a, const B& b) : a_(a), b_(b) { }
+
+    void shape(std::vector<size_t>& s) const {
+      a_.shape(s);
+      b_.shape(s);
+    }
+
+    void bind(const std::vector<size_t>& shape) {
+      a_.bind(shape);
+      b_.bind(shape);
+    }
+
+    void row(size_t r) {
+      a_.row(r);
+      b_.row(r);
+    }
+
+    const float* eval(size_t j, size_t n) {
+      const float* x = a_.eval(j, n);
+      const float* y = b_.eval(j, n);
+      Op op;
+      for (size_t k = 0; k < n; ++k) {
+        buf_[k] = op(x[k], y[k]);
+      }
+      return buf_;
+    }
+
+  private:
+    A a_;
+    B b_;
+    float buf_[block];
+};
+
+struct Exp {
+  static void apply(const float* x, float* out, size_t n) {
+    vexp(x, out, n);
+  }
+};
+
+struct Log {
+  static void apply(const float* x, float* out, size_t n) {
+    vlog(x, out, n);
+  }
+};
+
+struct Recip {
+  static void apply(const float* x, float* out, size_t n) {
+    vrecip(x, out, n);
+  }
+};
+
+struct Neg {
+  static void apply(const float* x, float* out, size_t n) {
+    for (size_t k = 0; k < n; ++k) {
+      out[k] = -x[k];
+    }
+  }
+};
+
+struct Add {
+  float operator()(float a, float b) const { return a + b; }
+};
+
+struct Sub {
+  float operator()(float a, float b) const { return a - b; }
+};
+
+struct Mul {
+  float operator()(float a, float b) const { return a * b; }
+};
+
+struct Div {
+  float operator()(float a, float b) const { return a / b; }
+};
+
+inline Ref ref(const NDArray& array) {
+  return Ref(array);
+}
+
+#define UFLOW_LAZY_UNARY(name, Op)                       \
+  template <class A>                                     \
+  Unary<Op, A> name(const Expr<A>& a) {                  \
+    return Unary<Op, A>(a.self());                       \
+  }
+
+UFLOW_LAZY_UNARY(exp, Exp)
+UFLOW_LAZY_UNARY(log, Log)
+UFLOW_LAZY_UNARY(recip, Recip)
+UFLOW_LAZY_UNARY(operator-, Neg)
+
+#undef UFLOW_LAZY_UNARY
+
+#define UFLOW_LAZY_BINARY(name, Op)                              \
+  template <class A, class B>                                    \
+  Binary<Op, A, B> name(const Expr<A>& a, const Expr<B>& b) {    \
+    return Binary<Op, A, B>(a.self(), b.self());                 \
+  }                                                              \
+  template <class A>                                             \
+  Binary<Op, A, Scalar> name(const Expr<A>& a, float b) {        \
+    return Binary<Op, A, Scalar>(a.self(), Scalar(b));           \
+  }                                                              \
+  template <class B>                                             \
+  Binary<Op, Scalar, B> name(float a, const Expr<B>& b) {        \
+    return Binary<Op, Scalar, B>(Scalar(a), b.self());           \
+  }
+
+UFLOW_LAZY_BINARY(operator+, Add)
+UFLOW_LAZY_BINARY(operator-, Sub)
+UFLOW_LAZY_BINARY(operator*, Mul)
+UFLOW_LAZY_BINARY(operator/, Div)
+
+#undef UFLOW_LAZY_BINARY
+
+template <class E>
+std::vector<size_t> bind_(E& e) {
+  std::vector<size_t> shape;
+  e.shape(shape);
+  if (shape.empty()) {
+    throw ValueError("lazy expression without arrays");
+  }
+
+  e.bind(shape);
+  return shape;
+}
+
+// fn(node, r) for every row of the result, each thread works on a copy of
+// the expression (and its buffers)
+template <class E, class F>
+void for_each_row_(const E& e, size_t rows, size_t inner, const F& fn) {
+  size_t grain = std::max<size_t>(1, parallel_grain / inner);
+  parallel_for(0, rows, grain, [&](size_t r0, size_t r1) {
+    E local = e;
+    for (size_t r = r0; r < r1; ++r) {
+      local.row(r);
+      fn(local, r);
+    }
+  });
+}
+
+template <class E>
+NDArray eval(const Expr<E>& expr) {
+  E e = expr.self();
+  auto shape = bind_(e);
+
+  NDArray res(shape);
+  size_t inner = shape.back();
+  if (res.size() == 0) {
+    return res;
+  }
+
+  float* out = res.mutable_data();
+  for_each_row_(e, res.size() / inner, inner, [&](E& node, size_t r) {
+    float* row = out + r * inner;
+    for (size_t j = 0; j < inner; j += block) {
+      size_t n = std::min(block, inner - j);
+      const float* x = node.eval(j, n);
+      std::copy(x, x + n, row + j);
+    }
+  });
+
+  return res;
+}
+
+// like NDArray::reduce applied to eval(expr), fused for the last axis and
+// for axis -1 (all elements)
+template <class E, class Op>
+NDArray reduce(const Expr<E>& expr, const Op& op, int axis, bool keep_dims,
+    float init) {
+  E e = expr.self();
+  auto shape = bind_(e);
+
+  int last = shape.size() - 1;
+  size_t inner = shape.back();
+  size_t size = 1;
+  for (auto dim : shape) {
+    size *= dim;
+  }
+  if ((axis != -1 && axis != last) || size == 0) {
+    return eval(expr).reduce(op, axis, keep_dims, init);
+  }
+
+  size_t rows = size / inner;
+  std::vector<float> folded(rows);
+  for_each_row_(e, rows, inner, [&](E& node, size_t r) {
+    float acc = init;
+    for (size_t j = 0; j < inner; j += block) {
+      size_t n = std::min(block, inner - j);
+      acc = op(acc, reduce_span(op, node.eval(j, n), n, init));
+    }
+    folded[r] = acc;
+  });
+
+  if (axis == -1) {
+    std::fill(shape.begin(), shape.end(), 1);
+    NDArray res(keep_dims ? shape : std::vector<size_t>{1});
+    res.mutable_data()[0] = reduce_span(op, folded.data(), rows, init);
+    return res;
+  }
+
+  if (keep_dims) {
+    shape.back() = 1;
+  } else {
+    shape.pop_back();
+  }
+  return NDArray(shape.empty() ? std::vector<size_t>{1} : shape, folded);
+}
+
+template <class E>
+NDArray sum(const Expr<E>& expr, int axis = -1, bool keep_dims = false) {
+  return reduce(expr, Add(), axis, keep_dims, 0.0f);
+}
+
+template <class E>
+NDArray max(const Expr<E>& expr, int axis = -1, bool keep_dims = false) {
+  return reduce(expr, [](float a, float b) {
+      return a > b ? a : b;
+      }, axis, keep_dims, -std::numeric_limits<float>::infinity());
+}
+
+} // namespace lazy
+
+#endif // _expr_h_
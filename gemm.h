@@ -0,0 +1,259 @@
+#ifndef _gemm_h_
+#define _gemm_h_
+
+#include <deque>
+#include <vector>
+#include <cstddef>
+#include <utility>
+#include <algorithm>
+
+#include "thread_pool.h"
+
+/*
+ * Cache blocked single precision matrix multiply: C += op(A) * op(B)
+ *
+ * op(A)=(m, k), op(B)=(k, n), C=(m, n), all row major with leading
+ * dimensions lda, ldb, ldc. op(X) is either X or X^T depending on the
+ * trans_a/trans_b flags (BLAS style): a transposed operand is read in its
+ * stored layout while packing, so callers never materialize X^T.
+ *
+ * The loop structure follows the usual Goto/BLIS layout:
+ *
+ * - B is split into KC x NC blocks and packed into NR wide column panels
+ *   which stay resident in L2 (and partially L3) while we sweep over A.
+ * - A is split into MC x KC blocks and packed into MR high row panels,
+ *   one panel fits into L1 next to the active B panel.
+ * - The micro kernel computes an MR x NR tile of C entirely in registers,
+ *   streaming both packed panels with unit stride.
+ *
+ * Panels are zero padded to full MR/NR, so only the final write back of
+ * edge tiles has to care about odd shapes.
+ *
+ * Packing runs on the calling thread, the micro kernel sweep over the
+ * tiles of a packed block is split across the intra-op thread pool.
+ *
+ * An optional epilogue (e.g. bias and activation) is applied to each tile
+ * of C right after its last update, so it costs no extra pass over C.
+ */
+
+#if defined(__AVX512F__)
+static const size_t gemm_mr = 8;
+static const size_t gemm_nr = 32;
+#elif defined(__AVX__)
+static const size_t gemm_mr = 6;
+static const size_t gemm_nr = 16;
+#else
+static const size_t gemm_mr = 4;
+static const size_t gemm_nr = 8;
+#endif
+
+static const size_t gemm_mc = 96;
+static const size_t gemm_kc = 256;
+static const size_t gemm_nc = 4096;
+
+// minimum number of flops per thread when splitting a block between threads
+static const size_t gemm_par_flops = 1 << 18;
+
+// A points at op(A)[0, 0] of the block
+inline void gemm_pack_a(bool trans_a, size_t mc, size_t kc,
+    const float* A, size_t lda, float* buf) {
+  // distance between op(A)[i, p] and op(A)[i + 1, p] / op(A)[i, p + 1]
+  size_t rs = trans_a ? 1 : lda;
+  size_t cs = trans_a ? lda : 1;
+
+  for (size_t ir = 0; ir < mc; ir += gemm_mr) {
+    size_t mr = std::min(gemm_mr, mc - ir);
+    for (size_t p = 0; p < kc; ++p) {
+      const float* A_p = &A[ir * rs + p * cs];
+      for (size_t i = 0; i < mr; ++i) {
+        buf[i] = A_p[i * rs];
+      }
+      for (size_t i = mr; i < gemm_mr; ++i) {
+        buf[i] = 0.0f;
+      }
+      buf += gemm_mr;
+    }
+  }
+}
+
+// B points at op(B)[0, 0] of the block
+inline void gemm_pack_b(bool trans_b, size_t kc, size_t nc,
+    const float* B, size_t ldb, float* buf) {
+  // distance between op(B)[p, j] and op(B)[p + 1, j] / op(B)[p, j + 1]
+  size_t rs = trans_b ? 1 : ldb;
+  size_t cs = trans_b ? ldb : 1;
+
+  for (size_t jr = 0; jr < nc; jr += gemm_nr) {
+    size_t nr = std::min(gemm_nr, nc - jr);
+    for (size_t p = 0; p < kc; ++p) {
+      const float* B_p = &B[p * rs + jr * cs];
+      for (size_t j = 0; j < nr; ++j) {
+        buf[j] = B_p[j * cs];
+      }
+      for (size_t j = nr; j < gemm_nr; ++j) {
+        buf[j] = 0.0f;
+      }
+      buf += gemm_nr;
+    }
+  }
+}
+
+// C[0:mr, 0:nr] += Ap * Bp where Ap is an MR x kc and Bp a kc x NR panel
+inline void gemm_micro_kernel(size_t kc, const float* __restrict Ap,
+    const float* __restrict Bp, float* C, size_t ldc, size_t mr, size_t nr) {
+  float acc[gemm_mr][gemm_nr] = {};
+
+  for (size_t p = 0; p < kc; ++p) {
+    const float* a = &Ap[p * gemm_mr];
+    const float* b = &Bp[p * gemm_nr];
+    for (size_t i = 0; i < gemm_mr; ++i) {
+      float a_i = a[i];
+      for (size_t j = 0; j < gemm_nr; ++j) {
+        acc[i][j] += a_i * b[j];
+      }
+    }
+  }
+
+  if (mr == gemm_mr && nr == gemm_nr) {
+    for (size_t i = 0; i < gemm_mr; ++i) {
+      for (size_t j = 0; j < gemm_nr; ++j) {
+        C[i * ldc + j] += acc[i][j];
+      }
+    }
+  } else {
+    for (size_t i = 0; i < mr; ++i) {
+      for (size_t j = 0; j < nr; ++j) {
+        C[i * ldc + j] += acc[i][j];
+      }
+    }
+  }
+}
+
+/*
+ * Packing buffers of the sgemm() calls in flight on this thread.
+ *
+ * A thread waiting on the chunks of its sgemm() helps with queued work,
+ * which may start another sgemm() on the same thread (a graph node or a
+ * chunk of a parallel bmm) while the chunks of the first one still read
+ * its packed panels on other threads. Every call takes the next level of
+ * a per thread stack instead, so nested calls never share buffers, and
+ * the levels are kept for reuse.
+ */
+class GemmBuffers {
+  public:
+    GemmBuffers() : level_(depth()++) {
+      auto& stack = levels();
+      if (stack.size() <= level_) {
+        stack.resize(level_ + 1);
+      }
+    }
+
+    ~GemmBuffers() {
+      depth()--;
+    }
+
+    // packed A and B of this call, references stay valid until it returns
+    std::vector<float>& a() {
+      return levels()[level_].first;
+    }
+
+    std::vector<float>& b() {
+      return levels()[level_].second;
+    }
+
+  private:
+    GemmBuffers(const GemmBuffers&) = delete;
+    const GemmBuffers& operator=(const GemmBuffers&) = delete;
+
+    // a deque, growing it does not move the buffers of outer calls
+    static std::deque<std::pair<std::vector<float>, std::vector<float>>>&
+    levels() {
+      thread_local std::deque<std::pair<std::vector<float>,
+        std::vector<float>>> stack;
+      return stack;
+    }
+
+    static size_t& depth() {
+      thread_local size_t depth = 0;
+      return depth;
+    }
+
+    size_t level_;
+};
+
+// epilogue(C_tile, ldc, i, j, mr, nr) is called once for every finished
+// mr x nr tile of C starting at C[i, j], while the tile is still in cache
+struct GemmNoEpilogue {
+  void operator()(float*, size_t, size_t, size_t, size_t, size_t) const { }
+};
+
+template <class Epilogue = GemmNoEpilogue>
+inline void sgemm(bool trans_a, bool trans_b, size_t m, size_t n, size_t k,
+    const float* A, size_t lda,
+    const float* B, size_t ldb,
+    float* C, size_t ldc,
+    const Epilogue& epilogue = Epilogue()) {
+  if (m == 0 || n == 0) {
+    return;
+  }
+  if (k == 0) {
+    epilogue(C, ldc, 0, 0, m, n);
+    return;
+  }
+
+  // packing buffers of this call, reused by later ones
+  GemmBuffers buffers;
+  std::vector<float>& a_buf = buffers.a();
+  std::vector<float>& b_buf = buffers.b();
+
+  size_t mc_max = std::min(gemm_mc, m);
+  size_t kc_max = std::min(gemm_kc, k);
+  size_t nc_max = std::min(gemm_nc, n);
+  a_buf.resize(((mc_max + gemm_mr - 1) / gemm_mr) * gemm_mr * kc_max);
+  b_buf.resize(((nc_max + gemm_nr - 1) / gemm_nr) * gemm_nr * kc_max);
+
+  for (size_t jc = 0; jc < n; jc += gemm_nc) {
+    size_t nc = std::min(gemm_nc, n - jc);
+
+    for (size_t pc = 0; pc < k; pc += gemm_kc) {
+      size_t kc = std::min(gemm_kc, k - pc);
+      bool last = pc + kc == k;
+      const float* B_block = trans_b ? &B[jc * ldb + pc] : &B[pc * ldb + jc];
+      gemm_pack_b(trans_b, kc, nc, B_block, ldb, b_buf.data());
+
+      for (size_t ic = 0; ic < m; ic += gemm_mc) {
+        size_t mc = std::min(gemm_mc, m - ic);
+        const float* A_block = trans_a ? &A[pc * lda + ic] : &A[ic * lda + pc];
+        gemm_pack_a(trans_a, mc, kc, A_block, lda, a_buf.data());
+
+        // the MR x NR tiles of this block are independent, split them
+        // between threads so that consecutive tiles share a B panel
+        size_t m_tiles = (mc + gemm_mr - 1) / gemm_mr;
+        size_t n_tiles = (nc + gemm_nr - 1) / gemm_nr;
+        size_t grain = std::max<size_t>(1,
+            gemm_par_flops / (2 * kc * gemm_mr * gemm_nr));
+        // the buffers belong to this thread, hand workers the pointers
+        const float* Ap = a_buf.data();
+        const float* Bp = b_buf.data();
+
+        parallel_for(0, m_tiles * n_tiles, grain, [&](size_t t0, size_t t1) {
+          for (size_t t = t0; t < t1; ++t) {
+            size_t ir = (t % m_tiles) * gemm_mr;
+            size_t jr = (t / m_tiles) * gemm_nr;
+            size_t mr = std::min(gemm_mr, mc - ir);
+            size_t nr = std::min(gemm_nr, nc - jr);
+
+            float* C_tile = &C[(ic + ir) * ldc + jc + jr];
+            gemm_micro_kernel(kc, &Ap[ir * kc], &Bp[jr * kc],
+                C_tile, ldc, mr, nr);
+            if (last) {
+              epilogue(C_tile, ldc, ic + ir, jc + jr, mr, nr);
+            }
+          }
+        });
+      }
+    }
+  }
+}
+
+#endif // _gemm_h_
@@ -1,10 +1,20 @@
 #include <queue>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <condition_variable>
 #include <string>
 
 #include "util.h"
 #include "graph.h"
 #include "kernel.h"
 
+const size_t Node::no_id;
+const size_t Graph::no_offset;
+
 Node::~Node() {}
 
 NodeRef Node::ref() {
@@ -23,6 +33,10 @@ std::string Node::str() const {
   return "node";
 }
 
+size_t Node::id() const {
+  return id_;
+}
+
 Node::Node(GraphRef graph) 
   : graph_(graph) { }
 
@@ -170,6 +184,10 @@ void Variable::set_value(const NDArray& value) {
   kernel_->set_value(value);
 }
 
+float* Variable::mutable_data() {
+  return kernel_->mutable_data();
+}
+
 std::string Variable::str() const {
   return "var: {\n" + kernel_->str() + "\n}";
 }
@@ -186,113 +204,839 @@ bool Variable::requires_grad() const {
 void Graph::add(NodeRef node) {
   auto& inputs = node->kernel()->get_inputs();
   for (auto& input_node : inputs) {
-    adj_[input_node].push_back(node);
+    register_node(input_node);
   }
+
+  size_t id = register_node(node);
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    consumers_[inputs[i]->id()].push_back(Edge{id, i});
+  }
+
+  compiled_ = false;
 }
 
-void Graph::forward() {
-  std::unordered_map<NodeRef, int> input_cnt;
+size_t Graph::register_node(const NodeRef& node) {
+  if (node->id_ == Node::no_id) {
+    node->id_ = nodes_.size();
+    nodes_.push_back(node);
+    // the node owns its kernel and nodes_ owns the node
+    kernels_.push_back(node->kernel().get());
+    consumers_.emplace_back();
+  }
 
-  for (const auto& item : adj_) {
-    const auto& node = item.first;
-    input_cnt[node] = 0;
+  return node->id_;
+}
+
+bool Graph::owns(const NodeRef& node) const {
+  return node && node->id_ < nodes_.size() && nodes_[node->id_] == node;
+}
+
+void Graph::compile() {
+  size_t n = nodes_.size();
+
+  requested_.assign(n, false);
+  for (auto u : outputs_) {
+    requested_[u] = true;
   }
+  checkpoints_.resize(n, false);
 
-  for (const auto& item : adj_) {
-    const auto& suc_u = item.second;
+  unfuse();
+  if (fusion_) {
+    fuse();
+  }
 
-    for (const auto& v : suc_u) {
-      input_cnt[v]++;
+  // everything the outputs depend on
+  scheduled_.assign(n, outputs_.empty());
+  std::vector<size_t> stack(outputs_);
+  for (auto u : outputs_) {
+    scheduled_[u] = true;
+  }
+  while (!stack.empty()) {
+    size_t u = stack.back();
+    stack.pop_back();
+    for (const auto& input : kernels_[u]->get_inputs()) {
+      if (!scheduled_[input->id()]) {
+        scheduled_[input->id()] = true;
+        stack.push_back(input->id());
+      }
     }
   }
 
-  std::queue<NodeRef> q;
+  edges_.assign(n, {});
+  std::vector<size_t> input_cnt(n, 0);
+  size_t active = 0;
 
-  for (const auto& item : input_cnt) {
-    const auto& node = item.first;
-    int node_in_cnt = item.second;
+  for (size_t u = 0; u < n; ++u) {
+    if (folded_[u]) {
+      scheduled_[u] = false;
+    }
+    if (!scheduled_[u]) {
+      continue;
+    }
+    active++;
+    const auto& inputs = kernels_[u]->get_inputs();
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      edges_[inputs[i]->id()].push_back(Edge{u, i});
+      input_cnt[u]++;
+    }
+  }
+
+  std::queue<size_t> q;
 
-    if (node_in_cnt == 0) {
-      q.push(node);
+  for (size_t u = 0; u < n; ++u) {
+    if (scheduled_[u] && input_cnt[u] == 0) {
+      q.push(u);
     }
   }
 
-  top_order_.clear();
-  int count = 0;
+  plan_.clear();
+  plan_.reserve(active);
 
   while (!q.empty()) {
-    auto node = q.front();
+    size_t u = q.front();
     q.pop();
-    top_order_.push_back(node);
+    plan_.push_back(u);
 
-    for (const auto& u : adj_[node]) {
-      if (--input_cnt[u] == 0) {
-        q.push(u);
+    for (const auto& e : edges_[u]) {
+      if (--input_cnt[e.node] == 0) {
+        q.push(e.node);
       }
     }
-
-    count++;
   }
 
-  if (count != adj_.size()) {
+  if (plan_.size() != active) {
     throw RuntimeError("graph contains cycle");
   }
 
-  for (const auto& node : top_order_) {
-    node->kernel()->forward();
+  size_t m = plan_.size();
+  std::vector<size_t>& pos = positions_;
+  pos.assign(n, 0);
+  for (size_t p = 0; p < m; ++p) {
+    pos[plan_[p]] = p;
+  }
+
+  // leaves hold inputs and parameters, sinks and outputs are the results
+  releases_.assign(2 * m, {});
+  forward_releases_.assign(m, {});
+  for (auto u : plan_) {
+    if (kernels_[u]->get_inputs().empty() || edges_[u].empty() ||
+        requested_[u]) {
+      continue;
+    }
+
+    size_t last_forward = 0;
+    size_t last = 0;
+    for (const auto& e : edges_[u]) {
+      last_forward = std::max(last_forward, pos[e.node]);
+      if (kernels_[e.node]->backward_reads_inputs()) {
+        last = std::max(last, 2 * m - 1 - pos[e.node]);
+      }
+    }
+    if (checkpoints_[u]) {
+      // the segment after it is recomputed from its value
+      last = std::max(last, 2 * m - 1 - pos[u]);
+    }
+    releases_[std::max(last, last_forward)].push_back(u);
+    forward_releases_[last_forward].push_back(u);
+  }
+
+  // a segment ends with its checkpoint, the values of its other nodes
+  // are dropped by forward() and recomputed by backward()
+  checkpointing_ = false;
+  for (auto u : plan_) {
+    checkpointing_ = checkpointing_ || checkpoints_[u];
+  }
+  segment_begin_.assign(1, 0);
+  segment_.assign(n, 0);
+  interior_.assign(n, false);
+  for (size_t p = 0; p < m; ++p) {
+    size_t u = plan_[p];
+    segment_[u] = segment_begin_.size() - 1;
+    interior_[u] = checkpointing_ && !checkpoints_[u] &&
+      !kernels_[u]->get_inputs().empty() && !edges_[u].empty() &&
+      !requested_[u];
+    if (checkpoints_[u]) {
+      segment_begin_.push_back(p + 1);
+    }
+  }
+  segment_begin_.push_back(m);
+
+  arena_.reset();
+  cached_ = false;
+  compiled_ = true;
+}
+
+void Graph::fuse() {
+  for (size_t u = 0; u < nodes_.size(); ++u) {
+    // mm feeding only the left side of an add
+    if (!dynamic_cast<MatMulKernel*>(kernels_[u]) || requested_[u] ||
+        checkpoints_[u] || consumers_[u].size() != 1 ||
+        consumers_[u][0].input != 0) {
+      continue;
+    }
+    size_t add = consumers_[u][0].node;
+    if (!dynamic_cast<AddKernel*>(kernels_[add])) {
+      continue;
+    }
+
+    // and the add feeding only a relu
+    size_t last = add;
+    bool relu = consumers_[add].size() == 1 && !requested_[add] &&
+      !checkpoints_[add] &&
+      dynamic_cast<ReLUKernel*>(kernels_[consumers_[add][0].node]);
+    if (relu) {
+      last = consumers_[add][0].node;
+      folded_[add] = true;
+    }
+    folded_[u] = true;
+
+    std::vector<NodeRef> inputs = kernels_[u]->get_inputs();
+    inputs.push_back(kernels_[add]->get_inputs()[1]);
+    auto kernel = std::make_shared<LinearKernel>(relu);
+    kernel->set_inputs(inputs);
+
+    auto op = std::static_pointer_cast<Op>(nodes_[last]);
+    fusions_.push_back(Fusion{last, op->kernel()});
+    op->set_kernel(kernel);
+    kernels_[last] = kernel.get();
+  }
+}
+
+void Graph::unfuse() {
+  for (const auto& f : fusions_) {
+    std::static_pointer_cast<Op>(nodes_[f.node])->set_kernel(f.original);
+    kernels_[f.node] = f.original.get();
+  }
+
+  fusions_.clear();
+  folded_.assign(nodes_.size(), false);
+}
+
+template <class F>
+void Graph::profiled(size_t u, Profiler::Pass pass, const F& fn) {
+  auto kernel = kernels_[u];
+  if (!profiling_ || kernel->get_inputs().empty()) {
+    fn();
+    return;
+  }
+
+  Profiler::Event event;
+  event.node = u;
+  event.name = kernel->name() + " #" + std::to_string(u);
+  event.pass = pass;
+  size_t allocated = allocated_bytes();
+  event.start = profiler_.now();
+  fn();
+  event.duration = profiler_.now() - event.start;
+  event.bytes = allocated_bytes() - allocated;
+
+  // backward() may run after the inputs are gone, estimate it up front
+  if (pass == Profiler::Pass::backward) {
+    event.flops = backward_flops_[u];
+    event.shape = shapes_[u];
+  } else {
+    event.flops = kernel->flops(false);
+    event.shape = kernel->get_value().shape();
+    backward_flops_[u] = kernel->flops(true);
+    shapes_[u] = event.shape;
+  }
+
+  profiler_.record(std::move(event));
+}
+
+void Graph::forward(const std::vector<NodeRef>& outputs) {
+  std::vector<size_t> ids;
+  for (const auto& node : outputs) {
+    if (!owns(node)) {
+      throw RuntimeError("cannot compute unknown node");
+    }
+    ids.push_back(node->id());
+  }
+  std::sort(ids.begin(), ids.end());
+  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+  if (ids != outputs_) {
+    outputs_ = ids;
+    compiled_ = false;
+  }
+
+  if (!compiled_) {
+    compile();
+  }
+
+  if (planning_) {
+    arena_.begin_step();
+  }
+
+  if (planning_ || inference_) {
+    if (!inference_) {
+      gradients_.clear();
+    }
+    for (auto kernel : kernels_) {
+      if (planning_ && !kernel->get_inputs().empty()) {
+        kernel->release_value();
+      }
+      if (!inference_) {
+        kernel->clear_gradients();
+      }
+      kernel->release_saved();
+    }
+  }
+
+  mark_dirty();
+  if (profiling_) {
+    backward_flops_.resize(nodes_.size(), 0);
+    shapes_.resize(nodes_.size());
+  }
+
+  MemoryArena::Scope scope(planning_ ? &arena_ : MemoryArena::current());
+
+  if (inter_op()) {
+    forward_inter_op();
+  } else {
+    bool drop = checkpointing_ && !inference_;
+    for (size_t p = 0; p < plan_.size(); ++p) {
+      size_t u = plan_[p];
+      auto kernel = kernels_[u];
+      if (run_[u]) {
+        kernel->set_training(!inference_);
+        profiled(u, Profiler::Pass::forward, [&]() { kernel->forward(); });
+        if (drop && interior_[u]) {
+          kernel->release_saved();
+        }
+      }
+      if (planning_ || inference_) {
+        release_values(p);
+      }
+      if (drop) {
+        for (auto v : forward_releases_[p]) {
+          if (interior_[v]) {
+            kernels_[v]->release_value();
+          }
+        }
+      }
+    }
+  }
+
+  checkpoint_stats_ = CheckpointStats();
+  for (auto u : plan_) {
+    checkpoint_stats_.forward_nodes += run_[u];
+    if (!kernels_[u]->get_inputs().empty()) {
+      checkpoint_stats_.kept_bytes +=
+        kernels_[u]->get_value().size() * sizeof(float);
+    }
+  }
+}
+
+void Graph::mark_dirty() {
+  size_t n = nodes_.size();
+  bool all = !incremental_ || planning_ || !cached_;
+
+  versions_.resize(n, 0);
+  dirty_.assign(n, all);
+  run_.assign(n, all);
+
+  for (auto u : plan_) {
+    auto kernel = kernels_[u];
+    if (kernel->get_inputs().empty()) {
+      dirty_[u] = dirty_[u] || kernel->version() != versions_[u];
+      versions_[u] = kernel->version();
+    }
+    for (const auto& input : kernel->get_inputs()) {
+      dirty_[u] = dirty_[u] || dirty_[input->id()];
+    }
+  }
+
+  // dropped values are recomputed if a result or a running node needs them
+  for (size_t p = plan_.size(); p != 0; --p) {
+    size_t u = plan_[p - 1];
+    if (run_[u] || kernels_[u]->get_inputs().empty()) {
+      continue;
+    }
+
+    bool needed = edges_[u].empty() || requested_[u];
+    for (const auto& e : edges_[u]) {
+      needed = needed || run_[e.node];
+    }
+    run_[u] = dirty_[u] || (needed && kernels_[u]->get_value().size() == 0);
+  }
+
+  cached_ = !planning_;
+}
+
+void Graph::release_values(size_t t) {
+  for (auto u : inference_ ? forward_releases_[t] : releases_[t]) {
+    // clean values in inference mode stay for the next forward()
+    if (!inference_ || dirty_[u]) {
+      kernels_[u]->release_value();
+    }
   }
 }
  
 
+namespace {
+
+const NDArray& seed_grad() {
+  // outlives every step, so never from an arena
+  MemoryArena::Scope heap(nullptr);
+  static const NDArray seed({1}, {1});
+  return seed;
+}
+
+} // namespace
+
 void Graph::backward(NodeRef node) {
-  gradients_.clear();
- 
-  size_t i = top_order_.size();
-  for (; i != 0; --i) {
-    if (top_order_[i-1] == node) break;
+  if (inference_) {
+    throw RuntimeError("cannot backprop in inference mode");
   }
 
-  if (i == 0) {
+  if (!compiled_) {
+    compile();
+  }
+
+  if (!owns(node)) {
     throw RuntimeError("cannot backprop from unknown node");
   }
+  if (folded_[node->id()]) {
+    throw RuntimeError("cannot backprop from a node folded by fusion");
+  }
+  if (!scheduled_[node->id()]) {
+    throw RuntimeError("cannot backprop from a node pruned from the plan");
+  }
+
+  // only once the root is valid, a failed call keeps the last gradients
+  gradients_.assign(nodes_.size(), NDArray());
+  if (flat_gradients_.size() != 0) {
+    float* grads = flat_gradients_.shared_data();
+    parallel_for(0, flat_gradients_.size(), parallel_grain,
+        [&](size_t i0, size_t i1) {
+      std::fill(grads + i0, grads + i1, 0.0f);
+    });
+  }
 
+  size_t i = plan_.size();
   for (; i != 0; --i) {
-    auto curr_node = top_order_[i-1];
-    auto kernel = curr_node->kernel();
-    bool leaf_node = kernel->get_inputs().empty();
-
-    kernel->clear_gradients();
-
-    if (adj_[curr_node].empty()) {
-      auto output_grad = NDArray({1}, {1});
-      if (!leaf_node) {
-        kernel->backward(output_grad);
-      } else {
-        gradients_[curr_node] = output_grad;
+    if (plan_[i-1] == node->id()) break;
+  }
+
+  if (profiling_) {
+    backward_flops_.resize(nodes_.size(), 0);
+    shapes_.resize(nodes_.size());
+  }
+
+  MemoryArena::Scope scope(planning_ ? &arena_ : MemoryArena::current());
+
+  if (inter_op()) {
+    backward_inter_op(node->id(), i);
+    return;
+  }
+
+  // only consumers which lead to node contribute gradients
+  std::vector<char> reached(nodes_.size(), false);
+  reached[node->id()] = true;
+  size_t n = plan_.size();
+
+  // segment of the values recomputed last
+  size_t segment = segment_begin_.size();
+  std::vector<size_t> recomputed;
+
+  for (; i != 0; --i) {
+    size_t u = plan_[i-1];
+    if (checkpointing_ && segment_[u] != segment) {
+      drop_recomputed(recomputed);
+      segment = segment_[u];
+      recompute_segment(segment, i, recomputed);
+    }
+    profiled(u, Profiler::Pass::backward, [&]() {
+        backward_node(u, node->id(), reached);
+      });
+
+    if (planning_) {
+      for (const auto& e : edges_[u]) {
+        kernels_[e.node]->release_gradient(e.input);
+      }
+      kernels_[u]->release_saved();
+      release_values(2 * n - i);
+    }
+  }
+
+  drop_recomputed(recomputed);
+}
+
+void Graph::recompute_segment(size_t s, size_t end,
+    std::vector<size_t>& nodes) {
+  std::vector<char> marked(nodes_.size(), false);
+  std::vector<size_t> stack;
+  for (size_t p = segment_begin_[s]; p < std::min(end, segment_begin_[s+1]);
+      ++p) {
+    if (interior_[plan_[p]]) {
+      marked[plan_[p]] = true;
+      stack.push_back(plan_[p]);
+    }
+  }
+
+  // values of earlier segments read by the segment (skip connections)
+  while (!stack.empty()) {
+    size_t u = stack.back();
+    stack.pop_back();
+    nodes.push_back(u);
+    for (const auto& input : kernels_[u]->get_inputs()) {
+      size_t v = input->id();
+      if (interior_[v] && !marked[v] &&
+          kernels_[v]->get_value().size() == 0) {
+        marked[v] = true;
+        stack.push_back(v);
       }
+    }
+  }
+
+  std::sort(nodes.begin(), nodes.end(), [&](size_t a, size_t b) {
+      return positions_[a] < positions_[b];
+    });
+  for (auto u : nodes) {
+    kernels_[u]->set_training(true);
+    profiled(u, Profiler::Pass::recompute, [&]() {
+        kernels_[u]->forward();
+      });
+  }
+
+  checkpoint_stats_.segments += !nodes.empty();
+  checkpoint_stats_.recomputed_nodes += nodes.size();
+}
+
+void Graph::drop_recomputed(std::vector<size_t>& nodes) {
+  for (auto u : nodes) {
+    kernels_[u]->release_value();
+    kernels_[u]->release_saved();
+  }
+  nodes.clear();
+}
+
+void Graph::backward_node(size_t u, size_t root, std::vector<char>& reached) {
+  auto kernel = kernels_[u];
+  bool leaf_node = kernel->get_inputs().empty();
+
+  kernel->clear_gradients();
+
+  if (u == root) {
+    if (!leaf_node) {
+      kernel->backward(seed_grad());
     } else {
-      for (auto& output_node : adj_[curr_node]) {
-        auto output_grad = output_node->kernel()->get_gradient(curr_node);
-        
-        if (!leaf_node) {
-          kernel->backward(output_grad);
-        } else if (curr_node->requires_grad()) {
-          if (gradients_.count(curr_node) == 0) {
-            gradients_[curr_node] = output_grad;
-          } else {
-            gradients_[curr_node].add_(output_grad);
-          }
+      gradients_[u] = seed_grad();
+    }
+    return;
+  }
+
+  for (const auto& e : edges_[u]) {
+    if (!reached[e.node]) {
+      continue;
+    }
+
+    reached[u] = true;
+    const auto& output_grad = kernels_[e.node]->get_gradient(e.input);
+
+    if (!leaf_node) {
+      kernel->backward(output_grad);
+    } else if (nodes_[u]->requires_grad()) {
+      accumulate_gradient(u, output_grad);
+    }
+  }
+}
+
+void Graph::accumulate_gradient(size_t u, const NDArray& grad) {
+  if (u >= flat_offsets_.size() || flat_offsets_[u] == no_offset) {
+    if (gradients_[u].size() == 0) {
+      gradients_[u] = grad;
+    } else {
+      gradients_[u].add_(grad);
+    }
+    return;
+  }
+
+  const auto& value = kernels_[u]->get_value();
+  if (grad.size() != value.size()) {
+    throw IncompatibleShapes("gradient of a flattened variable",
+        {value.shape(), grad.shape()});
+  }
+
+  size_t offset = flat_offsets_[u];
+  const NDArray g = grad.contiguous();
+  const float* src = g.data();
+  float* dst = flat_gradients_.shared_data() + offset;
+  for (size_t i = 0; i < g.size(); ++i) {
+    dst[i] += src[i];
+  }
+
+  if (gradients_[u].size() == 0) {
+    gradients_[u] = flat_gradients_.slice(0, offset, offset + g.size());
+    gradients_[u].reshape(value.shape());
+  }
+}
+
+void Graph::flatten_parameters() {
+  // outlives every step, so never from an arena
+  MemoryArena::Scope heap(nullptr);
+
+  // every variable starts on a 64 byte boundary
+  size_t align = 64 / sizeof(float);
+  size_t total = 0;
+  flat_offsets_.assign(nodes_.size(), no_offset);
+  for (size_t u = 0; u < nodes_.size(); ++u) {
+    if (nodes_[u]->requires_grad()) {
+      flat_offsets_[u] = total;
+      size_t size = kernels_[u]->get_value().size();
+      total += (size + align - 1) / align * align;
+    }
+  }
+
+  auto aligned = [&]() {
+    NDArray buffer({total + align});
+    size_t skew = reinterpret_cast<uintptr_t>(buffer.data()) % 64;
+    size_t begin = skew == 0 ? 0 : (64 - skew) / sizeof(float);
+    return buffer.slice(0, begin, begin + total);
+  };
+  flat_parameters_ = aligned();
+  flat_gradients_ = aligned();
+
+  for (size_t u = 0; u < nodes_.size(); ++u) {
+    if (flat_offsets_[u] == no_offset) {
+      continue;
+    }
+
+    auto kernel = static_cast<ValueKernel*>(kernels_[u]);
+    const NDArray value = kernel->get_value().contiguous();
+    size_t offset = flat_offsets_[u];
+    std::copy(value.data(), value.data() + value.size(),
+        flat_parameters_.shared_data() + offset);
+
+    NDArray view = flat_parameters_.slice(0, offset, offset + value.size());
+    view.reshape(value.shape());
+    kernel->bind(view);
+  }
+
+  gradients_.clear();
+}
+
+const NDArray& Graph::flat_parameters() const {
+  return flat_parameters_;
+}
+
+const NDArray& Graph::flat_gradients() const {
+  return flat_gradients_;
+}
+
+float Graph::clip_gradients(float max_norm) {
+  // one sweep over the flat buffer, otherwise one per variable
+  std::vector<NDArray*> grads;
+  if (flat_gradients_.size() != 0) {
+    grads.push_back(&flat_gradients_);
+  }
+  for (size_t u = 0; u < gradients_.size(); ++u) {
+    bool flat = u < flat_offsets_.size() && flat_offsets_[u] != no_offset;
+    if (!flat && gradients_[u].size() != 0) {
+      grads.push_back(&gradients_[u]);
+    }
+  }
+
+  double sum = 0.0;
+  for (auto g : grads) {
+    const NDArray c = g->contiguous();
+    const float* data = c.data();
+    for (size_t i = 0; i < c.size(); ++i) {
+      sum += double(data[i]) * data[i];
+    }
+  }
+
+  float norm = std::sqrt(sum);
+  if (norm <= max_norm) {
+    return norm;
+  }
+
+  float scale = max_norm / norm;
+  for (auto g : grads) {
+    if (g == &flat_gradients_) {
+      float* data = flat_gradients_.shared_data();
+      for (size_t i = 0; i < flat_gradients_.size(); ++i) {
+        data[i] *= scale;
+      }
+    } else {
+      *g = g->muls(scale);
+    }
+  }
+
+  return norm;
+}
+
+namespace {
+
+/*
+ * Runs task(u) on the thread pool for count nodes, starting with ready.
+ * Every node u waits for pending[u] others, for_each_next(u, f) calls f(v)
+ * for each node v waiting on u. The caller helps with queued work (graph
+ * nodes and kernel chunks alike) until all nodes are done. After the first
+ * exception the remaining tasks are skipped, it is rethrown at the end.
+ */
+template <class Task, class Next>
+void run_dag(size_t count, const std::vector<size_t>& ready,
+    const std::vector<size_t>& pending, const Task& task,
+    const Next& for_each_next) {
+  auto& pool = ThreadPool::get();
+  std::unique_ptr<std::atomic<size_t>[]> waiting(
+      new std::atomic<size_t>[pending.size()]);
+  for (size_t u = 0; u < pending.size(); ++u) {
+    waiting[u] = pending[u];
+  }
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t done = 0;
+  std::exception_ptr error;
+  std::atomic<bool> failed(false);
+
+  std::function<void(size_t)> execute = [&](size_t u) {
+    if (!failed) {
+      try {
+        task(u);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!error) {
+          error = std::current_exception();
         }
+        failed = true;
+      }
+    }
+
+    for_each_next(u, [&](size_t v) {
+      if (--waiting[v] == 0) {
+        pool.submit([&execute, v]() { execute(v); });
+      }
+    });
+
+    std::lock_guard<std::mutex> lock(mutex);
+    done++;
+    cv.notify_all();
+  };
+
+  for (auto u : ready) {
+    pool.submit([&execute, u]() { execute(u); });
+  }
+
+  std::unique_lock<std::mutex> lock(mutex);
+  while (done < count) {
+    size_t seen = done;
+    lock.unlock();
+    bool ran = pool.run_one();
+    lock.lock();
+    if (!ran) {
+      cv.wait(lock, [&]() { return done != seen; });
+    }
+  }
+
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+} // namespace
+
+bool Graph::inter_op() const {
+  return inter_op_ && !planning_ && !checkpointing_ &&
+    ThreadPool::get().num_threads() > 1;
+}
+
+void Graph::forward_inter_op() {
+  size_t n = nodes_.size();
+  std::vector<size_t> pending(n, 0);
+  std::vector<size_t> ready;
+  for (auto u : plan_) {
+    pending[u] = kernels_[u]->get_inputs().size();
+    if (pending[u] == 0) {
+      ready.push_back(u);
+    }
+  }
+
+  // in inference mode values go once all of their consumers have run
+  std::unique_ptr<std::atomic<size_t>[]> uses(new std::atomic<size_t>[n]);
+  for (size_t u = 0; u < n; ++u) {
+    uses[u] = 0;
+  }
+  if (inference_) {
+    for (const auto& releases : forward_releases_) {
+      for (auto u : releases) {
+        uses[u] = edges_[u].size();
+      }
+    }
+  }
+
+  run_dag(plan_.size(), ready, pending, [&](size_t u) {
+      auto kernel = kernels_[u];
+      if (run_[u]) {
+        kernel->set_training(!inference_);
+        profiled(u, Profiler::Pass::forward, [&]() { kernel->forward(); });
+      }
+      for (const auto& input : kernel->get_inputs()) {
+        size_t v = input->id();
+        if (uses[v] > 0 && --uses[v] == 0 && dirty_[v]) {
+          kernels_[v]->release_value();
+        }
+      }
+    }, [&](size_t u, const std::function<void(size_t)>& next) {
+      for (const auto& e : edges_[u]) {
+        next(e.node);
+      }
+    });
+}
+
+void Graph::backward_inter_op(size_t root, size_t end) {
+  // plan_[0, end) ends with root, a node waits for its consumers among them
+  size_t n = nodes_.size();
+  std::vector<char> in_range(n, false);
+  for (size_t p = 0; p < end; ++p) {
+    in_range[plan_[p]] = true;
+  }
+
+  std::vector<size_t> pending(n, 0);
+  std::vector<size_t> ready;
+  for (size_t p = 0; p < end; ++p) {
+    size_t u = plan_[p];
+    for (const auto& e : edges_[u]) {
+      pending[u] += in_range[e.node];
+    }
+    if (pending[u] == 0) {
+      ready.push_back(u);
+    }
+  }
+
+  std::vector<char> reached(n, false);
+  reached[root] = true;
+
+  run_dag(end, ready, pending, [&](size_t u) {
+      profiled(u, Profiler::Pass::backward, [&]() {
+          backward_node(u, root, reached);
+        });
+    }, [&](size_t u, const std::function<void(size_t)>& next) {
+      for (const auto& input : kernels_[u]->get_inputs()) {
+        next(input->id());
       }
+    });
+}
+
+std::vector<NodeRef> Graph::pruned() const {
+  std::vector<NodeRef> res;
+  for (size_t u = 0; u < scheduled_.size(); ++u) {
+    if (!scheduled_[u] && !folded_[u]) {
+      res.push_back(nodes_[u]);
     }
   }
+
+  return res;
 }
 
 std::vector<VariableRef> Graph::get_variables() const {
   std::vector<VariableRef> variables;
-  for (auto item : adj_) {
-    if (item.first->requires_grad()) {
-      variables.push_back(std::static_pointer_cast<Variable>(item.first));
+  for (const auto& node : nodes_) {
+    if (node->requires_grad()) {
+      variables.push_back(std::static_pointer_cast<Variable>(node));
     }
   }
 
@@ -300,14 +1044,70 @@ std::vector<VariableRef> Graph::get_variables() const {
 }
 
 NDArray Graph::gradient(const NodeRef& node) const {
-  auto it = gradients_.find(node);
-  if (it != gradients_.end()) {
-    return it->second;
+  if (owns(node) && node->id() < gradients_.size()) {
+    return gradients_[node->id()];
   }
  
   return NDArray();
 }
 
+void Graph::set_memory_planning(bool enabled) {
+  planning_ = enabled;
+  arena_.reset();
+  cached_ = false;
+}
+
+const MemoryArena::Stats& Graph::memory_stats() const {
+  return arena_.stats();
+}
+
+void Graph::set_inference(bool enabled) {
+  inference_ = enabled;
+  arena_.reset();
+  // saved state differs between the modes
+  cached_ = false;
+}
+
+void Graph::set_incremental(bool enabled) {
+  incremental_ = enabled;
+  cached_ = false;
+}
+
+void Graph::set_inter_op(bool enabled) {
+  inter_op_ = enabled;
+}
+
+void Graph::checkpoint(NodeRef node) {
+  if (!owns(node)) {
+    throw RuntimeError("cannot checkpoint unknown node");
+  }
+  checkpoints_.resize(nodes_.size(), false);
+  checkpoints_[node->id()] = true;
+  compiled_ = false;
+}
+
+void Graph::clear_checkpoints() {
+  checkpoints_.clear();
+  compiled_ = false;
+}
+
+const Graph::CheckpointStats& Graph::checkpoint_stats() const {
+  return checkpoint_stats_;
+}
+
+void Graph::set_profiling(bool enabled) {
+  profiling_ = enabled;
+}
+
+Profiler& Graph::profile() {
+  return profiler_;
+}
+
+void Graph::set_fusion(bool enabled) {
+  fusion_ = enabled;
+  compiled_ = false;
+}
+
 std::ostream& operator<<(std::ostream& os, const NodeRef& node) {
   os << node->str();
   return os;
@@ -1,13 +1,12 @@
 #ifndef _graph_h_
 #define _graph_h_
 
-#include <list>
 #include <vector>
 #include <memory>
 #include <ostream>
-#include <unordered_map>
 
 #include "ndarray.h"
+#include "profiler.h"
 
 
 class Node;
@@ -36,11 +35,19 @@ class Node : public std::enable_shared_from_this<Node> {
     const NDArray& get_value() const;
     virtual std::string str() const;
 
+    // dense index of the node in its graph, assigned by Graph::add
+    size_t id() const;
+    static const size_t no_id = static_cast<size_t>(-1);
+
   protected:
     Node(GraphRef g);
     Node(const Node&) = delete;
 
     GraphRef graph_;
+
+  private:
+    friend class Graph;
+    size_t id_ = no_id;
 };
 
 
@@ -81,6 +88,9 @@ class Op : public Node {
 
     
   private:
+    // the fusion pass swaps kernels
+    friend class Graph;
+
     Op(const Op&) = delete;
     const Op& operator=(const Op&) = delete;
     
@@ -110,6 +120,9 @@ class Variable : public Op {
 
     const Shape& shape() const;
     void set_value(const NDArray& value);
+    // the elements of the value for updates in place (e.g. by an
+    // optimizer), counts as a new value like set_value()
+    float* mutable_data();
     virtual std::string str() const override;
 
   protected:
@@ -130,17 +143,218 @@ class Variable : public Op {
 class Graph {
   public:
     void add(NodeRef node);
+
+    // Freezes the current topology into a flat schedule, forward() and
+    // backward() walk it by index until the next add(). forward() compiles
+    // on demand, calling this directly only moves the cost up front.
+    void compile();
     
-    void forward();
+    // Runs the nodes the outputs depend on, all nodes if there are none.
+    // Nodes no output depends on are pruned from the plan, which is
+    // compiled again whenever the outputs change. Values of the outputs
+    // are kept like those of sinks.
+    void forward(const std::vector<NodeRef>& outputs = {});
     void backward(NodeRef node);
 
+    // nodes left out of the current plan because no output depends on them
+    std::vector<NodeRef> pruned() const;
+
     std::vector<VariableRef> get_variables() const;
     NDArray gradient(const NodeRef& node) const;
 
+    // With memory planning forward() and backward() take tensor memory
+    // from an arena planned on the first step and drop intermediate values,
+    // gradients and saved state as soon as the step no longer needs them.
+    // After a step only the values of leaves and sinks and the gradients
+    // of variables are kept, and forward() drops those of the last step.
+    void set_memory_planning(bool enabled);
+    const MemoryArena::Stats& memory_stats() const;
+
+    // With fusion (the default) compile() rewrites mm -> add -> relu and
+    // mm -> add chains into single nodes which apply the bias and the ReLU
+    // while the matrix product is still in cache. The last node of a chain
+    // computes the fused result, the values of the nodes folded into it
+    // are not computed and backward() cannot start from them.
+    void set_fusion(bool enabled);
+
+    // In inference mode forward() skips the state kernels save for
+    // backward() and drops intermediate values as soon as their last
+    // consumer has run, only leaves and sinks keep theirs. Gradients of
+    // earlier training steps are left alone, backward() throws.
+    void set_inference(bool enabled);
+
+    // With inter-op parallelism forward() and backward() dispatch every
+    // node to the intra-op thread pool as soon as the nodes it depends on
+    // are done, so independent branches run concurrently and share the
+    // threads with the kernels. Memory planning needs a fixed allocation
+    // order and keeps execution serial.
+    void set_inter_op(bool enabled);
+
+    // With incremental evaluation (off by default) forward() only runs the
+    // nodes downstream of leaves which got a new value since the last
+    // forward(), plus the nodes needed to recompute dropped values. In
+    // inference mode values of nodes whose inputs did not change are kept
+    // for the next pass. Memory planning always runs every node. A leaf
+    // only counts as changed after set_value() or mutable_data(), writes
+    // through arrays sharing its storage (NDArray::shared_data()) are not
+    // seen and leave stale values behind.
+    void set_incremental(bool enabled);
+
+    // Gradient checkpointing: once a node is marked forward() keeps only
+    // the values of checkpoints, leaves and results (and the state the
+    // checkpoints save for backward()). The nodes between two checkpoints
+    // form a segment, backward() runs the forward of a segment again right
+    // before its backward and drops the recomputed values when it is done.
+    // Checkpoints are not folded by fusion and keep execution serial.
+    void checkpoint(NodeRef node);
+    void clear_checkpoints();
+
+    // what the last step kept and recomputed, with or without checkpoints
+    struct CheckpointStats {
+      // segments backward() recomputed
+      size_t segments = 0;
+      // forward runs by forward() and again by backward()
+      size_t forward_nodes = 0;
+      size_t recomputed_nodes = 0;
+      // bytes of intermediate values forward() leaves for backward()
+      size_t kept_bytes = 0;
+    };
+    const CheckpointStats& checkpoint_stats() const;
+
+    // With profiling every forward and backward run of a node is added to
+    // profile() (see profiler.h) until it is cleared. Disabled, running a
+    // node costs one extra branch.
+    void set_profiling(bool enabled);
+    Profiler& profile();
+
+    // Packs the values of all variables which require gradients into one
+    // 64 byte aligned buffer, and backward() writes their gradients into
+    // a second one with the same layout. Variables keep views into the
+    // buffer which set_value() and optimizers write through, so arrays
+    // taken from get_value() or gradient() see later updates. Variables
+    // created afterwards are packed by the next call.
+    void flatten_parameters();
+    // empty until flatten_parameters(), gradients of variables backward()
+    // did not reach are 0
+    const NDArray& flat_parameters() const;
+    const NDArray& flat_gradients() const;
+
+    // scales the gradients of all variables by max_norm / norm if their
+    // joint L2 norm is larger than max_norm, returns the norm
+    float clip_gradients(float max_norm);
+
   protected:
-    std::unordered_map<NodeRef, std::list<NodeRef>> adj_;
-    std::vector<NodeRef> top_order_;
-    std::unordered_map<NodeRef, NDArray> gradients_;
+    // the input slot of a consumer fed by a node
+    struct Edge {
+      size_t node;
+      size_t input;
+    };
+
+    // ids of node and its inputs, registering the ones seen for the first time
+    size_t register_node(const NodeRef& node);
+    bool owns(const NodeRef& node) const;
+
+    // everything below is indexed by node id
+    std::vector<NodeRef> nodes_;
+    std::vector<Kernel*> kernels_;
+    std::vector<std::vector<Edge>> consumers_;
+    std::vector<NDArray> gradients_;
+
+    // kernel swapped in by the fusion pass, restored by the next compile()
+    struct Fusion {
+      size_t node;
+      KernelRef original;
+    };
+
+    void fuse();
+    void unfuse();
+
+    bool fusion_ = true;
+    std::vector<Fusion> fusions_;
+    // nodes computed as part of a fused node
+    std::vector<bool> folded_;
+    // consumers_ of the executed graph, i.e. after fusion
+    std::vector<std::vector<Edge>> edges_;
+
+    // requested outputs, empty for all nodes
+    std::vector<size_t> outputs_;
+    std::vector<bool> requested_;
+    // nodes in plan_
+    std::vector<bool> scheduled_;
+
+    // node ids in topological order
+    std::vector<size_t> plan_;
+    // plan_ index of every scheduled node
+    std::vector<size_t> positions_;
+    bool compiled_ = false;
+
+    // drops the values which are dead after position t of the step, plan_
+    // index p runs its forward at p and its backward at 2 * n - 1 - p
+    void release_values(size_t t);
+
+    // node u of a backward() from root, reached marks the nodes which lead
+    // to root
+    void backward_node(size_t u, size_t root, std::vector<char>& reached);
+    void forward_inter_op();
+    void backward_inter_op(size_t root, size_t end);
+    bool inter_op() const;
+
+    bool inter_op_ = false;
+
+    // decides run_ and dirty_ for the next forward()
+    void mark_dirty();
+
+    bool incremental_ = false;
+    // values of the nodes not in the dirty cone are still valid
+    bool cached_ = false;
+    // leaf versions seen by the last forward()
+    std::vector<size_t> versions_;
+    // nodes downstream of a changed leaf
+    std::vector<char> dirty_;
+    // nodes the next forward() runs
+    std::vector<char> run_;
+
+    bool inference_ = false;
+
+    // runs the forward of the interior nodes of segment s before plan_
+    // index end, and of the dropped values they read, again
+    void recompute_segment(size_t s, size_t end, std::vector<size_t>& nodes);
+    void drop_recomputed(std::vector<size_t>& nodes);
+
+    std::vector<bool> checkpoints_;
+    bool checkpointing_ = false;
+    // plan_ index of the first node of every segment
+    std::vector<size_t> segment_begin_;
+    std::vector<size_t> segment_;
+    // nodes whose values and saved state forward() drops
+    std::vector<char> interior_;
+    CheckpointStats checkpoint_stats_;
+
+    // adds grad to the gradient of variable u
+    void accumulate_gradient(size_t u, const NDArray& grad);
+
+    static const size_t no_offset = static_cast<size_t>(-1);
+    NDArray flat_parameters_;
+    NDArray flat_gradients_;
+    // offset of each variable in both flat buffers, no_offset if not packed
+    std::vector<size_t> flat_offsets_;
+
+    // runs fn(), which runs node u in pass, and records it when profiling
+    template <class F>
+    void profiled(size_t u, Profiler::Pass pass, const F& fn);
+
+    bool profiling_ = false;
+    Profiler profiler_;
+    // per node, from its last profiled forward run
+    std::vector<size_t> backward_flops_;
+    std::vector<std::vector<size_t>> shapes_;
+
+    bool planning_ = false;
+    MemoryArena arena_;
+    // node ids by the position of their last use
+    std::vector<std::vector<size_t>> releases_;
+    // the same without backward() (inference mode)
+    std::vector<std::vector<size_t>> forward_releases_;
 };
 
 std::ostream& operator<<(std::ostream& os, const NodeRef& node);
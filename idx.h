@@ -0,0 +1,234 @@
+#ifndef _idx_h_
+#define _idx_h_
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "exception.h"
+
+/*
+ * Read only view of an IDX file (the format of the MNIST files).
+ *
+ * The file is mapped instead of read, so opening it costs the header and
+ * its pages are only faulted in (and kept in the page cache, shared with
+ * other processes) once they are touched. The header is
+ *
+ *   0x00 0x00 <type> <dims>, then dims big endian uint32 sizes
+ *
+ * followed by the values in row major order. Values wider than a byte are
+ * big endian as well, data() hands them out as stored and value() decodes
+ * them. An item is everything below the first dimension, e.g. one image
+ * of a 60000 x 28 x 28 file.
+ */
+class IDXFile {
+  public:
+    enum Type : uint8_t {
+      u8 = 0x08, i8 = 0x09, i16 = 0x0b, i32 = 0x0c, f32 = 0x0d, f64 = 0x0e
+    };
+
+    // an empty file without dimensions
+    IDXFile() { }
+
+    explicit IDXFile(const std::string& path) : path_(path) {
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0) {
+        throw RuntimeError("cannot open " + path);
+      }
+
+      struct stat st;
+      if (::fstat(fd, &st) != 0) {
+        ::close(fd);
+        throw RuntimeError("cannot stat " + path);
+      }
+      mapped_bytes_ = static_cast<size_t>(st.st_size);
+
+      if (mapped_bytes_ > 0) {
+        void* p = ::mmap(nullptr, mapped_bytes_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+          ::close(fd);
+          throw RuntimeError("cannot map " + path);
+        }
+        mapped_ = static_cast<const uint8_t*>(p);
+      }
+      // the mapping keeps the file alive
+      ::close(fd);
+
+      try {
+        parse_header();
+      } catch (...) {
+        unmap();
+        throw;
+      }
+    }
+
+    IDXFile(IDXFile&& other) {
+      *this = std::move(other);
+    }
+
+    IDXFile& operator=(IDXFile&& other) {
+      if (this != &other) {
+        unmap();
+        path_ = std::move(other.path_);
+        type_ = other.type_;
+        dims_ = std::move(other.dims_);
+        mapped_ = other.mapped_;
+        mapped_bytes_ = other.mapped_bytes_;
+        data_ = other.data_;
+        other.mapped_ = nullptr;
+        other.mapped_bytes_ = 0;
+        other.data_ = nullptr;
+        other.dims_.clear();
+      }
+      return *this;
+    }
+
+    ~IDXFile() {
+      unmap();
+    }
+
+    Type type() const {
+      return type_;
+    }
+
+    const std::vector<size_t>& dims() const {
+      return dims_;
+    }
+
+    // the first dimension
+    size_t items() const {
+      return dims_.empty() ? 0 : dims_[0];
+    }
+
+    // values per item
+    size_t item_size() const {
+      size_t n = 1;
+      for (size_t i = 1; i < dims_.size(); ++i) {
+        n *= dims_[i];
+      }
+      return n;
+    }
+
+    size_t type_size() const {
+      return type_size(type_);
+    }
+
+    // the raw values, big endian for types wider than a byte
+    const uint8_t* data() const {
+      return data_;
+    }
+
+    const uint8_t* item(size_t i) const {
+      return data_ + i * item_size() * type_size();
+    }
+
+    // the i-th value in row major order
+    double value(size_t i) const {
+      const uint8_t* p = data_ + i * type_size();
+      switch (type_) {
+        case u8: return p[0];
+        case i8: return static_cast<int8_t>(p[0]);
+        case i16: return static_cast<int16_t>(load_be(p, 2));
+        case i32: return static_cast<int32_t>(load_be(p, 4));
+        case f32: {
+          uint32_t bits = static_cast<uint32_t>(load_be(p, 4));
+          float f;
+          std::memcpy(&f, &bits, sizeof(f));
+          return f;
+        }
+        case f64: {
+          uint64_t bits = load_be(p, 8);
+          double d;
+          std::memcpy(&d, &bits, sizeof(d));
+          return d;
+        }
+      }
+      return 0.0;
+    }
+
+    static size_t type_size(Type type) {
+      switch (type) {
+        case u8: case i8: return 1;
+        case i16: return 2;
+        case i32: case f32: return 4;
+        case f64: return 8;
+      }
+      return 0;
+    }
+
+  private:
+    IDXFile(const IDXFile&) = delete;
+    const IDXFile& operator=(const IDXFile&) = delete;
+
+    static uint64_t load_be(const uint8_t* p, size_t n) {
+      uint64_t v = 0;
+      for (size_t i = 0; i < n; ++i) {
+        v = (v << 8) | p[i];
+      }
+      return v;
+    }
+
+    void parse_header() {
+      if (mapped_bytes_ < 4 || mapped_[0] != 0 || mapped_[1] != 0) {
+        throw ValueError(path_ + ": not an IDX file");
+      }
+
+      type_ = static_cast<Type>(mapped_[2]);
+      if (type_size(type_) == 0) {
+        throw ValueError(path_ + ": unknown IDX type "
+            + std::to_string(int(mapped_[2])));
+      }
+
+      size_t header = 4 + 4 * size_t(mapped_[3]);
+      if (mapped_bytes_ < header) {
+        throw ValueError(path_ + ": truncated IDX header");
+      }
+      dims_.resize(mapped_[3]);
+      for (size_t i = 0; i < dims_.size(); ++i) {
+        dims_[i] = load_be(mapped_ + 4 + 4 * i, 4);
+      }
+
+      // a malformed header may have dims whose product overflows, so the
+      // size of an item is checked against the largest size_t and the
+      // whole payload against the data behind the header
+      size_t item_bytes = type_size();
+      for (size_t i = 1; i < dims_.size(); ++i) {
+        if (dims_[i] != 0 && item_bytes > SIZE_MAX / dims_[i]) {
+          throw ValueError(path_ + ": IDX dimensions " + vstr(dims_)
+              + " overflow");
+        }
+        item_bytes *= dims_[i];
+      }
+      if (item_bytes != 0 && items() > (mapped_bytes_ - header) / item_bytes) {
+        throw ValueError(path_ + ": IDX file shorter than its dimensions "
+            + vstr(dims_));
+      }
+      data_ = mapped_ + header;
+    }
+
+    void unmap() {
+      if (mapped_ != nullptr) {
+        ::munmap(const_cast<uint8_t*>(mapped_), mapped_bytes_);
+        mapped_ = nullptr;
+      }
+    }
+
+    std::string path_;
+    Type type_ = u8;
+    std::vector<size_t> dims_;
+
+    const uint8_t* mapped_ = nullptr;
+    size_t mapped_bytes_ = 0;
+    // past the header
+    const uint8_t* data_ = nullptr;
+};
+
+#endif // _idx_h_
@@ -1,6 +1,17 @@
 #include <string>
 #include "kernel.h"
 #include "graph.h"
+#include "expr.h"
+
+namespace {
+
+// multiply-adds of a product: elements of the result times the length of
+// the contracted axis of its left operand
+size_t contracted(const NDArray& value, const NDArray& a) {
+  return a.shape().empty() ? 0 : value.size() * a.shape().back();
+}
+
+} // namespace
 
 void AddKernel::forward() {
   value_ = inputs_[0]->get_value().add(inputs_[1]->get_value());
@@ -8,11 +19,12 @@ void AddKernel::forward() {
 
 void AddKernel::backward(const NDArray& output_grad) {
   if (gradients_.empty()) {
-    gradients_[inputs_[0]] = output_grad;
-    gradients_[inputs_[1]] = output_grad.reduce_sum(0, false);
+    gradients_.resize(inputs_.size());
+    gradients_[0] = output_grad;
+    gradients_[1] = output_grad.reduce_sum(0, false);
   } else {
-    gradients_[inputs_[0]].add_(output_grad);
-    gradients_[inputs_[1]].add_(output_grad.reduce_sum(0, false));
+    gradients_[0].add_(output_grad);
+    gradients_[1].add_(output_grad.reduce_sum(0, false));
   }
 }
 
@@ -24,18 +36,27 @@ std::string AddKernel::str() const {
     +  ")";
 }
 
+std::string AddKernel::name() const {
+  return "add";
+}
+
+size_t AddKernel::flops(bool backward) const {
+  return value_.size();
+}
+
 void SubKernel::forward() {
   value_ = inputs_[0]->get_value().sub(inputs_[1]->get_value());
 }
 
 void SubKernel::backward(const NDArray& output_grad) {
   if (gradients_.empty()) {
-    gradients_[inputs_[0]].zeros(inputs_[0]->get_value().shape());
-    gradients_[inputs_[1]].zeros(inputs_[1]->get_value().shape());
+    gradients_.resize(inputs_.size());
+    gradients_[0].zeros(inputs_[0]->get_value().shape());
+    gradients_[1].zeros(inputs_[1]->get_value().shape());
   }
   
-  gradients_[inputs_[0]].add_(output_grad);
-  gradients_[inputs_[1]].sub_(output_grad);
+  gradients_[0].add_(output_grad);
+  gradients_[1].sub_(output_grad);
 }
 
 std::string SubKernel::str() const {
@@ -46,6 +67,14 @@ std::string SubKernel::str() const {
     +  ")";
 }
 
+std::string SubKernel::name() const {
+  return "sub";
+}
+
+size_t SubKernel::flops(bool backward) const {
+  return value_.size();
+}
+
 
 void MulKernel::forward() {
   value_ = inputs_[0]->get_value().mul(inputs_[1]->get_value());
@@ -53,12 +82,13 @@ void MulKernel::forward() {
 
 void MulKernel::backward(const NDArray& output_grad) {
   if (gradients_.empty()) {
-    gradients_[inputs_[0]].zeros(inputs_[1]->get_value().shape());
-    gradients_[inputs_[1]].zeros(inputs_[0]->get_value().shape());
+    gradients_.resize(inputs_.size());
+    gradients_[0].zeros(inputs_[1]->get_value().shape());
+    gradients_[1].zeros(inputs_[0]->get_value().shape());
   }
 
-  gradients_[inputs_[0]].add_(inputs_[1]->get_value().mul(output_grad));
-  gradients_[inputs_[1]].add_(inputs_[0]->get_value().mul(output_grad));
+  gradients_[0].add_(inputs_[1]->get_value().mul(output_grad));
+  gradients_[1].add_(inputs_[0]->get_value().mul(output_grad));
 }
 
 std::string MulKernel::str() const {
@@ -69,6 +99,14 @@ std::string MulKernel::str() const {
     + ")";
 }
 
+std::string MulKernel::name() const {
+  return "mul";
+}
+
+size_t MulKernel::flops(bool backward) const {
+  return (backward ? 2 : 1) * value_.size();
+}
+
 
 void DotKernel::forward() {
   value_ = inputs_[0]->get_value().dot(inputs_[1]->get_value());
@@ -76,12 +114,13 @@ void DotKernel::forward() {
 
 void DotKernel::backward(const NDArray& output_grad) {
   if (gradients_.empty()) {
-    gradients_[inputs_[0]].zeros(inputs_[0]->get_value().shape());
-    gradients_[inputs_[1]].zeros(inputs_[1]->get_value().shape());
+    gradients_.resize(inputs_.size());
+    gradients_[0].zeros(inputs_[0]->get_value().shape());
+    gradients_[1].zeros(inputs_[1]->get_value().shape());
   }
 
-  gradients_[inputs_[0]].add_(output_grad.dot(inputs_[1]->get_value()));
-  gradients_[inputs_[1]].add_(inputs_[0]->get_value().dot(output_grad));
+  gradients_[0].add_(output_grad.dot(inputs_[1]->get_value()));
+  gradients_[1].add_(inputs_[0]->get_value().dot(output_grad));
 }
 
 std::string DotKernel::str() const {
@@ -92,22 +131,30 @@ std::string DotKernel::str() const {
     + ")";
 }
 
+std::string DotKernel::name() const {
+  return "dot";
+}
+
+size_t DotKernel::flops(bool backward) const {
+  return (backward ? 4 : 2) * contracted(value_, inputs_[0]->get_value());
+}
+
 void MatMulKernel::forward() {
   value_ = inputs_[0]->get_value().mm(inputs_[1]->get_value());
 }
 
 void MatMulKernel::backward(const NDArray& output_grad) {
-  auto a_t = inputs_[0]->get_value().transpose();
-  auto b_t = inputs_[1]->get_value().transpose();
-  auto g0 = output_grad.mm(b_t);
-  auto g1 = a_t.mm(output_grad);
+  // dA = G * B^T, dB = A^T * G
+  auto g0 = output_grad.mm(inputs_[1]->get_value(), false, true);
+  auto g1 = inputs_[0]->get_value().mm(output_grad, true, false);
 
   if (gradients_.empty()) {
-    gradients_[inputs_[0]] = g0;
-    gradients_[inputs_[1]] = g1;
+    gradients_.resize(inputs_.size());
+    gradients_[0] = g0;
+    gradients_[1] = g1;
   } else {
-    gradients_[inputs_[0]].add_(g0);
-    gradients_[inputs_[1]].add_(g1);
+    gradients_[0].add_(g0);
+    gradients_[1].add_(g1);
   }
 }
 
@@ -119,23 +166,31 @@ std::string MatMulKernel::str() const {
     + ")";
 }
 
+std::string MatMulKernel::name() const {
+  return "mm";
+}
+
+size_t MatMulKernel::flops(bool backward) const {
+  return (backward ? 4 : 2) * contracted(value_, inputs_[0]->get_value());
+}
+
 
 void BatchMatMulKernel::forward() {
   value_ = inputs_[0]->get_value().bmm(inputs_[1]->get_value());
 }
 
 void BatchMatMulKernel::backward(const NDArray& output_grad) {
-  auto a_t = inputs_[0]->get_value().transpose();
-  auto b_t = inputs_[1]->get_value().transpose();
-  auto g0 = output_grad.bmm(b_t);
-  auto g1 = a_t.bmm(output_grad);
+  // dA = G * B^T, dB = A^T * G
+  auto g0 = output_grad.bmm(inputs_[1]->get_value(), false, true);
+  auto g1 = inputs_[0]->get_value().bmm(output_grad, true, false);
 
   if (gradients_.empty()) {
-    gradients_[inputs_[0]] = g0;
-    gradients_[inputs_[1]] = g1;
+    gradients_.resize(inputs_.size());
+    gradients_[0] = g0;
+    gradients_[1] = g1;
   } else {
-    gradients_[inputs_[0]].add_(g0);
-    gradients_[inputs_[1]].add_(g1);
+    gradients_[0].add_(g0);
+    gradients_[1].add_(g1);
   }
 }
 
@@ -147,53 +202,109 @@ std::string BatchMatMulKernel::str() const {
     + ")";
 }
 
+std::string BatchMatMulKernel::name() const {
+  return "bmm";
+}
+
+size_t BatchMatMulKernel::flops(bool backward) const {
+  return (backward ? 4 : 2) * contracted(value_, inputs_[0]->get_value());
+}
+
+void LinearKernel::forward() {
+  const auto& x = inputs_[0]->get_value();
+  const auto& W = inputs_[1]->get_value();
+  const auto& b = inputs_[2]->get_value();
+
+  size_t k = W.shape().back();
+  if (b.shape().size() <= 2 && b.size() == k && b.shape().back() == k) {
+    value_ = x.mm_bias(W, b, relu_);
+  } else {
+    // any other broadcast of the bias takes the unfused path
+    value_ = x.mm(W).add(b);
+    if (relu_) {
+      value_ = value_.max_filter(0.0f);
+    }
+  }
+
+  if (relu_ && training_) {
+    mask_ = BitMask(value_);
+  }
+}
+
+void LinearKernel::backward(const NDArray& output_grad) {
+  auto g = relu_ ? mask_.apply(output_grad) : output_grad;
+
+  // dx = g * W^T, dW = x^T * g, db = sum of g over the batch
+  auto g0 = g.mm(inputs_[1]->get_value(), false, true);
+  auto g1 = inputs_[0]->get_value().mm(g, true, false);
+  auto g2 = g.reduce_sum(0, false);
+
+  if (gradients_.empty()) {
+    gradients_.resize(inputs_.size());
+    gradients_[0] = g0;
+    gradients_[1] = g1;
+    gradients_[2] = g2;
+  } else {
+    gradients_[0].add_(g0);
+    gradients_[1].add_(g1);
+    gradients_[2].add_(g2);
+  }
+}
+
+std::string LinearKernel::str() const {
+  return std::string(relu_ ? "relu" : "")
+    + "(("
+    + inputs_[0]->get_value().str()
+    + " mm "
+    + inputs_[1]->get_value().str()
+    + ") + "
+    + inputs_[2]->get_value().str()
+    + ")";
+}
+
+std::string LinearKernel::name() const {
+  return relu_ ? "linear_relu" : "linear";
+}
+
+size_t LinearKernel::flops(bool backward) const {
+  // the products, the bias and the relu (or its mask)
+  return (backward ? 4 : 2) * contracted(value_, inputs_[0]->get_value())
+    + (relu_ ? 2 : 1) * value_.size();
+}
+
 // Great explanation: 
 // http://eli.thegreenplace.net/2016/the-softmax-function-and-its-derivative/
 void SoftmaxKernel::forward() {
-  value_ = inputs_[0]->get_value();
+  const auto& x = inputs_[0]->get_value();
   
-  Shape shape(value_.shape());
+  Shape shape(x.shape());
   if (shape.size() != 2) {
     throw ValueError("Incompatible shape for softmax: " + vstr(shape.v()));
   }
 
-  auto m = value_.reduce_max(1, true);
-  value_.sub_(m).exp_();
-  value_.mul_(value_.reduce_sum(1, true).recip_());
-
-  size_t nb = shape[0]; // number of batches
-  size_t js = shape[-1]; // size of the Jacobian
-
-  derivative_.zeros({nb, js, js});
-
-  for (size_t b = 0; b < nb; ++b) { // batch
-    for (size_t i = 0; i < js; ++i) { // Jacobian row
-      for (size_t j = 0; j < js; ++j) { // Jacobian col
-        if (i == j) {
-          float v_i = value_.get({b, i});
-          float val = v_i * (1.0f - v_i);
-          derivative_.set({b, i, i}, val);
-        } else {
-          float v_i = value_.get({b, i});
-          float v_j = value_.get({b, j});
-          derivative_.set({b, i, j}, -v_i * v_j);
-        }
-      }
-    }
+  auto X = lazy::ref(x);
+  auto max_x = lazy::ref(x.reduce_max(1, true));
+  auto sum_exp = lazy::ref(lazy::sum(exp(X - max_x), 1, true));
+  value_ = lazy::eval(exp(X - max_x) / sum_exp);
+
+  // the Jacobian is diag(s) - s s^T, backward only needs s
+  if (training_) {
+    output_ = value_;
   }
 }
 
 void SoftmaxKernel::backward(const NDArray& output_grad) {
-  Shape og_shape(output_grad.shape());
+  // g^T J = s * (g - <g, s>) per row, without materializing J
+  auto S = lazy::ref(output_);
+  auto G = lazy::ref(output_grad);
+  auto dot = lazy::ref(lazy::sum(S * G, 1, true));
+  auto gs = lazy::eval(S * (G - dot));
 
   if (gradients_.empty()) {
-    gradients_[inputs_[0]].zeros(output_grad.shape());
-  }
-
-  if (og_shape.is_row_vector()) {
-    gradients_[inputs_[0]].add_(output_grad.bmm(derivative_));
+    gradients_.resize(inputs_.size());
+    gradients_[0] = gs;
   } else {
-    gradients_[inputs_[0]].add_(derivative_.bmm(output_grad));
+    gradients_[0].add_(gs);
   }
 }
 
@@ -203,8 +314,15 @@ std::string SoftmaxKernel::str() const {
     + ")";
 }
 
+std::string SoftmaxKernel::name() const {
+  return "softmax";
+}
+
+size_t SoftmaxKernel::flops(bool backward) const {
+  return 4 * value_.size();
+}
+
 void SoftmaxCrossEntropyKernel::forward() {
-  // TODO: copy on write...
   auto x = inputs_[0]->get_value();
   auto y = inputs_[1]->get_value();
 
@@ -222,25 +340,30 @@ void SoftmaxCrossEntropyKernel::forward() {
     throw ValueError("Incompatible shape for softmax: " + vstr(x.shape()));
   }
 
-  auto max_x = x.reduce_max(1, true);
-  auto x_sub_max_x = x.sub(max_x);
-  auto logsum = x_sub_max_x.exp().reduce_sum(1, true).log_();
-  logsum.add_(max_x);
-  auto log_sm = x.sub(logsum);
+  auto X = lazy::ref(x);
+  auto Y = lazy::ref(y);
+  float batch = shape[0];
+
+  // log(sum(exp(x))) per row, shifted by the row max for stability
+  auto max_x = lazy::ref(x.reduce_max(1, true));
+  auto sum_exp = lazy::ref(lazy::sum(exp(X - max_x), 1, true));
+  auto logsum = lazy::ref(lazy::eval(log(sum_exp) + max_x));
   
-  // calculate derivative
-  derivative_ = log_sm.exp_().sub_(y).divs_(shape[0]);
+  // calculate derivative: softmax(x) - y
+  if (training_) {
+    derivative_ = lazy::eval((exp(X - logsum) - Y) / batch);
+  }
   
-  // calculate CE loss
-  value_ = x_sub_max_x.muls_(-1.0f).mul_(y).reduce_sum();
-  value_.divs_(shape[0]);
+  // calculate CE loss: -y * log(softmax(x))
+  value_ = lazy::sum((logsum - X) * Y / batch);
 }
 
 void SoftmaxCrossEntropyKernel::backward(const NDArray& output_grad) {
   if (gradients_.empty()) {
-    gradients_[inputs_[0]].zeros(inputs_[0]->get_value().shape());
+    gradients_.resize(inputs_.size());
+    gradients_[0].zeros(inputs_[0]->get_value().shape());
   }
-  gradients_[inputs_[0]].add_(derivative_.mul(output_grad));
+  gradients_[0].add_(derivative_.mul(output_grad));
 }
 
 std::string SoftmaxCrossEntropyKernel::str() const {
@@ -249,12 +372,28 @@ std::string SoftmaxCrossEntropyKernel::str() const {
     + ")";
 }
 
+std::string SoftmaxCrossEntropyKernel::name() const {
+  return "softmax_ce";
+}
+
+size_t SoftmaxCrossEntropyKernel::flops(bool backward) const {
+  return (backward ? 2 : 5) * inputs_[0]->get_value().size();
+}
+
 std::string ReLUKernel::str() const {
   return "ReLU("
     + inputs_[0]->get_value().str()
     + ")";
 }
 
+std::string ReLUKernel::name() const {
+  return "relu";
+}
+
+size_t ReLUKernel::flops(bool backward) const {
+  return value_.size();
+}
+
 void ReLUKernel::forward() {
   //ln(1.0 + e^x)
   //auto ones = NDArray();
@@ -267,14 +406,17 @@ void ReLUKernel::forward() {
   //derivative_.muls_(-1.0f).exp_().add_(ones).recip_();
 
   value_ = inputs_[0]->get_value().max_filter(0.0f);
-  derivative_ = value_.minimum(0.0f, 1.0f);
+  if (training_) {
+    mask_ = BitMask(value_);
+  }
 }
 
 void ReLUKernel::backward(const NDArray& output_grad) {
   if (gradients_.empty()) {
-    gradients_[inputs_[0]].zeros(derivative_.shape());
+    gradients_.resize(inputs_.size());
+    gradients_[0] = mask_.apply(output_grad);
+  } else {
+    gradients_[0].add_(mask_.apply(output_grad));
   }
-
-  gradients_[inputs_[0]].add_(output_grad.mul(derivative_));
 }
 
@@ -3,9 +3,9 @@
 
 #include <vector>
 #include <memory>
-#include <unordered_map>
 
 #include "ndarray.h"
+#include "mask.h"
 #include "graph.h"
 
 class Kernel {
@@ -27,12 +27,12 @@ class Kernel {
       return inputs_;
     }
 
-    const NDArray& get_gradient(const NodeRef& node) const {
+    // gradient w.r.t. inputs_[input] accumulated since clear_gradients()
+    const NDArray& get_gradient(size_t input) const {
       static NDArray default_grad({1}, {0});
 
-      const auto& it = gradients_.find(node);
-      if (it != gradients_.end()) {
-        return it->second;
+      if (input < gradients_.size()) {
+        return gradients_[input];
       }
 
       return default_grad;
@@ -42,14 +42,60 @@ class Kernel {
       gradients_.clear();
     }
 
+    // false if backward() needs neither the values nor the shapes of the
+    // inputs, which then do not have to outlive the forward pass
+    virtual bool backward_reads_inputs() const {
+      return true;
+    }
+
+    // Used by the memory planner to drop tensors as soon as the step does
+    // not need them anymore.
+    void release_value() {
+      value_ = NDArray();
+    }
+
+    void release_gradient(size_t input) {
+      if (input < gradients_.size()) {
+        gradients_[input] = NDArray();
+      }
+    }
+
+    // whatever forward() saved for backward()
+    virtual void release_saved() { }
+
+    // bumped whenever a leaf gets a new value
+    size_t version() const {
+      return version_;
+    }
+
+    // false when no backward() follows forward(), which then skips
+    // saving anything for it
+    void set_training(bool training) {
+      training_ = training;
+    }
+
     virtual std::string str() const {
       return "kernel";
     }
 
+    // short name of the operation, e.g. for profiles
+    virtual std::string name() const {
+      return "kernel";
+    }
+
+    // estimated floating point operations of forward() or backward() for
+    // the current input values
+    virtual size_t flops(bool backward) const {
+      return 0;
+    }
+
   protected:
     NDArray value_;
+    size_t version_ = 0;
+    bool training_ = true;
     std::vector<NodeRef> inputs_;
-    std::unordered_map<NodeRef, NDArray> gradients_;
+    // one slot per input, empty until the first backward()
+    std::vector<NDArray> gradients_;
 };
 
 class ValueKernel : public Kernel {
@@ -59,18 +105,53 @@ class ValueKernel : public Kernel {
       value_.zeros(shape.v());
     }
     void set_value(const NDArray& value) {
-      value_ = value;
+      if (bound_) {
+        if (value.size() != value_.size()) {
+          throw IncompatibleShapes("set_value of a flattened variable",
+              {value_.shape(), value.shape()});
+        }
+        const NDArray c = value.contiguous();
+        std::copy(c.data(), c.data() + c.size(), value_.shared_data());
+      } else {
+        value_ = value;
+      }
+      version_++;
+    }
+
+    float* mutable_data() {
+      version_++;
+      return bound_ ? value_.shared_data() : value_.mutable_data();
+    }
+
+    // makes value_ a view (e.g. into a flat buffer) which set_value() and
+    // mutable_data() write through instead of copying it
+    void bind(const NDArray& view) {
+      value_ = view;
+      bound_ = true;
+      version_++;
     }
 
     virtual std::string str() const {
       return value_.str();
     }
+
+    virtual std::string name() const override {
+      return "value";
+    }
+
+  private:
+    bool bound_ = false;
 };
 
 class AddKernel : public Kernel {
   public:
     AddKernel() = default;
     virtual std::string str() const override;
+    virtual std::string name() const override;
+    virtual size_t flops(bool backward) const override;
+    virtual bool backward_reads_inputs() const override {
+      return false;
+    }
     
   protected:
     virtual void forward() override;
@@ -82,6 +163,8 @@ class SubKernel : public Kernel {
   public:
     SubKernel() = default;
     virtual std::string str() const override;
+    virtual std::string name() const override;
+    virtual size_t flops(bool backward) const override;
 
   protected:
     virtual void forward() override;
@@ -93,6 +176,8 @@ class MulKernel : public Kernel {
   public:
     MulKernel() = default;
     virtual std::string str() const override;
+    virtual std::string name() const override;
+    virtual size_t flops(bool backward) const override;
 
   protected:
     virtual void forward() override;
@@ -104,6 +189,8 @@ class DotKernel : public Kernel {
   public:
     DotKernel() = default;
     virtual std::string str() const override;
+    virtual std::string name() const override;
+    virtual size_t flops(bool backward) const override;
 
   protected:
     virtual void forward() override;
@@ -115,6 +202,8 @@ class MatMulKernel : public Kernel {
   public:
     MatMulKernel() = default;
     virtual std::string str() const override;
+    virtual std::string name() const override;
+    virtual size_t flops(bool backward) const override;
 
   protected:
     virtual void forward() override;
@@ -126,6 +215,8 @@ class BatchMatMulKernel : public Kernel {
   public:
     BatchMatMulKernel() = default;
     virtual std::string str() const override;
+    virtual std::string name() const override;
+    virtual size_t flops(bool backward) const override;
 
   protected:
     virtual void forward() override;
@@ -133,23 +224,61 @@ class BatchMatMulKernel : public Kernel {
 };
 
 
+// x mm W + b, optionally followed by ReLU, as a single node. Made by
+// the graph's fusion pass out of mm -> add (-> relu) chains, a row bias is
+// added by the GEMM epilogue.
+class LinearKernel : public Kernel {
+  public:
+    explicit LinearKernel(bool relu) : relu_(relu) { }
+    virtual std::string str() const override;
+    virtual std::string name() const override;
+    virtual size_t flops(bool backward) const override;
+    virtual void release_saved() override {
+      mask_ = BitMask();
+    }
+
+  protected:
+    virtual void forward() override;
+    virtual void backward(const NDArray& output_grad) override;
+
+  private:
+    bool relu_;
+    // output > 0 if relu_
+    BitMask mask_;
+};
+
+
 class SoftmaxKernel : public Kernel {
   public:
     SoftmaxKernel() = default;
     virtual std::string str() const override;
+    virtual std::string name() const override;
+    virtual size_t flops(bool backward) const override;
+    virtual bool backward_reads_inputs() const override {
+      return false;
+    }
+    virtual void release_saved() override {
+      output_ = NDArray();
+    }
 
   protected:
     virtual void forward() override;
     virtual void backward(const NDArray& output_grad) override;
 
   private:
-    NDArray derivative_;
+    // value_ may be dropped by the memory planner before backward()
+    NDArray output_;
 };
 
 class SoftmaxCrossEntropyKernel : public Kernel {
   public:
     SoftmaxCrossEntropyKernel() = default;
     virtual std::string str() const override;
+    virtual std::string name() const override;
+    virtual size_t flops(bool backward) const override;
+    virtual void release_saved() override {
+      derivative_ = NDArray();
+    }
 
   protected:
     virtual void forward() override;
@@ -163,13 +292,22 @@ class ReLUKernel : public Kernel {
   public:
     ReLUKernel() = default;
     virtual std::string str() const override;
+    virtual std::string name() const override;
+    virtual size_t flops(bool backward) const override;
+    virtual bool backward_reads_inputs() const override {
+      return false;
+    }
+    virtual void release_saved() override {
+      mask_ = BitMask();
+    }
 
   protected:
     virtual void forward() override;
     virtual void backward(const NDArray& output_grad) override;
  
   private:
-    NDArray derivative_;
+    // output > 0, one bit per element
+    BitMask mask_;
 };
 
 #endif // _kernel_h_
@@ -1,9 +1,12 @@
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
 #include <iomanip>
 #include "graph.h"
 #include "kernel.h"
 #include "ndarray.h"
 #include "mnist.h"
+#include "optim.h"
 
 
 OpRef linear(OpRef x, size_t inp_size, size_t out_size) {
@@ -18,27 +21,6 @@ OpRef linear(OpRef x, size_t inp_size, size_t out_size) {
   return x->mm(W)->add(b);
 }
 
-void sgd(GraphRef g, float learning_rate) {
-  auto variables = g->get_variables();
-
-  for (auto& var : variables) {
-    auto v = var->get_value();
-    const auto& batch_grad = g->gradient(var);
-    //std::cout << "sum(grad): " << batch_grad.reduce_sum() << std::endl;
-    v.sub_(batch_grad.muls(learning_rate));
-    var->set_value(v);
-  }
-}
-
-NDArray one_hot(size_t batch_size, size_t classes, const std::vector<int>& data) {
-  NDArray result({batch_size, classes});
-  for (size_t i = 0; i < data.size(); ++i) {
-    result.set({i, size_t(data[i])}, 1.0f);
-  }
-  result.reshape({batch_size, classes});
-  return result;
-}
-
 void print_stat(const std::vector<int>& labels, const NDArray& predictions) {
   auto prediction_labels = predictions.argmax(1).vec();
   int match = 0;
@@ -70,27 +52,65 @@ int main() {
   auto l3 = linear(l1, 512, 10);
   auto loss = l3->softmax_ce(y);
   auto pred = l3->softmax();
-  
+  SGD optimizer(g, 0.1f);
+
   size_t batch_size = 100;
-  size_t classes = 10;
   int steps = 1000;
   float epoch = 0;
+  MNISTLoader loader(mnist, batch_size);
+  // UFLOW_PROFILE=trace.json profiles step 1 (once the plan is compiled)
+  // into a Chrome trace and prints a summary
+  const char* profile = std::getenv("UFLOW_PROFILE");
 
   for (int i = 0; i < steps; ++i) {
-    auto batch = mnist.get_train_batch(batch_size);
-    auto& batch_X = std::get<0>(batch);
-    auto& batch_y = std::get<1>(batch);
-
-    X->set_value(NDArray({batch_size, 28*28}, batch_X));
-    y->set_value(one_hot(batch_size, classes, batch_y));
-    g->forward();
+    const auto& batch = loader.next();
+    X->set_value(batch.images);
+    y->set_value(batch.targets);
+    g->set_profiling(profile != nullptr && i == 1);
+    g->forward({loss, pred});
+    if (i == 0) {
+      std::cout << "pruned " << g->pruned().size()
+        << " nodes not needed for loss and pred" << std::endl;
+    }
 
     epoch += float(batch_size) / float(mnist.train_size);
     std::cout << std::fixed << std::setw(6) << std::setprecision(6)
       << "epoch: " << epoch << "\tloss: " << loss->get_value() <<std::endl;
-    print_stat(batch_y, pred->get_value());
+    print_stat(batch.labels, pred->get_value());
     g->backward(loss);
-    sgd(g, 0.1);
+    optimizer.step();
+
+    if (profile != nullptr && i == 1) {
+      std::ofstream trace(profile);
+      g->profile().write_trace(trace);
+      g->profile().write_summary(std::cout);
+    }
+  }
+
+  // accuracy over the test set, in batches, without backward state
+  g->set_inference(true);
+  std::vector<size_t> idx(batch_size);
+  std::vector<int> labels(batch_size);
+  size_t match = 0;
+  size_t tested = 0;
+  for (; tested + batch_size <= mnist.test_size; tested += batch_size) {
+    for (size_t i = 0; i < batch_size; ++i) {
+      idx[i] = tested + i;
+    }
+    // a fresh array, X still holds the last one
+    NDArray images({batch_size, MNIST::img_size});
+    mnist.gather_test(idx.data(), batch_size, images.mutable_data(),
+        nullptr, labels.data());
+    X->set_value(images);
+    g->forward({pred});
+    auto predicted = pred->get_value().argmax(1).vec();
+    for (size_t i = 0; i < batch_size; ++i) {
+      match += labels[i] == int(predicted[i]);
+    }
+  }
+  g->set_inference(false);
+  if (tested > 0) {
+    std::cout << "test acc: " << float(match) / tested << std::endl;
   }
   //std::cout << pred->get_value() << std::endl;
   return 0;
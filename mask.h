@@ -0,0 +1,204 @@
+#ifndef _mask_h_
+#define _mask_h_
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+
+#include "ndarray.h"
+
+/*
+ * Packed masks for the backward pass of piecewise linear activations.
+ *
+ * The gradient of ReLU only depends on which outputs are positive, so
+ * instead of a float derivative per element (32 bits) a BitMask keeps one
+ * bit: element i is bit i % 64 of word i / 64. apply() zeroes the gradient
+ * where the bit is clear, with AVX-512 mask registers, an AVX2 bit to lane
+ * expansion or a scalar loop, picked at runtime like in vmath.h.
+ */
+
+namespace bitmask {
+
+// words[w] = bits of x[64 w, 64 w + 64) > 0, n is a multiple of 64
+inline void pack_scalar(const float* x, uint64_t* words, size_t n) {
+  for (size_t w = 0; w < n / 64; ++w) {
+    uint64_t bits = 0;
+    for (size_t i = 0; i < 64; ++i) {
+      bits |= uint64_t(x[w * 64 + i] > 0.0f) << i;
+    }
+    words[w] = bits;
+  }
+}
+
+// out[i] = bit i set ? g[i] : 0, n is a multiple of 64
+inline void apply_scalar(const uint64_t* words, const float* g, float* out,
+    size_t n) {
+  for (size_t w = 0; w < n / 64; ++w) {
+    uint64_t bits = words[w];
+    for (size_t i = 0; i < 64; ++i) {
+      out[w * 64 + i] = (bits >> i) & 1 ? g[w * 64 + i] : 0.0f;
+    }
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#define UFLOW_AVX2 __attribute__((target("avx2")))
+#define UFLOW_AVX512 __attribute__((target("avx512f")))
+
+UFLOW_AVX2 inline void pack_avx2(const float* x, uint64_t* words, size_t n) {
+  __m256 zero = _mm256_setzero_ps();
+  for (size_t w = 0; w < n / 64; ++w) {
+    uint64_t bits = 0;
+    for (size_t c = 0; c < 8; ++c) {
+      __m256 v = _mm256_loadu_ps(x + w * 64 + c * 8);
+      uint64_t m = _mm256_movemask_ps(_mm256_cmp_ps(v, zero, _CMP_GT_OQ));
+      bits |= m << (c * 8);
+    }
+    words[w] = bits;
+  }
+}
+
+UFLOW_AVX2 inline void apply_avx2(const uint64_t* words, const float* g,
+    float* out, size_t n) {
+  // lane j is kept if bit j of the broadcast byte is set
+  __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  for (size_t w = 0; w < n / 64; ++w) {
+    uint64_t bits = words[w];
+    for (size_t c = 0; c < 8; ++c) {
+      __m256i byte = _mm256_set1_epi32((bits >> (c * 8)) & 0xff);
+      __m256i keep = _mm256_cmpeq_epi32(
+          _mm256_and_si256(byte, lane_bits), lane_bits);
+      size_t i = w * 64 + c * 8;
+      _mm256_storeu_ps(out + i, _mm256_and_ps(
+            _mm256_loadu_ps(g + i), _mm256_castsi256_ps(keep)));
+    }
+  }
+}
+
+UFLOW_AVX512 inline void pack_avx512(const float* x, uint64_t* words,
+    size_t n) {
+  __m512 zero = _mm512_setzero_ps();
+  for (size_t w = 0; w < n / 64; ++w) {
+    uint64_t bits = 0;
+    for (size_t c = 0; c < 4; ++c) {
+      __m512 v = _mm512_loadu_ps(x + w * 64 + c * 16);
+      uint64_t m = _mm512_cmp_ps_mask(v, zero, _CMP_GT_OQ);
+      bits |= m << (c * 16);
+    }
+    words[w] = bits;
+  }
+}
+
+UFLOW_AVX512 inline void apply_avx512(const uint64_t* words, const float* g,
+    float* out, size_t n) {
+  for (size_t w = 0; w < n / 64; ++w) {
+    uint64_t bits = words[w];
+    for (size_t c = 0; c < 4; ++c) {
+      __mmask16 keep = static_cast<__mmask16>(bits >> (c * 16));
+      size_t i = w * 64 + c * 16;
+      _mm512_storeu_ps(out + i, _mm512_maskz_mov_ps(keep,
+            _mm512_loadu_ps(g + i)));
+    }
+  }
+}
+
+#undef UFLOW_AVX2
+#undef UFLOW_AVX512
+
+#define UFLOW_BITMASK_DISPATCH(name, ...)                   \
+  switch (isa) {                                            \
+    case SimdIsa::avx512: return name##_avx512(__VA_ARGS__); \
+    case SimdIsa::avx2: return name##_avx2(__VA_ARGS__);     \
+    default: return name##_scalar(__VA_ARGS__);              \
+  }
+
+#else
+
+#define UFLOW_BITMASK_DISPATCH(name, ...) \
+  (void) isa;                             \
+  return name##_scalar(__VA_ARGS__);
+
+#endif
+
+inline void pack(const float* x, uint64_t* words, size_t n, SimdIsa isa) {
+  UFLOW_BITMASK_DISPATCH(pack, x, words, n)
+}
+
+inline void apply(const uint64_t* words, const float* g, float* out,
+    size_t n, SimdIsa isa) {
+  UFLOW_BITMASK_DISPATCH(apply, words, g, out, n)
+}
+
+#undef UFLOW_BITMASK_DISPATCH
+
+} // namespace bitmask
+
+class BitMask {
+  public:
+    BitMask() = default;
+
+    // bits of x > 0, isa must be supported by the CPU
+    explicit BitMask(const NDArray& x, SimdIsa isa = simd_isa())
+      : shape_(x.shape()), size_(x.size()), words_((x.size() + 63) / 64) {
+      const NDArray c = x.contiguous();
+      const float* src = c.data();
+      uint64_t* words = words_.data();
+      size_t full = size_ / 64;
+
+      parallel_for(0, full, std::max<size_t>(1, parallel_grain / 64),
+          [&](size_t w0, size_t w1) {
+        bitmask::pack(src + w0 * 64, words + w0, (w1 - w0) * 64, isa);
+      });
+
+      for (size_t i = full * 64; i < size_; ++i) {
+        words[i / 64] |= uint64_t(src[i] > 0.0f) << (i % 64);
+      }
+    }
+
+    const std::vector<size_t>& shape() const {
+      return shape_;
+    }
+
+    size_t size() const {
+      return size_;
+    }
+
+    bool get(size_t i) const {
+      return (words_[i / 64] >> (i % 64)) & 1;
+    }
+
+    // grad (broadcast to shape()) where the mask is set, 0 elsewhere
+    NDArray apply(const NDArray& grad, SimdIsa isa = simd_isa()) const {
+      const NDArray g = grad.expand(shape_).contiguous();
+      NDArray res(shape_);
+      if (size_ == 0) {
+        return res;
+      }
+
+      const float* src = g.data();
+      float* dst = res.mutable_data();
+      const uint64_t* words = words_.data();
+      size_t full = size_ / 64;
+
+      parallel_for(0, full, std::max<size_t>(1, parallel_grain / 64),
+          [&](size_t w0, size_t w1) {
+        bitmask::apply(words + w0, src + w0 * 64, dst + w0 * 64,
+            (w1 - w0) * 64, isa);
+      });
+
+      for (size_t i = full * 64; i < size_; ++i) {
+        dst[i] = get(i) ? src[i] : 0.0f;
+      }
+
+      return res;
+    }
+
+  private:
+    std::vector<size_t> shape_;
+    size_t size_ = 0;
+    std::vector<uint64_t> words_;
+};
+
+#endif // _mask_h_
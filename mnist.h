@@ -1,124 +1,322 @@
 #ifndef _mnist_h_
 #define _mnist_h_
 
-#include <vector>
-#include <fstream>
+#include <mutex>
+#include <tuple>
 #include <random>
-#include <cassert>
+#include <thread>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <exception>
+#include <condition_variable>
 
-class MNIST {
+#include <unistd.h>
+
+#include "idx.h"
+#include "vmath.h"
+#include "ndarray.h"
+
+/*
+ * Shuffled passes over the indices [0, size).
+ *
+ * next() hands out the following indices of the current permutation and
+ * shuffles again once an epoch is used up, a batch may span two epochs.
+ * Every index comes exactly once per epoch and a batch of n costs O(n),
+ * the shuffle amortizes to O(1) per index.
+ */
+class EpochSampler {
   public:
-    MNIST() 
-      : train_idx_(train_size)
-      , test_idx_(test_size) {
-        for (int i = 0; i < train_size; ++i) {
-          train_idx_[i] = i;
-        }
-        
-        for (int i = 0; i < test_size; ++i) {
-          test_idx_[i] = i;
+    explicit EpochSampler(size_t size = 0,
+        unsigned seed = std::random_device()())
+      : indices_(size), engine_(seed) {
+      for (size_t i = 0; i < size; ++i) {
+        indices_[i] = i;
+      }
+      std::shuffle(indices_.begin(), indices_.end(), engine_);
+    }
+
+    void next(size_t* out, size_t n) {
+      if (indices_.empty()) {
+        throw ValueError("cannot sample from an empty set");
+      }
+
+      for (size_t i = 0; i < n; ++i) {
+        out[i] = indices_[pos_++];
+        if (pos_ == indices_.size()) {
+          std::shuffle(indices_.begin(), indices_.end(), engine_);
+          pos_ = 0;
+          epoch_++;
         }
+      }
+    }
+
+    size_t size() const {
+      return indices_.size();
+    }
+
+    // epochs used up so far, i.e. the epoch of the next index
+    size_t epoch() const {
+      return epoch_;
     }
 
+  private:
+    std::vector<size_t> indices_;
+    std::mt19937 engine_;
+    size_t pos_ = 0;
+    size_t epoch_ = 0;
+};
+
+/*
+ * The MNIST training and test sets.
+ *
+ * load() maps the IDX files (see IDXFile) and keeps the pixels as the
+ * bytes they are stored as, the floats only exist for the rows of a batch:
+ * gather_train() and gather_test() convert and scale the selected images
+ * straight into the batch. The test set is loaded if its files are there.
+ */
+class MNIST {
+  public:
     std::tuple<std::vector<float>, std::vector<int>> get_train_batch(size_t size) {
-      std::random_device rd;
-      std::default_random_engine re(rd());
-      std::shuffle(train_idx_.begin(), train_idx_.end(), re);
+      std::vector<size_t> idx(size);
+      sampler_.next(idx.data(), size);
 
       std::vector<float> data(size * img_size);
       std::vector<int> labels(size);
-
-      for (size_t i = 0; i < size; ++i) {
-        int idx = train_idx_[i];
-        size_t offset = i * img_size;
-        size_t img_offset = idx * img_size;
-        
-        std::copy(train_data_.begin() + img_offset, 
-            train_data_.begin() + img_offset + img_size,
-            data.begin() + offset);
-
-        labels[i] = static_cast<int>(train_labels_[idx]);
-      }
+      gather_train(idx.data(), size, data.data(), nullptr, labels.data());
 
       return {data, labels};
     }
 
+    // the training samples idx[0, n) as rows of images (n x img_size),
+    // one-hot rows of targets (n x classes, skipped for nullptr) and labels
+    void gather_train(const size_t* idx, size_t n, float* images,
+        float* targets, int* labels) const {
+      gather(train_images_, train_labels_, idx, n, images, targets, labels);
+    }
+
+    // the same for the test samples
+    void gather_test(const size_t* idx, size_t n, float* images,
+        float* targets, int* labels) const {
+      gather(test_images_, test_labels_, idx, n, images, targets, labels);
+    }
+
     void load(const std::string& path, bool normalize=true) {
-      std::ifstream train_data_s(path + "/train-images-idx3-ubyte",
-          std::ios::binary);
-      
-      if (train_data_s.fail()) {
-        throw std::exception();
+      scale_ = normalize ? 1.0f / 255.0f : 1.0f;
+
+      train_images_ = open_images(path + "/train-images-idx3-ubyte");
+      train_labels_ = open_labels(path + "/train-labels-idx1-ubyte",
+          train_images_);
+      train_size = train_images_.items();
+
+      std::string test_images = path + "/t10k-images-idx3-ubyte";
+      std::string test_labels = path + "/t10k-labels-idx1-ubyte";
+      if (::access(test_images.c_str(), F_OK) == 0
+          && ::access(test_labels.c_str(), F_OK) == 0) {
+        test_images_ = open_images(test_images);
+        test_labels_ = open_labels(test_labels, test_images_);
+      } else {
+        test_images_ = IDXFile();
+        test_labels_ = IDXFile();
       }
+      test_size = test_images_.items();
 
-      uint32_t magic, size, rows, cols;
-      train_data_s.read(reinterpret_cast<char*>(&magic), sizeof(uint32_t));
-      train_data_s.read(reinterpret_cast<char*>(&size), sizeof(uint32_t));
-      train_data_s.read(reinterpret_cast<char*>(&rows), sizeof(uint32_t));
-      train_data_s.read(reinterpret_cast<char*>(&cols), sizeof(uint32_t));
-   
-      magic = msb_to_lsb(magic);
-      size = msb_to_lsb(size);
-      rows = msb_to_lsb(rows);
-      cols = msb_to_lsb(cols);
-
-      assert(magic == 0x00000803);
-      assert(size == train_size);
-      assert(rows * cols == img_size);
-
-      size_t pos = 0;
-      train_data_.resize(train_size * img_size);
-
-      for (size_t i = 0; i < train_size; ++i) {
-        unsigned char buf[img_size];
-        train_data_s.read(reinterpret_cast<char*>(buf), img_size);
-        
-        for (size_t j = 0; j < img_size; ++j) {
-          train_data_[pos] = static_cast<float>(buf[j]);
-          if (normalize) {
-            train_data_[pos] /= 255.0f;
-          }
-          ++pos;
+      sampler_ = EpochSampler(train_size);
+    }
+
+    static const size_t img_size = 28 * 28;
+    static const size_t classes = 10;
+    // as given by the files, set by load()
+    size_t train_size = 60000;
+    size_t test_size = 10000;
+
+  private:
+    static IDXFile open_images(const std::string& path) {
+      IDXFile images(path);
+      if (images.type() != IDXFile::u8 || images.dims().size() != 3
+          || images.item_size() != img_size) {
+        throw ValueError(path + ": expected uint8 images of 28 x 28, got "
+            + vstr(images.dims()));
+      }
+      return images;
+    }
+
+    static IDXFile open_labels(const std::string& path,
+        const IDXFile& images) {
+      IDXFile labels(path);
+      if (labels.type() != IDXFile::u8 || labels.dims().size() != 1
+          || labels.items() != images.items()) {
+        throw ValueError(path + ": expected " + std::to_string(images.items())
+            + " uint8 labels, got " + vstr(labels.dims()));
+      }
+      return labels;
+    }
+
+    void gather(const IDXFile& images, const IDXFile& labels,
+        const size_t* idx, size_t n, float* out, float* targets,
+        int* out_labels) const {
+      if (targets != nullptr) {
+        std::fill(targets, targets + n * classes, 0.0f);
+      }
+      for (size_t i = 0; i < n; ++i) {
+        if (idx[i] >= images.items()) {
+          throw ValueError("sample " + std::to_string(idx[i])
+              + " out of range");
+        }
+        vscale_u8(images.item(idx[i]), out + i * img_size, img_size, scale_);
+
+        int label = labels.data()[idx[i]];
+        if (label >= int(classes)) {
+          throw ValueError("label " + std::to_string(label)
+              + " out of range");
+        }
+        out_labels[i] = label;
+        if (targets != nullptr) {
+          targets[i * classes + label] = 1.0f;
         }
       }
+    }
+
+    float scale_ = 1.0f / 255.0f;
+    EpochSampler sampler_;
+
+    IDXFile train_images_;
+    IDXFile train_labels_;
+
+    IDXFile test_images_;
+    IDXFile test_labels_;
+};
+
+/*
+ * Shuffled training batches assembled by a background thread.
+ *
+ * The loader owns a ring of depth batches whose arrays are allocated once
+ * and refilled in place. next() waits for the next filled batch (only if
+ * the thread fell behind) and hands it out. A batch stays untouched until
+ * the call after the next one, so the graph may still hold the arrays of
+ * the previous batch while the new one is set. If someone holds on to
+ * the arrays for longer they are not overwritten, the loader allocates
+ * new ones instead (see NDArray::mutable_data).
+ */
+class MNISTLoader {
+  public:
+    struct Batch {
+      // batch_size x img_size
+      NDArray images;
+      // batch_size x classes, one-hot
+      NDArray targets;
+      std::vector<int> labels;
+      // of the sampler when the batch was drawn
+      size_t epoch = 0;
+    };
+
+    MNISTLoader(const MNIST& mnist, size_t batch_size, size_t depth = 4,
+        unsigned seed = std::random_device()())
+      : mnist_(mnist), batch_size_(batch_size),
+        sampler_(mnist.train_size, seed), slots_(std::max<size_t>(depth, 3)),
+        state_(slots_.size(), empty) {
+      for (auto& slot : slots_) {
+        slot.images = NDArray({batch_size, MNIST::img_size});
+        slot.targets = NDArray({batch_size, MNIST::classes});
+        slot.labels.resize(batch_size);
+      }
+      thread_ = std::thread([this]() { run(); });
+    }
+
+    ~MNISTLoader() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+      }
+      cv_.notify_all();
+      thread_.join();
+    }
+
+    const Batch& next() {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (handed_out_ >= 2) {
+        state_[(consume_ + slots_.size() - 2) % slots_.size()] = empty;
+        cv_.notify_all();
+      }
+
+      cv_.wait(lock, [&]() {
+          return state_[consume_] == ready || error_;
+        });
+      if (error_) {
+        std::rethrow_exception(error_);
+      }
+
+      state_[consume_] = held;
+      const Batch& batch = slots_[consume_];
+      consume_ = (consume_ + 1) % slots_.size();
+      handed_out_++;
+      return batch;
+    }
+
+    size_t batch_size() const {
+      return batch_size_;
+    }
 
-      std::ifstream train_labels_s(path + "/train-labels-idx1-ubyte",
-          std::ios::binary);
-      train_labels_s.read(reinterpret_cast<char*>(&magic), sizeof(uint32_t));
-      train_labels_s.read(reinterpret_cast<char*>(&size), sizeof(uint32_t));
-   
-      magic = msb_to_lsb(magic);
-      size = msb_to_lsb(size);
-
-      assert(magic == 0x00000801);
-      assert(size == train_size);
-      train_labels_.reserve(train_size);
-      train_labels_.assign((std::istreambuf_iterator<char>(train_labels_s)),
-                           (std::istreambuf_iterator<char>()));
-    }
-
-    const size_t img_size = 28 * 28;
-    const size_t train_size = 60000;
-    const size_t test_size = 10000;
-  
   private:
-    uint32_t msb_to_lsb(uint32_t val) {
-      return ((val >> 24) & 0xff)
-        | ((val << 8) & 0xff0000)
-        | ((val >> 8) & 0xff00)
-        | ((val << 24) & 0xff000000);
-    }
-
-    std::random_device rd_;
- 
-    std::vector<int> train_idx_;
-    std::vector<float> train_data_;
-    std::vector<char> train_labels_;
-
-    std::vector<int> test_idx_;
-    std::vector<float> test_data_;
-    std::vector<char> test_labels_;
+    MNISTLoader(const MNISTLoader&) = delete;
+    const MNISTLoader& operator=(const MNISTLoader&) = delete;
+
+    enum State { empty, ready, held };
+
+    void run() {
+      std::vector<size_t> idx(batch_size_);
+      size_t produce = 0;
+
+      try {
+        while (true) {
+          {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [&]() {
+                return stop_ || state_[produce] == empty;
+              });
+            if (stop_) {
+              return;
+            }
+          }
+
+          // the slot is ours until it is marked ready
+          Batch& batch = slots_[produce];
+          batch.epoch = sampler_.epoch();
+          sampler_.next(idx.data(), batch_size_);
+          mnist_.gather_train(idx.data(), batch_size_,
+              batch.images.mutable_data(), batch.targets.mutable_data(),
+              batch.labels.data());
+
+          {
+            std::lock_guard<std::mutex> lock(mutex_);
+            state_[produce] = ready;
+          }
+          cv_.notify_all();
+          produce = (produce + 1) % slots_.size();
+        }
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        error_ = std::current_exception();
+        cv_.notify_all();
+      }
+    }
+
+    const MNIST& mnist_;
+    size_t batch_size_;
+    // only used by the thread
+    EpochSampler sampler_;
+
+    std::vector<Batch> slots_;
+    std::vector<State> state_;
+    // next slot next() hands out
+    size_t consume_ = 0;
+    size_t handed_out_ = 0;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+    std::exception_ptr error_;
+    std::thread thread_;
 };
 
 #endif // _mnist_h_
-
@@ -2,12 +2,18 @@
 #define _ndarray_h_
 
 #include <cmath>
+#include <memory>
 #include <vector>
 #include <utility>
 #include <algorithm>
+#include <functional>
 #include <iostream>
 #include "util.h"
 #include "exception.h"
+#include "gemm.h"
+#include "thread_pool.h"
+#include "arena.h"
+#include "vmath.h"
 
 class NDArray;
 std::ostream& operator<<(std::ostream& os, const NDArray& arr);
@@ -101,6 +107,45 @@ class Shape {
     std::vector<size_t> v_;
 };
 
+
+// op folded over n contiguous elements, with independent accumulators so
+// the loop vectorizes without reassociating float math
+template <class Op>
+inline float reduce_span(const Op& op, const float* x, size_t n, float init) {
+  const size_t lanes = 16;
+  float acc[lanes];
+  std::fill(acc, acc + lanes, init);
+
+  size_t i = 0;
+  for (; i + lanes <= n; i += lanes) {
+    for (size_t k = 0; k < lanes; ++k) {
+      acc[k] = op(acc[k], x[i + k]);
+    }
+  }
+  for (size_t k = 0; i < n; ++i, ++k) {
+    acc[k] = op(acc[k], x[i]);
+  }
+
+  for (size_t w = lanes / 2; w > 0; w /= 2) {
+    for (size_t k = 0; k < w; ++k) {
+      acc[k] = op(acc[k], acc[k + w]);
+    }
+  }
+  return acc[0];
+}
+
+/*
+ * N dimensional float array.
+ *
+ * The elements live in reference counted storage (see allocate_storage()
+ * in arena.h), an NDArray is a view into it described by an offset and per
+ * axis strides. Copies, transpose, expand, slice, squeeze/unsqueeze and
+ * reshape of contiguous arrays are O(1) and share the storage. Mutating
+ * operations are copy-on-write: they write in place only if the array is
+ * contiguous and nobody else refers to its storage, otherwise they
+ * reallocate first. Operations which index the elements linearly read
+ * through contiguous(), which only copies views that are not contiguous.
+ */
 class NDArray {
   public:
     NDArray() {} 
@@ -108,11 +153,12 @@ class NDArray {
     NDArray(const std::vector<size_t>& shape,
             const std::vector<float>& init = std::vector<float>())
       : shape_(shape) {
-      update_shape();
+      allocate_();
       
       if (!init.empty()) {
-        for (size_t i = 0; i < arr_.size(); ++i) {
-          arr_[i] = init[i % init.size()];  
+        float* arr = storage_.get();
+        for (size_t i = 0; i < size_; ++i) {
+          arr[i] = init[i % init.size()];  
         }
       }
     }
@@ -122,8 +168,11 @@ class NDArray {
         return false;
       }
 
-      for (size_t i = 0; i < arr_.size(); ++i) {
-        if (arr_[i] != other.arr_[i]) {
+      auto a = contiguous();
+      auto b = other.contiguous();
+
+      for (size_t i = 0; i < size_; ++i) {
+        if (a.data()[i] != b.data()[i]) {
           return false;
         }
       }
@@ -132,7 +181,87 @@ class NDArray {
     }
 
     const std::vector<float> vec() const {
-      return arr_;
+      auto c = contiguous();
+      return std::vector<float>(c.data(), c.data() + size_);
+    }
+
+    size_t size() const {
+      return size_;
+    }
+
+    // first element, the rest is at the offsets given by strides()
+    const float* data() const {
+      return storage_ ? storage_.get() + offset_ : nullptr;
+    }
+
+    // contiguous, unshared elements which can be written in place
+    float* mutable_data() {
+      if (storage_ && !writable_()) {
+        *this = clone();
+      }
+      return storage_ ? storage_.get() + offset_ : nullptr;
+    }
+
+    // elements of a contiguous array written in place even if the storage
+    // is shared, unlike mutable_data() every array sharing it sees the
+    // writes (e.g. views into one flat buffer)
+    float* shared_data() {
+      if (!is_contiguous()) {
+        throw RuntimeError("NDArray::shared_data: array is not contiguous");
+      }
+      return storage_ ? storage_.get() + offset_ : nullptr;
+    }
+
+    const std::vector<size_t>& strides() const {
+      return strides_;
+    }
+
+    bool is_contiguous() const {
+      size_t expected = 1;
+      for (size_t i = shape_.size(); i > 0; --i) {
+        size_t idx = i - 1;
+        if (shape_[idx] != 1 && strides_[idx] != expected) {
+          return false;
+        }
+        expected *= shape_[idx];
+      }
+      return true;
+    }
+
+    // self if already contiguous, otherwise a contiguous copy
+    NDArray contiguous() const {
+      return is_contiguous() ? *this : clone();
+    }
+
+    // contiguous copy with its own storage
+    NDArray clone() const {
+      NDArray res(shape_);
+      if (size_ == 0) {
+        return res;
+      }
+
+      size_t inner = shape_.empty() ? 1 : shape_.back();
+      size_t inner_stride = shape_.empty() ? 1 : strides_.back();
+      size_t rows = size_ / inner;
+      const float* src = data();
+      float* dst = res.storage_.get();
+
+      parallel_for(0, rows, std::max<size_t>(1, parallel_grain / inner),
+          [&](size_t r0, size_t r1) {
+        for (size_t r = r0; r < r1; ++r) {
+          const float* s = src + row_offset_(r);
+          float* d = dst + r * inner;
+          if (inner_stride == 1) {
+            std::copy(s, s + inner, d);
+          } else {
+            for (size_t j = 0; j < inner; ++j) {
+              d[j] = s[j * inner_stride];
+            }
+          }
+        }
+      });
+
+      return res;
     }
 
     void squeeze(size_t axis) {
@@ -146,7 +275,7 @@ class NDArray {
       }
 
       shape_.erase(shape_.begin() + axis);
-      update_shape();
+      strides_.erase(strides_.begin() + axis);
     }
 
     void unsqueeze(size_t axis) {
@@ -158,48 +287,36 @@ class NDArray {
             + std::to_string(axis));
       }
 
+      if (!storage_) {
+        shape_.insert(shape_.begin() + axis, 1);
+        allocate_();
+        return;
+      }
+
+      size_t stride = axis < shape_.size() ? shape_[axis] * strides_[axis] : 1;
       shape_.insert(shape_.begin() + axis, 1);
-      update_shape();
+      strides_.insert(strides_.begin() + axis, stride);
     }
 
     void ones(const std::vector<size_t>& shape) {
       shape_ = shape;
-      update_shape();
+      allocate_();
 
-      for (auto& val : arr_) {
-        val = 1.0f;
-      }
+      std::fill_n(storage_.get(), size_, 1.0f);
     }
 
     void zeros(const std::vector<size_t>& shape) {
       shape_ = shape;
-      update_shape();
-
-      for (auto& val : arr_) {
-        val = 0.0f;
-      }
+      allocate_();
     }
 
     void arange(size_t n, float step = 1.0f) {
       shape_ = std::vector<size_t>{n};
-      update_shape();
+      allocate_();
 
-      for (size_t i = 0; i < arr_.size(); ++i) {
-        arr_[i] = i * step;
-      }
-    }
-
-    void update_shape() {
-      size_t size = 1;
-      for (auto dim : shape_) {
-        size *= dim;
-      }
-
-      arr_.resize(size, 0.0f); 
-      
-      strides_ = std::vector<size_t>(shape_.size(), 1);
-      for (int i = shape_.size() - 2; i >= 0; --i) {
-        strides_[i] = shape_[i + 1] * strides_[i + 1];
+      float* arr = storage_.get();
+      for (size_t i = 0; i < size_; ++i) {
+        arr[i] = i * step;
       }
     }
 
@@ -215,21 +332,48 @@ class NDArray {
         }
       }
 
-      if (new_size != arr_.size()) {
+      if (new_size != size_) {
         throw IncompatibleShapes("reshape", {shape_, shape});
       }
 
+      // only contiguous elements can be reinterpreted with a new shape
+      if (!is_contiguous()) {
+        *this = clone();
+      }
+
       shape_ = shape;
-      update_shape();
+      init_strides_();
+    }
+
+    // O(1) view of [begin, end) along axis
+    NDArray slice(size_t axis, size_t begin, size_t end) const {
+      if (axis >= shape_.size() || begin > end || end > shape_[axis]) {
+        throw RuntimeError("NDArray::slice: cannot slice "
+            + vstr(shape_)
+            + " at axis "
+            + std::to_string(axis)
+            + " with ["
+            + std::to_string(begin)
+            + ", "
+            + std::to_string(end)
+            + ")");
+      }
+
+      NDArray res = *this;
+      res.offset_ += begin * strides_[axis];
+      res.size_ = size_ / shape_[axis] * (end - begin);
+      res.shape_[axis] = end - begin;
+      return res;
     }
 
+    // expects a contiguous array, see str()
     void str_helper(std::stringstream& ss, int dim, int& pos, int level) const {
       int ndim = shape_.size();
 
       if (dim == ndim - 1) {
         ss << "[";
         for (int i = 0; i < shape_[dim]; ++i) {
-          ss << arr_[pos++];
+          ss << data()[pos++];
           if (i != shape_[dim] - 1) {
             ss << ", ";
           }
@@ -253,67 +397,50 @@ class NDArray {
       }
       std::stringstream ss;
       int pos = 0;
-      str_helper(ss, 0, pos, 1);
+      contiguous().str_helper(ss, 0, pos, 1);
       return ss.str();
     }
 
     NDArray& operator=(const NDArray& other) = default;
     
+    // O(1) view with the last two axes swapped
     NDArray transpose() const {
       if (shape_.size() < 2) {
         throw RuntimeError("cannot transpose array");
       }
 
-      NDArray res(shape_);
+      NDArray res = *this;
 
       size_t i1 = res.shape_.size() - 2;
       size_t i2 = res.shape_.size() - 1;
-      size_t d1 = res.shape_[i1];
-      size_t d2 = res.shape_[i2];
-      
-      size_t count = 1;
-      for (size_t i = 0; i < shape_.size() - 2; ++i) {
-        count *= shape_[i];
-      }
-      
-      size_t stride = d1 * d2;
-
-      for (size_t c = 0; c < count; ++c) {
-        size_t offset = c * stride;
-        auto oa = &arr_[offset];
-        auto ra = &res.arr_[offset];
-        
-        for (size_t i = 0; i < d1; ++i) {
-          for (size_t j = 0; j < d2; ++j) {
-            ra[j * d1 + i] = oa[i * d2 + j];
-          }
-        }
-      }
-
       std::swap(res.shape_[i1], res.shape_[i2]);
+      std::swap(res.strides_[i1], res.strides_[i2]);
       return res;
     }
 
 
     std::vector<size_t> get_common_shape(const NDArray& other) const {
-      auto& shape1 = shape_;
-      auto& shape2 = other.shape_;
+      return common_shape(shape_, other.shape_);
+    }
 
+    // shape both broadcast to, empty if they are incompatible
+    static std::vector<size_t> common_shape(const std::vector<size_t>& shape1,
+        const std::vector<size_t>& shape2) {
       size_t s1 = shape1.size();
       size_t s2 = shape2.size();
       size_t sc = std::max(s1, s2);
-      std::vector<size_t> common_shape(sc);
+      std::vector<size_t> shape(sc);
       
-      for (size_t i = 0; i < common_shape.size(); ++i) {
+      for (size_t i = 0; i < shape.size(); ++i) {
         size_t d1 = i < s1 ? shape1[s1 - i - 1] : 1;
         size_t d2 = i < s2 ? shape2[s2 - i - 1] : 1;
         if (std::min(d1, d2) != 1 && d1 != d2) {
           return std::vector<size_t>();
         }
-        common_shape[sc - i - 1] = std::max(d1, d2);
+        shape[sc - i - 1] = std::max(d1, d2);
       }
       
-      return common_shape;
+      return shape;
     }
 
     std::vector<size_t> strides(const std::vector<size_t>& shape_d) const {
@@ -338,40 +465,30 @@ class NDArray {
       return expand(other.shape());
     }
 
+    // O(1) broadcast view, expanded axes have stride 0
     NDArray expand(const std::vector<size_t>& new_shape) const {
       if (shape_ == new_shape) {
         return *this;
       }
 
-      NDArray res(new_shape);
-      if (arr_.empty()) {
-        return res;
+      if (size_ == 0) {
+        return NDArray(new_shape);
       }
 
-      auto strides_d = strides(new_shape);
-      
-      std::vector<size_t> nonzero_strides;
-      for (auto s : strides_d) {
-        if (s != 0) {
-          nonzero_strides.push_back(s);
-        }
+      bool ok = new_shape.size() >= shape_.size();
+      size_t offs = new_shape.size() - shape_.size();
+      for (size_t i = 0; ok && i < shape_.size(); ++i) {
+        ok = shape_[i] == 1 || shape_[i] == new_shape[i + offs];
       }
 
-      for (size_t pos = 0; pos < res.arr_.size(); ++pos) {
-        size_t inc = 0;
-        size_t tmp = pos;
-        for (size_t i = new_shape.size(); i > 0; --i) {
-          size_t idx = i - 1;
-          size_t n = tmp % new_shape[idx];
-          inc += n * strides_d[idx];
-          tmp /= new_shape[idx];
-        }
-        if (tmp > 0) {
-          inc = new_shape[0] * nonzero_strides[0];
-        }
-        res.arr_[pos] = arr_[inc];
+      if (!ok) {
+        throw IncompatibleShapes("NDArray::expand", {shape_, new_shape});
       }
 
+      NDArray res = *this;
+      res.strides_ = strides(new_shape);
+      res.shape_ = new_shape;
+      res.size_ = shape_size(new_shape);
       return res;
     }
 
@@ -387,12 +504,14 @@ class NDArray {
         }
       }
 
+      float* arr = mutable_data();
+
       size_t pos = 0;
       for (size_t i = 0; i < index.size(); ++i) {
         pos += strides_[i] * index[i];
       }
 
-      arr_[pos] = value;
+      arr[pos] = value;
     }
 
     float get(const std::vector<size_t>& index) const {
@@ -415,134 +534,174 @@ class NDArray {
         pos += strides_[i] * index[i];
       }
 
-     return  arr_[pos];
+     return  data()[pos];
     }
 
-    NDArray reduce(std::function<void(float&, const float&, size_t, size_t)> op,
-        int axis, bool keep_dims, float init) const {
-      if (arr_.empty()) {
+    // op(acc, x) folds the elements along axis (all of them for axis -1)
+    // into acc starting from init. op has to be associative, elements are
+    // combined in a fixed but unspecified order.
+    template <class Op>
+    NDArray reduce(const Op& op, int axis, bool keep_dims, float init) const {
+      if (size_ == 0) {
         throw RuntimeError("NDArray::reduce on zero-size array");
       }
 
+      const NDArray src = contiguous();
+      const float* arr = src.data();
+
       if (axis == -1) {
         auto shape = shape_;
-        
         if (keep_dims) {
-          auto shape = shape_;
-          for (auto& ax : shape) {
-            ax = 1;
-          }
+          std::fill(shape.begin(), shape.end(), 1);
         } else {
-          shape.resize(1);
-          shape[0] = 1;
+          shape = {1};
         }
 
-        auto res = NDArray(shape);
-        res.arr_[0] = init;
-        for (auto i = 0; i < arr_.size(); ++i) {
-          op(res.arr_[0], arr_[i], 0, i);
-        }
+        // fixed size blocks keep the result independent of the thread count
+        size_t blocks = (size_ + parallel_grain - 1) / parallel_grain;
+        std::vector<float> partial(blocks);
+        parallel_for(0, blocks, 1, [&](size_t b0, size_t b1) {
+          for (size_t b = b0; b < b1; ++b) {
+            size_t begin = b * parallel_grain;
+            size_t n = std::min(size_, begin + parallel_grain) - begin;
+            partial[b] = reduce_span(op, arr + begin, n, init);
+          }
+        });
 
+        NDArray res(shape);
+        res.storage_.get()[0] = reduce_span(op, partial.data(), blocks, init);
         return res;
       }
-      
-      auto shape = shape_;
-      if (keep_dims) {
-        shape[axis] = 1;
-      } else {
-        shape.erase(shape.begin() + axis);
-      }
-      NDArray res(shape);
-
-      auto stride = strides_[axis];
-      if (stride == 1) {
-        for (size_t i = 0; i < res.arr_.size(); i++) {
-          res.arr_[i] = init;
-          
-          size_t ax_idx = 0;
-          for (size_t j = i*shape_[axis]; j < (i+1)*shape_[axis]; ++j) {
-            op(res.arr_[i], arr_[j], i, ax_idx);
-            ++ax_idx;
-          }
-        }
-      } else {
-        int pos = 0;
-        for (size_t i = 0; i < res.arr_.size(); i++) {
-          int offs = stride * (i / stride) + i;
-          res.arr_[pos] = init;
-          
-          size_t ax_idx = 0;
-          for (size_t j = 0; j < shape_[axis]; ++j) {
-            op(res.arr_[pos], arr_[offs + j * stride], pos, ax_idx);
-            ++ax_idx;
+
+      NDArray res(reduced_shape_(axis, keep_dims));
+      float* r = res.storage_.get();
+
+      size_t len = shape_[axis];
+      size_t inner = src.strides_[axis];
+      size_t out_grain = std::max<size_t>(1, parallel_grain / len);
+
+      if (inner == 1) {
+        parallel_for(0, res.size_, out_grain, [&](size_t i0, size_t i1) {
+          for (size_t i = i0; i < i1; ++i) {
+            r[i] = reduce_span(op, arr + i * len, len, init);
           }
-          pos++;
-        }
+        });
+        return res;
       }
 
+      // [outer, len, inner]: fold whole rows of inner elements at a time
+      // so the reads stay sequential
+      parallel_for(0, res.size_, out_grain, [&](size_t i0, size_t i1) {
+        std::fill(r + i0, r + i1, init);
+        for_each_outer_(i0, i1, inner, [&](size_t o, size_t c0, size_t c1) {
+          float* out = r + o * inner;
+          for (size_t j = 0; j < len; ++j) {
+            const float* row = arr + (o * len + j) * inner;
+            for (size_t c = c0; c < c1; ++c) {
+              out[c] = op(out[c], row[c]);
+            }
+          }
+        });
+      });
+
       return res;
     }
 
     NDArray reduce_max(int axis = -1, bool keep_dims=false) const {
-      if (arr_.empty()) {
+      if (size_ == 0) {
         throw RuntimeError("NDArray::reduce_max on zero-size array");
       }
-      return reduce([](float& x, const float& y, size_t i, size_t ax_idx) {
-            x = std::max(x, y);
-          }, axis, keep_dims, std::numeric_limits<float>::min());
+      return reduce([](float x, float y) {
+            return x > y ? x : y;
+          }, axis, keep_dims, -std::numeric_limits<float>::infinity());
     }
 
     NDArray reduce_sum(int axis=-1, bool keep_dims=false) const {
-      if (arr_.empty()) {
+      if (size_ == 0) {
         throw RuntimeError("NDArray::reduce_sum on zero-size array");
       }
-      return reduce([](float& x, const float& y, size_t i, size_t ax_idx) {
-          x += y;
+      return reduce([](float x, float y) {
+          return x + y;
           }, axis, keep_dims, 0.0f);
     }
-   
+
+    // index of the first maximum along axis (of the flattened array for
+    // axis -1), as float
     NDArray argmax(int axis=-1) const {
-      if (arr_.empty()) {
-        throw RuntimeError("NDArray::reduce_sum on zero-size array");
+      if (size_ == 0) {
+        throw RuntimeError("NDArray::argmax on zero-size array");
       }
-      const float init = std::numeric_limits<float>::min();
-      float max_val = init;
-      size_t curr_i = 0;
-      return reduce([&](float& x, const float& y, size_t i, size_t ax_idx) {
-          if (curr_i != i) {
-            curr_i = i;
-            max_val = init;
+
+      const NDArray src = contiguous();
+      const float* arr = src.data();
+
+      if (axis == -1) {
+        NDArray res({1});
+        res.storage_.get()[0] = argmax_span_(arr, size_);
+        return res;
+      }
+
+      NDArray res(reduced_shape_(axis, false));
+      float* r = res.storage_.get();
+
+      size_t len = shape_[axis];
+      size_t inner = src.strides_[axis];
+      size_t out_grain = std::max<size_t>(1, parallel_grain / len);
+
+      if (inner == 1) {
+        parallel_for(0, res.size_, out_grain, [&](size_t i0, size_t i1) {
+          for (size_t i = i0; i < i1; ++i) {
+            r[i] = argmax_span_(arr + i * len, len);
           }
+        });
+        return res;
+      }
 
-          if (y > max_val) {
-            max_val = y;
-            x = ax_idx;
+      parallel_for(0, res.size_, out_grain, [&](size_t i0, size_t i1) {
+        std::vector<float> best(i1 - i0);
+        for_each_outer_(i0, i1, inner, [&](size_t o, size_t c0, size_t c1) {
+          float* out = r + o * inner;
+          float* max = best.data() + (o * inner + c0 - i0);
+          for (size_t c = c0; c < c1; ++c) {
+            out[c] = 0.0f;
+            max[c - c0] = arr[o * len * inner + c];
           }
+          for (size_t j = 1; j < len; ++j) {
+            const float* row = arr + (o * len + j) * inner;
+            for (size_t c = c0; c < c1; ++c) {
+              if (row[c] > max[c - c0]) {
+                max[c - c0] = row[c];
+                out[c] = j;
+              }
+            }
+          }
+        });
+      });
 
-          }, axis, false, 0.0f);
+      return res;
     }
 
     NDArray max_filter(float x) const {
-      if (arr_.empty()) {
+      if (size_ == 0) {
         throw RuntimeError("NDArray::max_filter on zero-size array");
       }
 
-      NDArray res(shape_);
-      for (auto i = 0; i < res.arr_.size(); ++i) {
-        res.arr_[i] = arr_[i] >= x ? arr_[i] : x;
-      }
+      NDArray res = *this;
+      res.apply_([=](float val) {
+        return val >= x ? val : x;
+      });
 
       return res;
     }
 
     NDArray& clip_(float min, float max) {
-      if (arr_.empty()) {
+      if (size_ == 0) {
         throw RuntimeError("NDArray::clip_ on zero-size array");
       }
 
-      for (auto& val : arr_) {
-        val = std::min(std::max(val, min), max);
-      }
+      apply_([=](float val) {
+        return std::min(std::max(val, min), max);
+      });
 
       return *this;
     }
@@ -553,13 +712,13 @@ class NDArray {
     }
 
     NDArray& minimum_(float a, float b) {
-      if (arr_.empty()) {
+      if (size_ == 0) {
         throw RuntimeError("NDArray::minimum_ on zero-size array");
       }
 
-      for (auto& val : arr_) {
-        val = val <= a ? a : b;
-      }
+      apply_([=](float val) {
+        return val <= a ? a : b;
+      });
 
       return *this;
     }
@@ -570,9 +729,9 @@ class NDArray {
     }
 
     NDArray& exp_() {
-      for (auto& val : arr_) {
-        val = std::exp(val);
-      }
+      apply_span_([](const float* in, float* out, size_t n) {
+        vexp(in, out, n);
+      });
       return *this;
     }
 
@@ -582,9 +741,9 @@ class NDArray {
     }
 
     NDArray& log_() {
-      for (auto& val : arr_) {
-        val = std::log(std::max(val, std::numeric_limits<float>::min()));
-      }
+      apply_span_([](const float* in, float* out, size_t n) {
+        vlog(in, out, n);
+      });
       return *this;
     }
 
@@ -594,13 +753,13 @@ class NDArray {
     }
 
     NDArray& recip_() {
-      if (arr_.empty()) {
+      if (size_ == 0) {
         throw RuntimeError("recip on zero-size array");
       }
 
-      for (auto& val : arr_) {
-        val = 1.0f / val;
-      }
+      apply_span_([](const float* in, float* out, size_t n) {
+        vrecip(in, out, n);
+      });
 
       return *this;
     }
@@ -611,22 +770,9 @@ class NDArray {
     }
 
     NDArray& add_(const NDArray& other) {
-      if (shape_ != other.shape_) {
-        auto common_shape = get_common_shape(other);
-        if (common_shape.empty()) {
-          throw IncompatibleShapes("NDArray::add", {shape_, other.shape_});
-        }
-
-        if (common_shape != shape_) {
-          *this = expand(common_shape);
-        }
-
-        return add_(other.expand(common_shape));
-      }
-
-      for (size_t i = 0; i < arr_.size(); ++i) {
-        arr_[i] += other.arr_[i];
-      }
+      broadcast_apply_(other, "NDArray::add", [](float a, float b) {
+        return a + b;
+      });
 
       return *this;
     }
@@ -637,30 +783,17 @@ class NDArray {
     }
 
     NDArray& sub_(const NDArray& other) {
-      if (shape_ != other.shape_) {
-        auto common_shape = get_common_shape(other);
-        if (common_shape.empty()) {
-          throw IncompatibleShapes("NDArray::sub", {shape_, other.shape_});
-        }
-
-        if (common_shape != shape_) {
-          *this = expand(common_shape);
-        }
-
-        return sub_(other.expand(common_shape));
-      }
-
-      for (size_t i = 0; i < arr_.size(); ++i) {
-        arr_[i] -= other.arr_[i];
-      }
+      broadcast_apply_(other, "NDArray::sub", [](float a, float b) {
+        return a - b;
+      });
 
       return *this;
     }
 
     NDArray& muls_(float s) {
-      for (auto& v : arr_) {
-        v *= s;
-      }
+      apply_([=](float v) {
+        return v * s;
+      });
       return *this;
     }
 
@@ -685,22 +818,9 @@ class NDArray {
     }
 
     NDArray& mul_(const NDArray& other) {
-      if (shape_ != other.shape_) {
-        auto common_shape = get_common_shape(other);
-        if (common_shape.empty()) {
-          throw IncompatibleShapes("NDArray::mul", {shape_, other.shape_});
-        }
-
-        if (common_shape != shape_) {
-          *this = expand(common_shape);
-        }
-
-        return mul_(other.expand(common_shape));
-      }
-      
-      for (size_t i = 0; i < arr_.size(); ++i) {
-        arr_[i] *= other.arr_[i];
-      }
+      broadcast_apply_(other, "NDArray::mul", [](float a, float b) {
+        return a * b;
+      });
 
       return *this;
     }
@@ -728,55 +848,55 @@ class NDArray {
         throw IncompatibleShapes("NDArray::dot", {shape_, other.shape_});
       }
 
+      auto a = contiguous();
+      auto b = other.contiguous();
+
       NDArray res({1});
-      for (size_t i = 0; i < arr_.size(); ++i) {
-        res.arr_[0] += arr_[i] * other.arr_[i];
+      float* r = res.storage_.get();
+      for (size_t i = 0; i < size_; ++i) {
+        r[0] += a.data()[i] * b.data()[i];
       }
       
       return res;
     }
 
-    NDArray mm(const NDArray& other) const {
-      // TODO: refactor shapes
-      Shape shape1(shape_);
-      Shape shape2(other.shape_);
-
-      if (shape1.size() != 2 ||
-          shape2.size() != 2 ||
-          shape1[-1] != shape2[-2]) {
-        throw IncompatibleShapes("NDArray::mm", {shape1.v(), shape2.v()});
-      }
-
-      // A=(m, n) B=(n, k) AB=(m, k)
-      size_t m = shape1[-2];
-      size_t n = shape1[-1];
-      size_t k = shape2[-1];
-      
-      NDArray res({m, k});
-      
-      auto& A = arr_;
-      auto& B = other.arr_;
-      auto& AB = res.arr_;
-
-      for (size_t i = 0; i < m; ++i) {
-        for (size_t j = 0; j < k; ++j) {
-
-          auto& AB_ij = AB[i * k + j];
-          auto A_i = &A[i * n];
-          auto B_j = &B[j];
+    // op(A) * op(B) where op(X) is X^T if the corresponding trans flag is set,
+    // transposed operands are read in place without materializing X^T
+    NDArray mm(const NDArray& other,
+        bool trans_a = false, bool trans_b = false) const {
+      return mm_(other, trans_a, trans_b, GemmNoEpilogue());
+    }
 
-          for (size_t l = 0; l < n; ++l) {
-            AB_ij += A_i[l] * B_j[l * k];
+    // this * other + bias, followed by max(x, 0) if relu is set. bias is a
+    // row of other's columns, bias and relu are applied by the GEMM
+    // epilogue instead of extra passes over the result.
+    NDArray mm_bias(const NDArray& other, const NDArray& bias, bool relu,
+        bool trans_a = false, bool trans_b = false) const {
+      size_t k = other.shape_.empty() ? 0 :
+        trans_b ? other.shape_.front() : other.shape_.back();
+      if (bias.shape_.size() > 2 || bias.size_ != k || bias.shape_.back() != k) {
+        throw IncompatibleShapes("NDArray::mm_bias", {other.shape_, bias.shape_});
+      }
+
+      const NDArray b = bias.contiguous();
+      const float* bp = b.data();
+
+      return mm_(other, trans_a, trans_b, [=](float* C, size_t ldc,
+            size_t, size_t j, size_t mr, size_t nr) {
+          for (size_t r = 0; r < mr; ++r) {
+            float* row = C + r * ldc;
+            for (size_t c = 0; c < nr; ++c) {
+              float v = row[c] + bp[j + c];
+              row[c] = relu && v < 0.0f ? 0.0f : v;
+            }
           }
-        }
-      }
-
-      return res;
+        });
     }
 
-    NDArray bmm(const NDArray& other) const {
+    NDArray bmm(const NDArray& other,
+        bool trans_a = false, bool trans_b = false) const {
       /*
-       * Valid combinations:
+       * Valid combinations (after applying op(X) to the last two axes):
        * - (m, n) * (b, n, k)  and  (b, m, n) * (n, k) = (b, m, k)
        * - (1, m, n) * (b, n, k)  and  (b, m, n) * (1, n, k) = (b, m, k)
        * - (b, m, n) * (b, n, k) = (b, m, k)
@@ -788,6 +908,9 @@ class NDArray {
       size_t s1 = shape1.size();
       size_t s2 = shape2.size();
 
+      if (trans_a && s1 >= 2) shape1.swap(-1, -2);
+      if (trans_b && s2 >= 2) shape2.swap(-1, -2);
+
       bool ok = ((s1 == 2 && s2 == 3) || (s1 == 3 && s2 == 2) || (s1 == 3 && s2 == 3)) &&
                 (shape1[-1] == shape2[-2]);
 
@@ -801,7 +924,7 @@ class NDArray {
         throw IncompatibleShapes("NDArray::bmm", {shape1.v(), shape2.v()});
       }
 
-      // A=(?, m, n) B=(?, n, k) AB=(?, m, k)
+      // op(A)=(?, m, n) op(B)=(?, n, k) AB=(?, m, k)
       size_t m = shape1[-2];
       size_t n = shape1[-1];
       size_t k = shape2[-1];
@@ -811,24 +934,34 @@ class NDArray {
 
       size_t count = std::max(c1, c2);
       
+      size_t lda, ldb;
+      auto a = gemm_operand(trans_a, lda);
+      auto b = other.gemm_operand(trans_b, ldb);
+      size_t a_stride = c1 > 1 ? a.strides_[0] : 0;
+      size_t b_stride = c2 > 1 ? b.strides_[0] : 0;
+
       NDArray res({count, m, k});
       
-      for (size_t c = 0; c < count; ++c) {
-        auto A = &arr_[c1 > 1 ? (c * m * n) : 0];
-        auto B = &other.arr_[c2 > 1 ? (c * n * k) : 0];
-        auto AB = &res.arr_[c * m * k];
-
-        for (size_t i = 0; i < m; ++i) {
-          for (size_t j = 0; j < k; ++j) {
-
-            auto& AB_ij = AB[i * k + j];
-            auto A_i = &A[i * n];
-            auto B_j = &B[j];
-
-            for (size_t l = 0; l < n; ++l) {
-              AB_ij += A_i[l] * B_j[l * k];
-            }
+      auto batch = [&](size_t c) {
+        auto A = a.data() + c * a_stride;
+        auto B = b.data() + c * b_stride;
+        auto AB = res.storage_.get() + c * m * k;
+
+        sgemm(trans_a, trans_b, m, k, n, A, lda, B, ldb, AB, k);
+      };
+
+      // with enough batches give each thread whole products, otherwise
+      // let sgemm split every product
+      if (count >= ThreadPool::get().num_threads()) {
+        size_t grain = std::max<size_t>(1, gemm_par_flops / (2 * m * n * k + 1));
+        parallel_for(0, count, grain, [&](size_t c0, size_t c1) {
+          for (size_t c = c0; c < c1; ++c) {
+            batch(c);
           }
+        });
+      } else {
+        for (size_t c = 0; c < count; ++c) {
+          batch(c);
         }
       }
 
@@ -836,7 +969,267 @@ class NDArray {
     }
 
   private:
-    std::vector<float> arr_;
+    static size_t shape_size(const std::vector<size_t>& shape) {
+      size_t size = 1;
+      for (auto dim : shape) {
+        size *= dim;
+      }
+      return size;
+    }
+
+    // row major strides and size for shape_
+    void init_strides_() {
+      size_ = shape_size(shape_);
+      strides_ = std::vector<size_t>(shape_.size(), 1);
+      for (int i = shape_.size() - 2; i >= 0; --i) {
+        strides_[i] = shape_[i + 1] * strides_[i + 1];
+      }
+    }
+
+    // fresh zeroed contiguous storage for shape_
+    void allocate_() {
+      init_strides_();
+      storage_ = allocate_storage(size_);
+      offset_ = 0;
+    }
+
+    bool writable_() const {
+      return storage_.use_count() == 1 && is_contiguous();
+    }
+
+    // storage offset of the first element of a row (last axis)
+    size_t row_offset_(size_t row) const {
+      size_t offs = 0;
+      for (size_t i = shape_.size() - 1; i > 0; --i) {
+        size_t idx = i - 1;
+        offs += (row % shape_[idx]) * strides_[idx];
+        row /= shape_[idx];
+      }
+      return offs;
+    }
+
+    // self or a contiguous copy such that op(X) of the last two axes can be
+    // read by sgemm, trans is flipped for views stored transposed
+    NDArray gemm_operand(bool& trans, size_t& ld) const {
+      size_t ndim = shape_.size();
+      size_t rows = shape_[ndim - 2];
+      size_t cols = shape_[ndim - 1];
+      size_t rs = strides_[ndim - 2];
+      size_t cs = strides_[ndim - 1];
+
+      if ((cols == 1 || cs == 1) && (rows == 1 || rs >= cols)) {
+        ld = rows == 1 ? cols : rs;
+        return *this;
+      }
+
+      if ((rows == 1 || rs == 1) && (cols == 1 || cs >= rows)) {
+        trans = !trans;
+        ld = cols == 1 ? rows : cs;
+        return *this;
+      }
+
+      ld = cols;
+      return clone();
+    }
+
+    template <class Epilogue>
+    NDArray mm_(const NDArray& other, bool trans_a, bool trans_b,
+        const Epilogue& epilogue) const {
+      Shape shape1(shape_);
+      Shape shape2(other.shape_);
+
+      if (trans_a && shape1.size() == 2) shape1.swap(-1, -2);
+      if (trans_b && shape2.size() == 2) shape2.swap(-1, -2);
+
+      if (shape1.size() != 2 ||
+          shape2.size() != 2 ||
+          shape1[-1] != shape2[-2]) {
+        throw IncompatibleShapes("NDArray::mm", {shape1.v(), shape2.v()});
+      }
+
+      // op(A)=(m, n) op(B)=(n, k) AB=(m, k)
+      size_t m = shape1[-2];
+      size_t n = shape1[-1];
+      size_t k = shape2[-1];
+      
+      size_t lda, ldb;
+      auto a = gemm_operand(trans_a, lda);
+      auto b = other.gemm_operand(trans_b, ldb);
+
+      NDArray res({m, k});
+      sgemm(trans_a, trans_b, m, k, n,
+          a.data(), lda, b.data(), ldb, res.storage_.get(), k, epilogue);
+
+      return res;
+    }
+
+    // x = fn(x) for every element
+    template <class F>
+    void apply_(const F& fn) {
+      apply_span_([&](const float* in, float* out, size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+          out[i] = fn(in[i]);
+        }
+      });
+    }
+
+    // fn(in, out, n) over contiguous spans of the elements, split across
+    // the thread pool for large arrays, in and out are the same span unless
+    // the array is shared or strided, which is written to fresh storage
+    template <class F>
+    void apply_span_(const F& fn) {
+      if (size_ == 0) {
+        return;
+      }
+
+      NDArray src;
+      if (!writable_()) {
+        src = contiguous();
+        allocate_();
+      }
+
+      float* a = storage_.get() + offset_;
+      const float* in = src.storage_ ? src.data() : a;
+      parallel_for(0, size_, parallel_grain, [&](size_t b, size_t e) {
+        fn(in + b, a + b, e - b);
+      });
+    }
+
+    // shape of a reduction along axis
+    std::vector<size_t> reduced_shape_(int axis, bool keep_dims) const {
+      if (axis < 0 || size_t(axis) >= shape_.size()) {
+        throw ValueError("NDArray::reduce: invalid axis " + std::to_string(axis));
+      }
+
+      auto shape = shape_;
+      if (keep_dims) {
+        shape[axis] = 1;
+      } else {
+        shape.erase(shape.begin() + axis);
+      }
+      return shape;
+    }
+
+    // index of the first maximum of n contiguous elements: the maximum is
+    // a vectorizable reduction, finding it again is a short scan
+    static float argmax_span_(const float* x, size_t n) {
+      float max = reduce_span([](float a, float b) {
+          return a > b ? a : b;
+          }, x, n, -std::numeric_limits<float>::infinity());
+
+      for (size_t i = 0; i < n; ++i) {
+        if (x[i] == max) {
+          return i;
+        }
+      }
+      return 0.0f;
+    }
+
+    // fn(o, c0, c1) for the outer blocks of size inner overlapping the flat
+    // output range [i0, i1), with the covered columns [c0, c1) of each
+    template <class F>
+    static void for_each_outer_(size_t i0, size_t i1, size_t inner,
+        const F& fn) {
+      for (size_t o = i0 / inner; o * inner < i1; ++o) {
+        size_t c0 = std::max(i0, o * inner) - o * inner;
+        size_t c1 = std::min(i1, (o + 1) * inner) - o * inner;
+        fn(o, c0, c1);
+      }
+    }
+
+    // out[j] = fn(a[j * as], b[j * bs]) for j < n, the common unit and
+    // zero stride cases get their own loops so they vectorize
+    template <class F>
+    static void apply_row_(size_t n, float* out,
+        const float* a, size_t as, const float* b, size_t bs, const F& fn) {
+      if (as == 1 && bs == 1) {
+        for (size_t j = 0; j < n; ++j) {
+          out[j] = fn(a[j], b[j]);
+        }
+      } else if (as == 1 && bs == 0) {
+        float y = b[0];
+        for (size_t j = 0; j < n; ++j) {
+          out[j] = fn(a[j], y);
+        }
+      } else if (as == 0 && bs == 1) {
+        float x = a[0];
+        for (size_t j = 0; j < n; ++j) {
+          out[j] = fn(x, b[j]);
+        }
+      } else {
+        for (size_t j = 0; j < n; ++j) {
+          out[j] = fn(a[j * as], b[j * bs]);
+        }
+      }
+    }
+
+    // x = fn(x, y) with both sides broadcast to their common shape. Expanded
+    // axes are read with stride 0, so neither side is ever materialized:
+    // - same layout or scalar other: a single flat loop
+    // - other broadcast along rows (e.g. a bias): one row reused for all rows
+    // - anything else: per row offsets from the strides
+    template <class F>
+    void broadcast_apply_(const NDArray& other, const std::string& name,
+        const F& fn) {
+      auto shape = shape_ == other.shape_ ? shape_ : get_common_shape(other);
+      if (shape.empty() && shape_ != other.shape_) {
+        throw IncompatibleShapes(name, {shape_, other.shape_});
+      }
+
+      size_t size = shape_size(shape);
+      if (size == 0 || shape.empty()) {
+        return;
+      }
+
+      // decide before the views below add references to the storage
+      bool in_place = shape_ == shape && writable_();
+
+      NDArray a = in_place ? *this : expand(shape);
+      NDArray b = other.expand(shape);
+      NDArray res = in_place ? NDArray() : NDArray(shape);
+      float* out = in_place ?
+        storage_.get() + offset_ : res.storage_.get();
+
+      const float* ap = a.data();
+      const float* bp = b.data();
+      bool a_flat = a.is_contiguous();
+      bool b_scalar = other.size_ == 1;
+
+      if (a_flat && (b_scalar || b.is_contiguous())) {
+        size_t bs = b_scalar ? 0 : 1;
+        parallel_for(0, size, parallel_grain, [&](size_t i0, size_t i1) {
+          apply_row_(i1 - i0, out + i0, ap + i0, 1, bp + i0 * bs, bs, fn);
+        });
+      } else {
+        size_t ndim = shape.size();
+        size_t inner = shape.back();
+        size_t rows = size / inner;
+        size_t as = a.strides_.back();
+        size_t bs = b.strides_.back();
+
+        bool b_row = true;
+        for (size_t i = 0; i + 1 < ndim; ++i) {
+          b_row = b_row && (b.strides_[i] == 0 || shape[i] == 1);
+        }
+
+        size_t grain = std::max<size_t>(1, parallel_grain / inner);
+        parallel_for(0, rows, grain, [&](size_t r0, size_t r1) {
+          for (size_t r = r0; r < r1; ++r) {
+            size_t ao = a_flat ? r * inner : a.row_offset_(r);
+            size_t bo = b_row ? 0 : b.row_offset_(r);
+            apply_row_(inner, out + r * inner, ap + ao, as, bp + bo, bs, fn);
+          }
+        });
+      }
+
+      if (!in_place) {
+        *this = res;
+      }
+    }
+
+    std::shared_ptr<float> storage_;
+    size_t offset_ = 0;
+    size_t size_ = 0;
     std::vector<size_t> shape_;
     std::vector<size_t> strides_;
 };
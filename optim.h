@@ -0,0 +1,213 @@
+#ifndef _optim_h_
+#define _optim_h_
+
+#include <cmath>
+#include <vector>
+#include <cstddef>
+#include <algorithm>
+
+#include "graph.h"
+#include "thread_pool.h"
+
+/*
+ * Optimizers which update the variables of a graph in place.
+ *
+ * step() is a single pass over all parameters: each element is read and
+ * written once together with its gradient and its optimizer state, in
+ * chunks spread over the intra-op thread pool. The state of all variables
+ * lives in slabs (one per kind of state, e.g. the first and the second
+ * moment) laid out in the order of the variables, so a chunk is one
+ * contiguous run of parameters, gradients and state.
+ *
+ * Variables without a gradient from the last backward() are left alone,
+ * their state is not touched either.
+ */
+class Optimizer {
+  public:
+    // the variables of graph which require gradients, with their current
+    // sizes and slabs floats of state per parameter
+    Optimizer(GraphRef graph, float learning_rate, size_t slabs)
+      : learning_rate_(learning_rate), graph_(graph),
+        variables_(graph->get_variables()), slabs_(slabs) {
+      offsets_.push_back(0);
+      for (const auto& var : variables_) {
+        offsets_.push_back(offsets_.back() + var->get_value().size());
+      }
+      state_.assign(slabs_ * offsets_.back(), 0.0f);
+    }
+
+    virtual ~Optimizer() { }
+
+    // one update of every variable from the gradients of the last backward()
+    void step() {
+      size_t n = variables_.size();
+      std::vector<float*> params(n, nullptr);
+      std::vector<NDArray> grads(n);
+
+      for (size_t i = 0; i < n; ++i) {
+        const auto& var = variables_[i];
+        grads[i] = graph_->gradient(var).contiguous();
+        if (grads[i].size() == 0) {
+          continue;
+        }
+
+        const auto& value = var->get_value();
+        if (value.size() != offsets_[i + 1] - offsets_[i]) {
+          throw ValueError("variable changed size since the optimizer was "
+              "created");
+        }
+        if (grads[i].size() != value.size()) {
+          throw IncompatibleShapes("optimizer step",
+              {value.shape(), grads[i].shape()});
+        }
+        // copies the value first if anyone else holds on to it, unless it
+        // is flattened
+        params[i] = var->mutable_data();
+      }
+
+      steps_++;
+      begin_step();
+
+      parallel_for(0, offsets_.back(), parallel_grain,
+          [&](size_t begin, size_t end) {
+        size_t i = std::upper_bound(offsets_.begin(), offsets_.end(), begin)
+          - offsets_.begin() - 1;
+        for (; begin < end; ++i) {
+          size_t last = std::min(end, offsets_[i + 1]);
+          if (params[i] != nullptr && last > begin) {
+            size_t j = begin - offsets_[i];
+            update(params[i] + j, grads[i].data() + j, begin, last - begin);
+          }
+          begin = last;
+        }
+      });
+    }
+
+    size_t steps() const {
+      return steps_;
+    }
+
+    void set_learning_rate(float learning_rate) {
+      learning_rate_ = learning_rate;
+    }
+
+  protected:
+    // called by step() before the update, steps() already counts it
+    virtual void begin_step() { }
+
+    // updates p[0, n) from g[0, n), whose state starts at offset in the
+    // slabs, chunks of one step may run concurrently
+    virtual void update(float* __restrict p, const float* __restrict g,
+        size_t offset, size_t n) = 0;
+
+    float* slab(size_t k) {
+      return state_.data() + k * offsets_.back();
+    }
+
+    float learning_rate_;
+    size_t steps_ = 0;
+
+  private:
+    GraphRef graph_;
+    std::vector<VariableRef> variables_;
+    // variables_[i] is [offsets_[i], offsets_[i + 1]) in every slab
+    std::vector<size_t> offsets_;
+    size_t slabs_;
+    std::vector<float> state_;
+};
+
+// p -= lr * (g + weight_decay * p), or with momentum
+// v = momentum * v + g + weight_decay * p, p -= lr * v
+class SGD : public Optimizer {
+  public:
+    SGD(GraphRef graph, float learning_rate, float momentum = 0.0f,
+        float weight_decay = 0.0f)
+      : Optimizer(graph, learning_rate, momentum != 0.0f ? 1 : 0),
+        momentum_(momentum), weight_decay_(weight_decay) { }
+
+  protected:
+    virtual void update(float* __restrict p, const float* __restrict g,
+        size_t offset, size_t n) override {
+      float lr = learning_rate_;
+      float wd = weight_decay_;
+      if (momentum_ == 0.0f) {
+        for (size_t i = 0; i < n; ++i) {
+          p[i] -= lr * (g[i] + wd * p[i]);
+        }
+        return;
+      }
+
+      float mu = momentum_;
+      float* __restrict v = slab(0) + offset;
+      for (size_t i = 0; i < n; ++i) {
+        v[i] = mu * v[i] + g[i] + wd * p[i];
+        p[i] -= lr * v[i];
+      }
+    }
+
+  private:
+    float momentum_;
+    float weight_decay_;
+};
+
+// Adam (Kingma & Ba) with bias corrected moments, weight_decay is added
+// to the gradient (L2 regularization)
+class Adam : public Optimizer {
+  public:
+    Adam(GraphRef graph, float learning_rate = 1e-3f, float beta1 = 0.9f,
+        float beta2 = 0.999f, float eps = 1e-8f, float weight_decay = 0.0f)
+      : Adam(graph, learning_rate, beta1, beta2, eps, weight_decay, 0.0f) { }
+
+  protected:
+    Adam(GraphRef graph, float learning_rate, float beta1, float beta2,
+        float eps, float weight_decay, float decoupled_decay)
+      : Optimizer(graph, learning_rate, 2), beta1_(beta1), beta2_(beta2),
+        eps_(eps), weight_decay_(weight_decay),
+        decoupled_decay_(decoupled_decay) { }
+
+    virtual void begin_step() override {
+      correction1_ = 1.0f / (1.0f - std::pow(beta1_, float(steps_)));
+      correction2_ = 1.0f / (1.0f - std::pow(beta2_, float(steps_)));
+    }
+
+    virtual void update(float* __restrict p, const float* __restrict g,
+        size_t offset, size_t n) override {
+      float* __restrict m = slab(0) + offset;
+      float* __restrict v = slab(1) + offset;
+      float lr = learning_rate_;
+      float b1 = beta1_;
+      float b2 = beta2_;
+      float c1 = correction1_;
+      float c2 = correction2_;
+      float eps = eps_;
+      float wd = weight_decay_;
+      float dwd = decoupled_decay_;
+
+      for (size_t i = 0; i < n; ++i) {
+        float gi = g[i] + wd * p[i];
+        m[i] = b1 * m[i] + (1.0f - b1) * gi;
+        v[i] = b2 * v[i] + (1.0f - b2) * gi * gi;
+        p[i] -= lr * (c1 * m[i] / (std::sqrt(c2 * v[i]) + eps) + dwd * p[i]);
+      }
+    }
+
+  private:
+    float beta1_;
+    float beta2_;
+    float eps_;
+    float weight_decay_;
+    float decoupled_decay_;
+    float correction1_ = 1.0f;
+    float correction2_ = 1.0f;
+};
+
+// Adam with weight decay applied to the parameters directly instead of
+// through the moments (Loshchilov & Hutter)
+class AdamW : public Adam {
+  public:
+    AdamW(GraphRef graph, float learning_rate = 1e-3f, float beta1 = 0.9f,
+        float beta2 = 0.999f, float eps = 1e-8f, float weight_decay = 1e-2f)
+      : Adam(graph, learning_rate, beta1, beta2, eps, 0.0f, weight_decay) { }
+};
+
+#endif // _optim_h_
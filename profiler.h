@@ -0,0 +1,173 @@
+#ifndef _profiler_h_
+#define _profiler_h_
+
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <string>
+#include <ostream>
+#include <iomanip>
+#include <cstddef>
+#include <algorithm>
+
+#include "util.h"
+
+/*
+ * Per node record of graph execution.
+ *
+ * The graph adds an Event for every forward and backward run of a node
+ * while profiling is enabled (see Graph::set_profiling). Events carry the
+ * wall time, the tensor bytes allocated by the running thread, an
+ * estimate of the floating point operations and the output shape.
+ *
+ * write_trace() writes the Chrome trace event format, which loads into
+ * chrome://tracing and ui.perfetto.dev with one row per thread.
+ * write_summary() aggregates the events per node and pass, most time
+ * first.
+ */
+class Profiler {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    enum class Pass {
+      forward,
+      backward,
+      // forward run again by backward() (gradient checkpointing)
+      recompute
+    };
+
+    struct Event {
+      size_t node = 0;
+      std::string name;
+      Pass pass = Pass::forward;
+      // microseconds since the profiler was cleared
+      double start = 0.0;
+      double duration = 0.0;
+      size_t bytes = 0;
+      size_t flops = 0;
+      std::vector<size_t> shape;
+      // dense index of the recording thread
+      size_t thread = 0;
+    };
+
+    Profiler() {
+      clear();
+    }
+
+    void clear() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      events_.clear();
+      threads_.clear();
+      epoch_ = clock::now();
+    }
+
+    double now() const {
+      return std::chrono::duration<double, std::micro>(
+          clock::now() - epoch_).count();
+    }
+
+    // safe to call from several threads
+    void record(Event event) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = threads_.emplace(std::this_thread::get_id(),
+          threads_.size()).first;
+      event.thread = it->second;
+      events_.push_back(std::move(event));
+    }
+
+    const std::vector<Event>& events() const {
+      return events_;
+    }
+
+    static const char* pass_name(Pass pass) {
+      switch (pass) {
+        case Pass::forward: return "forward";
+        case Pass::backward: return "backward";
+        default: return "recompute";
+      }
+    }
+
+    void write_trace(std::ostream& os) const {
+      os << "{\"traceEvents\": [";
+      for (size_t i = 0; i < events_.size(); ++i) {
+        const auto& e = events_[i];
+        os << (i ? ",\n" : "\n")
+          << std::fixed << std::setprecision(3)
+          << "{\"name\": \"" << e.name << "\", \"cat\": \""
+          << pass_name(e.pass) << "\", \"ph\": \"X\", \"ts\": " << e.start
+          << ", \"dur\": " << e.duration
+          << ", \"pid\": 0, \"tid\": " << e.thread
+          << ", \"args\": {\"node\": " << e.node
+          << ", \"bytes\": " << e.bytes
+          << ", \"flops\": " << e.flops
+          << ", \"shape\": \"" << vstr(e.shape) << "\"}}";
+      }
+      os << "\n], \"displayTimeUnit\": \"ms\"}\n";
+    }
+
+    void write_summary(std::ostream& os) const {
+      struct Row {
+        const Event* first;
+        size_t calls = 0;
+        double time = 0.0;
+        size_t bytes = 0;
+        size_t flops = 0;
+      };
+
+      std::map<std::pair<size_t, Pass>, Row> rows;
+      double total = 0.0;
+      for (const auto& e : events_) {
+        auto& row = rows[{e.node, e.pass}];
+        if (row.calls++ == 0) {
+          row.first = &e;
+        }
+        row.time += e.duration;
+        row.bytes += e.bytes;
+        row.flops += e.flops;
+        total += e.duration;
+      }
+
+      std::vector<const Row*> sorted;
+      for (const auto& r : rows) {
+        sorted.push_back(&r.second);
+      }
+      std::sort(sorted.begin(), sorted.end(), [](const Row* a, const Row* b) {
+          return a->time > b->time;
+        });
+
+      os << std::left << std::setw(20) << "node"
+        << std::setw(11) << "pass" << std::right
+        << std::setw(7) << "calls"
+        << std::setw(11) << "ms"
+        << std::setw(8) << "%"
+        << std::setw(11) << "MB"
+        << std::setw(10) << "GFLOP/s"
+        << "  shape" << std::endl;
+
+      for (auto row : sorted) {
+        os << std::left << std::setw(20) << row->first->name
+          << std::setw(11) << pass_name(row->first->pass) << std::right
+          << std::fixed
+          << std::setw(7) << row->calls
+          << std::setprecision(3)
+          << std::setw(11) << row->time / 1e3
+          << std::setprecision(1)
+          << std::setw(8) << (total > 0 ? 100.0 * row->time / total : 0.0)
+          << std::setprecision(2)
+          << std::setw(11) << row->bytes / double(1 << 20)
+          << std::setw(10)
+          << (row->time > 0 ? row->flops / row->time / 1e3 : 0.0)
+          << "  " << vstr(row->first->shape) << std::endl;
+      }
+    }
+
+  private:
+    std::mutex mutex_;
+    clock::time_point epoch_;
+    std::vector<Event> events_;
+    std::map<std::thread::id, size_t> threads_;
+};
+
+#endif // _profiler_h_
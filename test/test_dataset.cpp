@@ -0,0 +1,221 @@
+#include <set>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+#include "catch.hpp"
+#include "../dataset.h"
+
+namespace {
+
+std::vector<int> range(int n) {
+  std::vector<int> v(n);
+  for (int i = 0; i < n; ++i) {
+    v[i] = i;
+  }
+  return v;
+}
+
+template <class T>
+std::vector<T> drain(DatasetRef<T> ds) {
+  std::vector<T> out;
+  T element;
+  while (ds->next(element)) {
+    out.push_back(element);
+  }
+  return out;
+}
+
+void write_u32(std::ofstream& os, uint32_t v) {
+  unsigned char bytes[4] = {
+    static_cast<unsigned char>(v >> 24), static_cast<unsigned char>(v >> 16),
+    static_cast<unsigned char>(v >> 8), static_cast<unsigned char>(v)};
+  os.write(reinterpret_cast<char*>(bytes), 4);
+}
+
+// n items of 2 x 2 bytes, all first + i, and labels (first + i) % 10
+void write_shard(const std::string& prefix, size_t first, size_t n) {
+  std::ofstream images(prefix + "-images", std::ios::binary);
+  write_u32(images, 0x803);
+  write_u32(images, n);
+  write_u32(images, 2);
+  write_u32(images, 2);
+  for (size_t i = 0; i < n; ++i) {
+    std::string pixels(4, static_cast<char>(first + i));
+    images.write(pixels.data(), pixels.size());
+  }
+
+  std::ofstream labels(prefix + "-labels", std::ios::binary);
+  write_u32(labels, 0x801);
+  write_u32(labels, n);
+  for (size_t i = 0; i < n; ++i) {
+    labels.put(static_cast<char>((first + i) % 10));
+  }
+}
+
+} // namespace
+
+TEST_CASE("Dataset stages") {
+  GIVEN("map") {
+    for (size_t workers : {0, 1, 3}) {
+      auto ds = vector_source(range(100))
+        ->map([](int i) { return 2.0 * i; }, workers);
+      auto out = drain(ds);
+      REQUIRE(out.size() == 100);
+      for (size_t i = 0; i < out.size(); ++i) {
+        REQUIRE(out[i] == 2.0 * i);
+      }
+      REQUIRE(ds->stats().items == 100);
+    }
+  }
+
+  GIVEN("map errors in order") {
+    for (size_t workers : {0, 2}) {
+      auto ds = vector_source(range(10))->map([](int i) {
+          if (i == 5) {
+            throw ValueError("five");
+          }
+          return i;
+        }, workers);
+
+      int element;
+      for (int i = 0; i < 5; ++i) {
+        REQUIRE(ds->next(element));
+        REQUIRE(element == i);
+      }
+      REQUIRE_THROWS_AS(ds->next(element), const ValueError&);
+    }
+  }
+
+  GIVEN("shuffle") {
+    auto same = drain(vector_source(range(50))->shuffle(1));
+    REQUIRE(same == range(50));
+
+    auto out = drain(vector_source(range(50))->shuffle(16, 3));
+    REQUIRE(out != range(50));
+    std::sort(out.begin(), out.end());
+    REQUIRE(out == range(50));
+
+    // an element moves ahead by less than the buffer
+    out = drain(vector_source(range(50))->shuffle(4, 3));
+    for (size_t i = 0; i < out.size(); ++i) {
+      REQUIRE(out[i] < int(i) + 4);
+    }
+  }
+
+  GIVEN("batch") {
+    std::vector<Sample> samples(7);
+    for (size_t i = 0; i < samples.size(); ++i) {
+      samples[i].x = {float(i), float(i) + 0.5f};
+      samples[i].label = i % 3;
+    }
+
+    auto batches = drain(vector_source(samples)->batch(3, 3));
+    REQUIRE(batches.size() == 3);
+    REQUIRE(batches[0].x.shape() == std::vector<size_t>({3, 2}));
+    REQUIRE(batches[2].x.shape() == std::vector<size_t>({1, 2}));
+    REQUIRE(batches[1].x.get({2, 1}) == 5.5f);
+    REQUIRE(batches[1].labels == std::vector<int>({0, 1, 2}));
+    REQUIRE(batches[1].targets.get({1, 1}) == 1.0f);
+    REQUIRE(batches[1].targets.get({1, 0}) == 0.0f);
+    REQUIRE(batches[2].targets.shape() == std::vector<size_t>({1, 3}));
+
+    REQUIRE(drain(vector_source(samples)->batch(3, 0, true)).size() == 2);
+    REQUIRE(drain(vector_source(samples)->batch(3)).back().targets.size()
+        == 0);
+
+    REQUIRE_THROWS_AS(drain(vector_source(samples)->batch(3, 2)),
+        const ValueError&);
+    samples[4].x.push_back(1.0f);
+    REQUIRE_THROWS_AS(drain(vector_source(samples)->batch(3)),
+        const IncompatibleShapes&);
+  }
+
+  GIVEN("prefetch") {
+    auto ds = vector_source(range(100))
+      ->map([](int i) { return i + 1; }, 2)
+      ->prefetch(3);
+    auto out = drain(ds);
+    REQUIRE(out.size() == 100);
+    REQUIRE(out.front() == 1);
+    REQUIRE(out.back() == 100);
+
+    auto failing = vector_source(range(10))->map([](int i) {
+        if (i == 3) {
+          throw RuntimeError("three");
+        }
+        return i;
+      })->prefetch(4);
+    int element;
+    for (int i = 0; i < 3; ++i) {
+      REQUIRE(failing->next(element));
+    }
+    REQUIRE_THROWS_AS(failing->next(element), const RuntimeError&);
+
+    // stopped with elements in flight
+    auto endless = vector_source(range(1000))->prefetch(2);
+    REQUIRE(endless->next(element));
+  }
+}
+
+TEST_CASE("Dataset pipeline") {
+  char dir[] = "/tmp/uflow_datasetXXXXXX";
+  REQUIRE(mkdtemp(dir) != nullptr);
+  std::string a = std::string(dir) + "/a";
+  std::string b = std::string(dir) + "/b";
+  write_shard(a, 0, 30);
+  write_shard(b, 30, 20);
+
+  auto source = idx_source({a + "-images", b + "-images"},
+      {a + "-labels", b + "-labels"}, 1.0f, 2);
+  auto batches = source
+    ->map([](Sample s) {
+        s.x.push_back(1.0f);
+        return s;
+      }, 2)
+    ->shuffle(16, 5)
+    ->batch(8, 10)
+    ->prefetch(2);
+
+  // two epochs of 50
+  std::multiset<int> seen;
+  size_t rows = 0;
+  Batch batch;
+  while (batches->next(batch)) {
+    REQUIRE(batch.x.shape()[1] == 5);
+    for (size_t i = 0; i < batch.labels.size(); ++i) {
+      int value = int(batch.x.get({i, 0}));
+      REQUIRE(batch.x.get({i, 3}) == value);
+      REQUIRE(batch.x.get({i, 4}) == 1.0f);
+      REQUIRE(batch.labels[i] == value % 10);
+      REQUIRE(batch.targets.get({i, size_t(value % 10)}) == 1.0f);
+      seen.insert(value);
+    }
+    rows += batch.labels.size();
+  }
+  REQUIRE(rows == 100);
+  for (int i = 0; i < 50; ++i) {
+    REQUIRE(seen.count(i) == 2);
+  }
+
+  REQUIRE(source->stats().items == 100);
+  REQUIRE(batches->stats().items == 13);
+  std::stringstream ss;
+  batches->write_stats(ss);
+  std::string stats = ss.str();
+  REQUIRE(stats.find("shuffle") != std::string::npos);
+  // header and 5 stages
+  REQUIRE(std::count(stats.begin(), stats.end(), '\n') == 6);
+
+  REQUIRE_THROWS_AS(idx_source({a + "-images"}, {}), const ValueError&);
+  auto mismatched = idx_source({a + "-images"}, {b + "-labels"});
+  Sample sample;
+  REQUIRE_THROWS_AS(mismatched->next(sample), const ValueError&);
+
+  for (auto prefix : {a, b}) {
+    std::remove((prefix + "-images").c_str());
+    std::remove((prefix + "-labels").c_str());
+  }
+  std::remove(dir);
+}
@@ -0,0 +1,70 @@
+#include "catch.hpp"
+#include "../expr.h"
+
+namespace {
+
+void require_close(const NDArray& a, const NDArray& b) {
+  REQUIRE(a.shape() == b.shape());
+  auto v1 = a.vec();
+  auto v2 = b.vec();
+  for (size_t i = 0; i < v1.size(); ++i) {
+    REQUIRE(v1[i] == Approx(v2[i]).epsilon(1e-5));
+  }
+}
+
+} // namespace
+
+TEST_CASE("lazy::eval") {
+  NDArray x({3, 4}, {1, -2, 3, 0.5f, -1, 2, 0.75f, 4, 0.25f, 1, -3, 2});
+  NDArray y({3, 4}, {2, 1, -1, 3, 0.5f, -2, 1, 1, 4, 2, 1, -1});
+  NDArray row({4}, {1, 2, 3, 4});
+  NDArray col({3, 1}, {-1, 0, 1});
+  auto X = lazy::ref(x);
+  auto Y = lazy::ref(y);
+
+  require_close(lazy::eval(X + Y), x.add(y));
+  require_close(lazy::eval(X * Y - X), x.mul(y).sub(x));
+  require_close(lazy::eval(X / lazy::ref(row)), x.mul(row.recip()));
+  require_close(lazy::eval(exp(X - lazy::ref(col))), x.sub(col).exp());
+  require_close(lazy::eval(log(exp(X)) * 2.0f), x.muls(2.0f));
+  require_close(lazy::eval(1.0f - recip(-X)), x.recip().add(NDArray({1}, {1})));
+
+  GIVEN("Broadcasting to a larger result") {
+    auto res = lazy::eval(lazy::ref(row) + lazy::ref(col));
+    require_close(res, NDArray({3, 4}, {0, 1, 2, 3, 1, 2, 3, 4, 2, 3, 4, 5}));
+    CHECK_THROWS(lazy::eval(X + lazy::ref(NDArray({3}))));
+  }
+
+  GIVEN("Strided views") {
+    auto t = x.transpose();
+    require_close(lazy::eval(lazy::ref(t) * 3.0f), t.muls(3.0f));
+    auto s = x.slice(1, 1, 3);
+    require_close(lazy::eval(exp(lazy::ref(s))), s.exp());
+  }
+
+  GIVEN("Rows longer than a block") {
+    size_t n = 3 * lazy::block + 7;
+    NDArray a({5, n}, random_vec<float>(5 * n, -5.0f, 5.0f));
+    NDArray m = a.reduce_max(1, true);
+    auto A = lazy::ref(a);
+    auto M = lazy::ref(m);
+    require_close(lazy::eval(exp(A - M)), a.sub(m).exp());
+  }
+}
+
+TEST_CASE("lazy::sum, lazy::max") {
+  size_t n = 2 * lazy::block + 3;
+  NDArray a({4, n}, random_vec<float>(4 * n, -1.0f, 1.0f));
+  NDArray b({n}, random_vec<float>(n, -1.0f, 1.0f));
+  auto A = lazy::ref(a);
+  auto B = lazy::ref(b);
+
+  require_close(lazy::sum(A * B, 1), a.mul(b).reduce_sum(1));
+  require_close(lazy::sum(A * B, 1, true), a.mul(b).reduce_sum(1, true));
+  require_close(lazy::max(-A, 1, true), a.muls(-1.0f).reduce_max(1, true));
+  require_close(lazy::sum(A - B), a.sub(b).reduce_sum());
+  require_close(lazy::max(A, -1, true), a.reduce_max(-1, true));
+
+  // not the last axis, evaluated first
+  require_close(lazy::sum(A + B, 0), a.add(b).reduce_sum(0));
+}
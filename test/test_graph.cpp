@@ -0,0 +1,701 @@
+#include "catch.hpp"
+#include "../graph.h"
+#include "../kernel.h"
+#include "../graph.cpp"
+#include "../kernel.cpp"
+
+TEST_CASE("Graph::forward") {
+  GraphRef g = std::make_shared<Graph>();
+  auto a = Variable::create(g, {2});
+  auto b = Variable::create(g, {2});
+  a->set_value(NDArray({1, 2}, {1, 2}));
+  b->set_value(NDArray({1, 2}, {3, 5}));
+
+  auto sum = a->add(b);
+  g->forward();
+  REQUIRE(sum->get_value() == NDArray({1, 2}, {4, 7}));
+
+  GIVEN("Nodes added after the plan was compiled") {
+    auto prod = sum->mul(b);
+    g->forward();
+    REQUIRE(prod->get_value() == NDArray({1, 2}, {12, 35}));
+
+    a->set_value(NDArray({1, 2}, {0, 0}));
+    g->forward();
+    REQUIRE(prod->get_value() == NDArray({1, 2}, {9, 25}));
+  }
+}
+
+TEST_CASE("Graph::backward") {
+  GraphRef g = std::make_shared<Graph>();
+  auto x = Variable::create(g, {2});
+  auto y = Variable::create(g, {2});
+  auto W = Variable::create(g, Shape({2, 2}), true);
+  auto b = Variable::create(g, {2}, true);
+  x->set_value(NDArray({1, 2}, {1, 2}));
+  y->set_value(NDArray({1, 2}, {1, 0}));
+  W->set_value(NDArray({2, 2}, {1, -1, 2, -2}));
+  b->set_value(NDArray({2}, {1, 1}));
+
+  auto loss = x->mm(W)->add(b)->softmax_ce(y);
+
+  // logits = (6, -4), dL/dlogits = softmax(logits) - y
+  float p0 = std::exp(6.0f) / (std::exp(6.0f) + std::exp(-4.0f));
+  std::vector<float> d = {p0 - 1.0f, 1.0f - p0};
+
+  auto check = [&]() {
+    auto dW = g->gradient(W).vec();
+    auto db = g->gradient(b).vec();
+    REQUIRE(dW.size() == 4);
+    REQUIRE(db.size() == 2);
+    for (size_t j = 0; j < 2; ++j) {
+      REQUIRE(dW[j] == Approx(d[j]));
+      REQUIRE(dW[2 + j] == Approx(2.0f * d[j]));
+      REQUIRE(db[j] == Approx(d[j]));
+    }
+  };
+
+  GIVEN("A single path to the loss") {
+    g->forward();
+    g->backward(loss);
+    check();
+    REQUIRE(g->gradient(x).size() == 0);
+  }
+
+  GIVEN("Branches which do not lead to the loss") {
+    auto unused = x->mm(W)->relu();
+    auto pred = x->mm(W)->add(b)->softmax();
+    g->forward();
+    g->backward(loss);
+    check();
+  }
+
+  GIVEN("An unknown node") {
+    GraphRef other = std::make_shared<Graph>();
+    auto v = Variable::create(other, {1});
+    g->forward();
+    CHECK_THROWS(g->backward(v));
+  }
+}
+
+TEST_CASE("Softmax backward") {
+  GraphRef g = std::make_shared<Graph>();
+  auto x = Variable::create(g, {3}, true);
+  auto c = Variable::create(g, {3});
+  x->set_value(NDArray({2, 3}, {1, 2, 3, -1, 0, 4}));
+  c->set_value(NDArray({2, 3}, {1, -2, 3, 0.5f, 2, -1}));
+
+  // sum(softmax(x) * c), dL/dx = s * (c - <s, c>) per row
+  auto out = x->softmax()->mul(c);
+  g->forward();
+  g->backward(out);
+
+  auto xv = x->get_value();
+  auto cv = c->get_value();
+  auto dx = g->gradient(x);
+  REQUIRE(dx.shape() == std::vector<size_t>({2, 3}));
+
+  for (size_t b = 0; b < 2; ++b) {
+    float sum = 0.0f;
+    std::vector<float> s(3);
+    for (size_t j = 0; j < 3; ++j) {
+      s[j] = std::exp(xv.get({b, j}));
+      sum += s[j];
+    }
+
+    float dot = 0.0f;
+    for (size_t j = 0; j < 3; ++j) {
+      s[j] /= sum;
+      dot += s[j] * cv.get({b, j});
+    }
+
+    for (size_t j = 0; j < 3; ++j) {
+      REQUIRE(dx.get({b, j}) == Approx(s[j] * (cv.get({b, j}) - dot)));
+    }
+  }
+}
+
+TEST_CASE("Graph node ids") {
+  GraphRef g = std::make_shared<Graph>();
+  auto x = Variable::create(g, {2}, true);
+  auto y = Variable::create(g, {2});
+  x->set_value(NDArray({1, 2}, {1, -2}));
+  y->set_value(NDArray({1, 2}, {0, 1}));
+
+  REQUIRE(x->id() == Node::no_id);
+
+  GIVEN("A node feeding both inputs of one consumer") {
+    auto sq = x->mul(x);
+    auto loss = sq->softmax_ce(y);
+    REQUIRE(x->id() == 0);
+    REQUIRE(sq->id() == 1);
+    REQUIRE(loss->id() == 3);
+
+    g->forward();
+    g->backward(loss);
+
+    // z = x * x = (1, 4), dL/dx = 2 x (softmax(z) - y)
+    float p0 = std::exp(1.0f) / (std::exp(1.0f) + std::exp(4.0f));
+    auto dx = g->gradient(x).vec();
+    REQUIRE(dx.size() == 2);
+    REQUIRE(dx[0] == Approx(2.0f * p0));
+    REQUIRE(dx[1] == Approx(-4.0f * (1.0f - p0 - 1.0f)));
+    REQUIRE(g->get_variables().size() == 1);
+  }
+}
+
+TEST_CASE("Graph memory planning") {
+  auto build = [](GraphRef g, std::vector<VariableRef>& params) {
+    auto x = Variable::create(g, {3});
+    auto y = Variable::create(g, {2});
+    auto W1 = Variable::create(g, Shape({3, 4}), true);
+    auto b1 = Variable::create(g, {4}, true);
+    auto W2 = Variable::create(g, Shape({4, 2}), true);
+    x->set_value(NDArray({2, 3}, {1, -2, 3, 0.5f, 1, -1}));
+    y->set_value(NDArray({2, 2}, {1, 0, 0, 1}));
+    W1->set_value(NDArray({3, 4}, {0.1f, -0.2f, 0.3f, 0.4f, -0.5f, 0.6f}));
+    b1->set_value(NDArray({4}, {0.1f, -0.1f}));
+    W2->set_value(NDArray({4, 2}, {0.3f, -0.3f, 0.2f}));
+    params = {W1, b1, W2};
+    return x->mm(W1)->add(b1)->relu()->mm(W2)->softmax_ce(y);
+  };
+
+  GraphRef plain = std::make_shared<Graph>();
+  GraphRef planned = std::make_shared<Graph>();
+  std::vector<VariableRef> plain_params, planned_params;
+  auto plain_loss = build(plain, plain_params);
+  auto planned_loss = build(planned, planned_params);
+  planned->set_memory_planning(true);
+
+  for (size_t step = 0; step < 4; ++step) {
+    plain->forward();
+    plain->backward(plain_loss);
+    planned->forward();
+    planned->backward(planned_loss);
+
+    REQUIRE(planned_loss->get_value() == plain_loss->get_value());
+    for (size_t i = 0; i < plain_params.size(); ++i) {
+      REQUIRE(planned->gradient(planned_params[i]) ==
+          plain->gradient(plain_params[i]));
+    }
+  }
+
+  const auto& stats = planned->memory_stats();
+  REQUIRE(stats.buffers > 0);
+  REQUIRE(stats.misses == 0);
+  REQUIRE(stats.arena_bytes > 0);
+  // buffers of a planned step start on 64 byte boundaries
+  for (const auto& param : planned_params) {
+    auto address = reinterpret_cast<uintptr_t>(
+        planned->gradient(param).data());
+    REQUIRE(address % 64 == 0);
+  }
+
+  GIVEN("A gradient held across steps") {
+    auto held = planned->gradient(planned_params[0]);
+    planned->forward();
+    planned->backward(planned_loss);
+    REQUIRE(held.size() == 12);
+    REQUIRE(planned->gradient(planned_params[0]) ==
+        plain->gradient(plain_params[0]));
+  }
+}
+
+TEST_CASE("Graph fusion") {
+  auto build = [](GraphRef g, std::vector<VariableRef>& params,
+      std::vector<OpRef>& layers) {
+    auto x = Variable::create(g, {3});
+    auto y = Variable::create(g, {2});
+    auto W1 = Variable::create(g, Shape({3, 4}), true);
+    auto b1 = Variable::create(g, {4}, true);
+    auto W2 = Variable::create(g, Shape({4, 2}), true);
+    auto b2 = Variable::create(g, {2}, true);
+    x->set_value(NDArray({2, 3}, {1, -2, 3, 0.5f, 1, -1}));
+    y->set_value(NDArray({2, 2}, {1, 0, 0, 1}));
+    W1->set_value(NDArray({3, 4}, {0.1f, -0.2f, 0.3f, 0.4f, -0.5f, 0.6f}));
+    b1->set_value(NDArray({4}, {0.1f, -0.1f}));
+    W2->set_value(NDArray({4, 2}, {0.3f, -0.3f, 0.2f}));
+    b2->set_value(NDArray({2}, {0.5f, -0.5f}));
+    params = {W1, b1, W2, b2};
+
+    auto mm1 = x->mm(W1);
+    auto l1 = mm1->add(b1)->relu();
+    auto l2 = l1->mm(W2)->add(b2);
+    layers = {mm1, l1, l2};
+    return l2->softmax_ce(y);
+  };
+
+  GraphRef plain = std::make_shared<Graph>();
+  GraphRef fused = std::make_shared<Graph>();
+  std::vector<VariableRef> plain_params, fused_params;
+  std::vector<OpRef> plain_layers, fused_layers;
+  auto plain_loss = build(plain, plain_params, plain_layers);
+  auto fused_loss = build(fused, fused_params, fused_layers);
+  plain->set_fusion(false);
+
+  plain->forward();
+  plain->backward(plain_loss);
+  fused->forward();
+  fused->backward(fused_loss);
+
+  REQUIRE(fused_loss->get_value() == plain_loss->get_value());
+  REQUIRE(fused_layers[1]->get_value() == plain_layers[1]->get_value());
+  REQUIRE(fused_layers[2]->get_value() == plain_layers[2]->get_value());
+  for (size_t i = 0; i < plain_params.size(); ++i) {
+    REQUIRE(fused->gradient(fused_params[i]) ==
+        plain->gradient(plain_params[i]));
+  }
+
+  // folded into the relu node
+  REQUIRE(fused_layers[0]->get_value().size() == 0);
+  REQUIRE_THROWS(fused->backward(fused_layers[0]));
+
+  GIVEN("An mm with a second consumer") {
+    auto extra = fused_layers[0]->relu();
+    fused->forward();
+    fused->backward(fused_loss);
+    REQUIRE(fused_layers[0]->get_value() == plain_layers[0]->get_value());
+    REQUIRE(fused_loss->get_value() == plain_loss->get_value());
+    for (size_t i = 0; i < plain_params.size(); ++i) {
+      REQUIRE(fused->gradient(fused_params[i]) ==
+          plain->gradient(plain_params[i]));
+    }
+  }
+}
+
+TEST_CASE("Graph inference mode") {
+  GraphRef g = std::make_shared<Graph>();
+  auto x = Variable::create(g, {3});
+  auto y = Variable::create(g, {2});
+  auto W1 = Variable::create(g, Shape({3, 4}), true);
+  auto W2 = Variable::create(g, Shape({4, 2}), true);
+  x->set_value(NDArray({2, 3}, {1, -2, 3, 0.5f, 1, -1}));
+  y->set_value(NDArray({2, 2}, {1, 0, 0, 1}));
+  W1->set_value(NDArray({3, 4}, {0.1f, -0.2f, 0.3f, 0.4f, -0.5f, 0.6f}));
+  W2->set_value(NDArray({4, 2}, {0.3f, -0.3f, 0.2f}));
+
+  auto h = x->mm(W1)->relu();
+  auto logits = h->mm(W2);
+  auto loss = logits->softmax_ce(y);
+  auto pred = logits->softmax();
+
+  g->forward();
+  g->backward(loss);
+  auto train_loss = loss->get_value();
+  auto train_pred = pred->get_value();
+  auto grad = g->gradient(W1);
+
+  g->set_inference(true);
+  g->forward();
+  REQUIRE(loss->get_value() == train_loss);
+  REQUIRE(pred->get_value() == train_pred);
+  REQUIRE(h->get_value().size() == 0);
+  REQUIRE(logits->get_value().size() == 0);
+  REQUIRE(g->gradient(W1) == grad);
+  REQUIRE_THROWS(g->backward(loss));
+
+  GIVEN("Training again") {
+    g->set_inference(false);
+    g->forward();
+    g->backward(loss);
+    REQUIRE(h->get_value().size() == 8);
+    REQUIRE(g->gradient(W1) == grad);
+  }
+
+  GIVEN("Memory planning") {
+    g->set_memory_planning(true);
+    for (size_t step = 0; step < 3; ++step) {
+      g->forward();
+      REQUIRE(pred->get_value() == train_pred);
+    }
+    REQUIRE(g->memory_stats().misses == 0);
+  }
+}
+
+TEST_CASE("Graph requested outputs") {
+  GraphRef g = std::make_shared<Graph>();
+  auto x = Variable::create(g, {3});
+  auto y = Variable::create(g, {2});
+  auto W1 = Variable::create(g, Shape({3, 2}), true);
+  auto b1 = Variable::create(g, {2}, true);
+  auto W2 = Variable::create(g, Shape({2, 2}), true);
+  x->set_value(NDArray({2, 3}, {1, -2, 3, 0.5f, 1, -1}));
+  y->set_value(NDArray({2, 2}, {1, 0, 0, 1}));
+  W1->set_value(NDArray({3, 2}, {0.1f, -0.2f, 0.3f, 0.4f, -0.5f, 0.6f}));
+  b1->set_value(NDArray({2}, {0.1f, -0.1f}));
+  W2->set_value(NDArray({2, 2}, {0.3f, -0.3f, 0.2f, 0.1f}));
+
+  auto mm1 = x->mm(W1);
+  auto h = mm1->add(b1)->relu();
+  auto loss = h->softmax_ce(y);
+  // not needed for the loss
+  auto dead = h->mm(W2);
+  auto dead_relu = dead->relu();
+
+  g->forward({loss});
+  REQUIRE(loss->get_value().size() == 1);
+  REQUIRE(h->get_value().size() == 4);
+  REQUIRE(dead->get_value().size() == 0);
+  REQUIRE(dead_relu->get_value().size() == 0);
+
+  auto pruned = g->pruned();
+  REQUIRE(pruned.size() == 3);
+  REQUIRE(std::find(pruned.begin(), pruned.end(), NodeRef(W2)) != pruned.end());
+  REQUIRE(std::find(pruned.begin(), pruned.end(), NodeRef(dead)) != pruned.end());
+  REQUIRE(std::find(pruned.begin(), pruned.end(), NodeRef(dead_relu)) != pruned.end());
+
+  REQUIRE_THROWS(g->backward(dead_relu));
+  g->backward(loss);
+  REQUIRE(g->gradient(W1).size() == 6);
+  // a rejected root keeps the gradients of the last call
+  REQUIRE_THROWS(g->backward(dead_relu));
+  REQUIRE(g->gradient(W1).size() == 6);
+
+  GIVEN("All outputs") {
+    g->forward();
+    REQUIRE(g->pruned().empty());
+    REQUIRE(dead_relu->get_value().size() == 4);
+  }
+
+  GIVEN("An output inside a fusable chain") {
+    auto loss_value = loss->get_value();
+    g->forward({mm1, loss});
+    REQUIRE(mm1->get_value().size() == 4);
+    REQUIRE(loss->get_value() == loss_value);
+  }
+
+  GIVEN("An unknown node") {
+    GraphRef other = std::make_shared<Graph>();
+    auto z = Variable::create(other, {2});
+    REQUIRE_THROWS(g->forward({z}));
+  }
+}
+
+TEST_CASE("Graph inter-op parallelism") {
+  auto build = [](GraphRef g, std::vector<VariableRef>& params,
+      std::vector<OpRef>& outputs) {
+    auto x = Variable::create(g, {3});
+    auto y = Variable::create(g, {2});
+    x->set_value(NDArray({2, 3}, {1, -2, 3, 0.5f, 1, -1}));
+    y->set_value(NDArray({2, 2}, {1, 0, 0, 1}));
+
+    // independent towers, joined by sub (AddKernel assumes a row bias)
+    OpRef joined;
+    for (size_t t = 0; t < 4; ++t) {
+      auto W1 = Variable::create(g, Shape({3, 4}), true);
+      auto W2 = Variable::create(g, Shape({4, 2}), true);
+      W1->set_value(NDArray({3, 4}, random_normal_vec<float>(12, 0.0f, 1.0f)));
+      W2->set_value(NDArray({4, 2}, random_normal_vec<float>(8, 0.0f, 1.0f)));
+      params.push_back(W1);
+      params.push_back(W2);
+      auto tower = x->mm(W1)->relu()->mm(W2);
+      joined = joined ? joined->sub(tower) : tower;
+    }
+
+    outputs = {joined->softmax_ce(y), joined->softmax()};
+  };
+
+  size_t threads = ThreadPool::get().num_threads();
+  ThreadPool::get().set_num_threads(4);
+
+  GraphRef serial = std::make_shared<Graph>();
+  GraphRef parallel = std::make_shared<Graph>();
+  std::vector<VariableRef> serial_params, parallel_params;
+  std::vector<OpRef> serial_out, parallel_out;
+  build(serial, serial_params, serial_out);
+  build(parallel, parallel_params, parallel_out);
+  for (size_t i = 0; i < serial_params.size(); ++i) {
+    parallel_params[i]->set_value(serial_params[i]->get_value());
+  }
+  parallel->set_inter_op(true);
+
+  for (size_t step = 0; step < 3; ++step) {
+    serial->forward();
+    serial->backward(serial_out[0]);
+    parallel->forward();
+    parallel->backward(parallel_out[0]);
+
+    REQUIRE(parallel_out[0]->get_value() == serial_out[0]->get_value());
+    REQUIRE(parallel_out[1]->get_value() == serial_out[1]->get_value());
+    for (size_t i = 0; i < serial_params.size(); ++i) {
+      REQUIRE(parallel->gradient(parallel_params[i]) ==
+          serial->gradient(serial_params[i]));
+    }
+  }
+
+  GIVEN("Inference mode") {
+    parallel->set_inference(true);
+    parallel->forward();
+    REQUIRE(parallel_out[1]->get_value() == serial_out[1]->get_value());
+  }
+
+  GIVEN("A failing node") {
+    auto bad = parallel_params[0]->mm(parallel_params[0]);
+    REQUIRE_THROWS(parallel->forward());
+  }
+
+  ThreadPool::get().set_num_threads(threads);
+}
+
+TEST_CASE("Graph inter-op parallelism with split GEMMs") {
+  // layers large enough that every mm splits its tiles between threads
+  // while other towers run on the same pool
+  size_t batch = 192, width = 384;
+  auto build = [&](GraphRef g, std::vector<VariableRef>& params) {
+    auto x = Variable::create(g, {width});
+    std::vector<float> inputs(batch * width);
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      inputs[i] = float(i % 97) / 97.0f;
+    }
+    x->set_value(NDArray({batch, width}, inputs));
+    OpRef joined;
+    for (size_t t = 0; t < 8; ++t) {
+      OpRef h = x;
+      for (size_t l = 0; l < 3; ++l) {
+        auto W = Variable::create(g, Shape({width, width}), true);
+        W->set_value(NDArray({width, width},
+              random_normal_vec<float>(width * width, 0.0f, 0.05f)));
+        params.push_back(W);
+        h = h->mm(W)->relu();
+      }
+      joined = joined ? joined->sub(h) : h;
+    }
+    auto y = Variable::create(g, {width});
+    NDArray targets({batch, width});
+    for (size_t i = 0; i < batch; ++i) {
+      targets.set({i, i % width}, 1.0f);
+    }
+    y->set_value(targets);
+    return joined->softmax_ce(y);
+  };
+
+  size_t threads = ThreadPool::get().num_threads();
+  ThreadPool::get().set_num_threads(8);
+
+  GraphRef serial = std::make_shared<Graph>();
+  GraphRef parallel = std::make_shared<Graph>();
+  std::vector<VariableRef> serial_params, parallel_params;
+  auto serial_out = build(serial, serial_params);
+  auto parallel_out = build(parallel, parallel_params);
+  for (size_t i = 0; i < serial_params.size(); ++i) {
+    parallel_params[i]->set_value(serial_params[i]->get_value());
+  }
+  parallel->set_inter_op(true);
+
+  serial->forward();
+  serial->backward(serial_out);
+  for (size_t step = 0; step < 5; ++step) {
+    parallel->forward();
+    parallel->backward(parallel_out);
+
+    REQUIRE(parallel_out->get_value() == serial_out->get_value());
+    for (size_t i = 0; i < serial_params.size(); ++i) {
+      REQUIRE(parallel->gradient(parallel_params[i]) ==
+          serial->gradient(serial_params[i]));
+    }
+  }
+
+  ThreadPool::get().set_num_threads(threads);
+}
+
+TEST_CASE("Graph incremental forward") {
+  GraphRef g = std::make_shared<Graph>();
+  auto x = Variable::create(g, {3});
+  auto W = Variable::create(g, Shape({3, 2}));
+  auto B = Variable::create(g, Shape({2, 2}));
+  x->set_value(NDArray({2, 3}, {1, -2, 3, 0.5f, 1, -1}));
+  W->set_value(NDArray({3, 2}, {0.1f, -0.2f, 0.3f, 0.4f, -0.5f, 0.6f}));
+  B->set_value(NDArray({2, 2}, {1, -1, 2, 3}));
+  g->set_incremental(true);
+
+  // frozen only depends on B
+  auto frozen = B->relu();
+  auto h = x->mm(W);
+  auto out = h->mul(frozen);
+
+  auto expected = [&]() {
+    return x->get_value().mm(W->get_value()).mul(
+        B->get_value().max_filter(0.0f));
+  };
+
+  g->forward();
+  REQUIRE(out->get_value() == expected());
+  const float* frozen_data = frozen->get_value().data();
+  const float* h_data = h->get_value().data();
+
+  g->forward();
+  REQUIRE(h->get_value().data() == h_data);
+  REQUIRE(frozen->get_value().data() == frozen_data);
+
+  x->set_value(NDArray({2, 3}, {0, 1, 2, 3, 4, 5}));
+  g->forward();
+  REQUIRE(out->get_value() == expected());
+  REQUIRE(h->get_value().data() != h_data);
+  REQUIRE(frozen->get_value().data() == frozen_data);
+
+  B->set_value(NDArray({2, 2}, {-1, 1, 2, -3}));
+  g->forward();
+  REQUIRE(out->get_value() == expected());
+  REQUIRE(frozen->get_value().data() != frozen_data);
+
+  GIVEN("Inference mode") {
+    g->set_inference(true);
+    // everything runs and intermediate values are dropped
+    g->forward();
+    REQUIRE(frozen->get_value().size() == 0);
+
+    // the dropped frozen value is recomputed once and then kept
+    x->set_value(NDArray({2, 3}, {1, 1, 1, 2, 2, 2}));
+    g->forward();
+    REQUIRE(out->get_value() == expected());
+    REQUIRE(h->get_value().size() == 0);
+    frozen_data = frozen->get_value().data();
+    REQUIRE(frozen_data != nullptr);
+
+    x->set_value(NDArray({2, 3}, {3, 1, 1, 2, 2, 2}));
+    g->forward();
+    REQUIRE(out->get_value() == expected());
+    REQUIRE(frozen->get_value().data() == frozen_data);
+  }
+
+  GIVEN("Incremental evaluation disabled") {
+    g->set_incremental(false);
+    g->forward();
+    REQUIRE(frozen->get_value().data() != frozen_data);
+    REQUIRE(out->get_value() == expected());
+  }
+}
+
+TEST_CASE("Graph checkpointing") {
+  auto build = [](GraphRef g, std::vector<VariableRef>& params,
+      std::vector<OpRef>& layers) {
+    auto x = Variable::create(g, {3});
+    auto y = Variable::create(g, {2});
+    auto W1 = Variable::create(g, Shape({3, 4}), true);
+    auto b1 = Variable::create(g, {4}, true);
+    auto W2 = Variable::create(g, Shape({4, 4}), true);
+    auto b2 = Variable::create(g, {4}, true);
+    auto W3 = Variable::create(g, Shape({4, 2}), true);
+    x->set_value(NDArray({2, 3}, {1, -2, 3, 0.5f, 1, -1}));
+    y->set_value(NDArray({2, 2}, {1, 0, 0, 1}));
+    W1->set_value(NDArray({3, 4}, {0.1f, -0.2f, 0.3f, 0.4f, -0.5f, 0.6f}));
+    b1->set_value(NDArray({4}, {0.1f, -0.1f}));
+    W2->set_value(NDArray({4, 4}, {0.3f, -0.3f, 0.2f, 0.5f, -0.1f}));
+    b2->set_value(NDArray({4}, {0.2f, 0.1f}));
+    W3->set_value(NDArray({4, 2}, {0.3f, -0.3f, 0.2f}));
+    params = {W1, b1, W2, b2, W3};
+
+    auto l1 = x->mm(W1)->add(b1)->relu();
+    auto l2 = l1->mm(W2)->add(b2)->relu();
+    // l1 skips the checkpoint at l2
+    auto l3 = l2->sub(l1)->mm(W3);
+    layers = {l1, l2, l3};
+    return l3->softmax_ce(y);
+  };
+
+  GraphRef plain = std::make_shared<Graph>();
+  GraphRef g = std::make_shared<Graph>();
+  std::vector<VariableRef> plain_params, params;
+  std::vector<OpRef> plain_layers, layers;
+  auto plain_loss = build(plain, plain_params, plain_layers);
+  auto loss = build(g, params, layers);
+
+  plain->forward();
+  plain->backward(plain_loss);
+
+  auto check = [&]() {
+    g->forward();
+    // only the checkpoint and the results are kept
+    REQUIRE(layers[0]->get_value().size() == 0);
+    REQUIRE(layers[1]->get_value() == plain_layers[1]->get_value());
+    REQUIRE(layers[2]->get_value().size() == 0);
+    REQUIRE(loss->get_value() == plain_loss->get_value());
+
+    g->backward(loss);
+    for (size_t i = 0; i < params.size(); ++i) {
+      REQUIRE(g->gradient(params[i]) == plain->gradient(plain_params[i]));
+    }
+    REQUIRE(layers[0]->get_value().size() == 0);
+
+    const auto& stats = g->checkpoint_stats();
+    REQUIRE(stats.segments == 2);
+    // the second segment needs l1 again
+    REQUIRE(stats.recomputed_nodes > 3);
+    REQUIRE(stats.kept_bytes < plain->checkpoint_stats().kept_bytes);
+  };
+
+  g->checkpoint(layers[1]);
+  check();
+
+  GIVEN("A second step") {
+    params[0]->set_value(NDArray({3, 4}, {0.2f, -0.2f, 0.3f}));
+    plain_params[0]->set_value(NDArray({3, 4}, {0.2f, -0.2f, 0.3f}));
+    plain->forward();
+    plain->backward(plain_loss);
+    check();
+  }
+
+  GIVEN("Memory planning") {
+    g->set_memory_planning(true);
+    check();
+    check();
+  }
+
+  GIVEN("No checkpoints") {
+    g->clear_checkpoints();
+    g->forward();
+    g->backward(loss);
+    REQUIRE(layers[0]->get_value() == plain_layers[0]->get_value());
+    REQUIRE(g->checkpoint_stats().recomputed_nodes == 0);
+  }
+}
+
+TEST_CASE("Graph profiling") {
+  GraphRef g = std::make_shared<Graph>();
+  auto x = Variable::create(g, {3});
+  auto y = Variable::create(g, {2});
+  auto W = Variable::create(g, Shape({3, 2}), true);
+  x->set_value(NDArray({4, 3}, {1, -2, 3, 0.5f, 1, -1}));
+  y->set_value(NDArray({4, 2}, {1, 0, 0, 1, 1, 0, 0, 1}));
+  W->set_value(NDArray({3, 2}, {0.1f, -0.2f, 0.3f, 0.4f, -0.5f, 0.6f}));
+
+  auto h = x->mm(W);
+  auto loss = h->relu()->softmax_ce(y);
+
+  g->forward();
+  g->backward(loss);
+  REQUIRE(g->profile().events().empty());
+
+  // a new batch, or incremental evaluation runs nothing
+  g->set_profiling(true);
+  x->set_value(x->get_value());
+  g->forward();
+  g->backward(loss);
+
+  // mm, relu and softmax_ce, leaves are not recorded
+  const auto& events = g->profile().events();
+  REQUIRE(events.size() == 6);
+  REQUIRE(events[0].name == "mm #" + std::to_string(h->id()));
+  REQUIRE(events[0].pass == Profiler::Pass::forward);
+  REQUIRE(events[0].shape == std::vector<size_t>({4, 2}));
+  REQUIRE(events[0].flops == 2 * 4 * 2 * 3);
+  REQUIRE(events[0].bytes >= 4 * 2 * sizeof(float));
+  REQUIRE(events[5].name == events[0].name);
+  REQUIRE(events[5].pass == Profiler::Pass::backward);
+  REQUIRE(events[5].flops == 2 * events[0].flops);
+  for (size_t i = 1; i < events.size(); ++i) {
+    REQUIRE(events[i].start >= events[i - 1].start + events[i - 1].duration);
+  }
+
+  std::stringstream trace;
+  g->profile().write_trace(trace);
+  REQUIRE(trace.str().find("\"ph\": \"X\"") != std::string::npos);
+  REQUIRE(trace.str().find("\"cat\": \"backward\"") != std::string::npos);
+
+  std::stringstream summary;
+  g->profile().write_summary(summary);
+  REQUIRE(summary.str().find("relu #") != std::string::npos);
+
+  g->profile().clear();
+  REQUIRE(g->profile().events().empty());
+}
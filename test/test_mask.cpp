@@ -0,0 +1,52 @@
+#include <random>
+
+#include "catch.hpp"
+#include "../mask.h"
+
+TEST_CASE("BitMask") {
+  // odd length so the tail word is covered too
+  size_t n = 100003;
+  std::mt19937 rng(3);
+  std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+  std::vector<float> x(n), g(n);
+  for (size_t i = 0; i < n; ++i) {
+    x[i] = i % 7 == 0 ? 0.0f : dist(rng);
+    g[i] = dist(rng);
+  }
+  NDArray X({n}, x);
+  NDArray G({n}, g);
+
+  for (auto isa : {SimdIsa::scalar, SimdIsa::avx2, SimdIsa::avx512}) {
+    if (!simd_supported(isa)) {
+      continue;
+    }
+
+    BitMask mask(X, isa);
+    REQUIRE(mask.size() == n);
+    auto res = mask.apply(G, isa);
+    REQUIRE(res.shape() == X.shape());
+
+    bool ok = true;
+    for (size_t i = 0; i < n; ++i) {
+      ok = ok && mask.get(i) == (x[i] > 0.0f);
+      ok = ok && res.data()[i] == (x[i] > 0.0f ? g[i] : 0.0f);
+    }
+    REQUIRE(ok);
+  }
+
+  GIVEN("A broadcast gradient") {
+    BitMask mask(NDArray({2, 3}, {1, -1, 0, 2, 3, -4}));
+    REQUIRE(mask.apply(NDArray({1}, {5})) ==
+        NDArray({2, 3}, {5, 0, 0, 5, 5, 0}));
+    REQUIRE(mask.apply(NDArray({3}, {1, 2, 3})) ==
+        NDArray({2, 3}, {1, 0, 0, 1, 2, 0}));
+  }
+
+  GIVEN("A strided view") {
+    NDArray a({2, 3}, {1, -1, 0, 2, 3, -4});
+    BitMask mask(a.transpose());
+    REQUIRE(mask.shape() == std::vector<size_t>({3, 2}));
+    REQUIRE(mask.apply(NDArray({3, 2}, {1, 1, 1, 1, 1, 1})) ==
+        NDArray({3, 2}, {1, 1, 0, 1, 0, 0}));
+  }
+}
@@ -0,0 +1,242 @@
+#include <set>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+
+#include "catch.hpp"
+#include "../mnist.h"
+
+namespace {
+
+void write_u32(std::ofstream& os, uint32_t v) {
+  unsigned char bytes[4] = {
+    static_cast<unsigned char>(v >> 24), static_cast<unsigned char>(v >> 16),
+    static_cast<unsigned char>(v >> 8), static_cast<unsigned char>(v)};
+  os.write(reinterpret_cast<char*>(bytes), 4);
+}
+
+void write_images(const std::string& path, size_t n) {
+  std::ofstream images(path, std::ios::binary);
+  write_u32(images, 0x803);
+  write_u32(images, n);
+  write_u32(images, 28);
+  write_u32(images, 28);
+  for (size_t i = 0; i < n; ++i) {
+    std::string pixels(MNIST::img_size, static_cast<char>(i));
+    images.write(pixels.data(), pixels.size());
+  }
+}
+
+void write_labels(const std::string& path, size_t n) {
+  std::ofstream labels(path, std::ios::binary);
+  write_u32(labels, 0x801);
+  write_u32(labels, n);
+  for (size_t i = 0; i < n; ++i) {
+    labels.put(static_cast<char>(i % 10));
+  }
+}
+
+const char* const files[] = {
+  "train-images-idx3-ubyte", "train-labels-idx1-ubyte",
+  "t10k-images-idx3-ubyte", "t10k-labels-idx1-ubyte",
+};
+
+// n training and m test images where every pixel of image i is i, labels
+// i % 10, no test files for m = 0
+std::string write_dataset(size_t n, size_t m = 0) {
+  char dir[] = "/tmp/uflow_mnistXXXXXX";
+  REQUIRE(mkdtemp(dir) != nullptr);
+  std::string path = dir;
+
+  write_images(path + "/" + files[0], n);
+  write_labels(path + "/" + files[1], n);
+  if (m > 0) {
+    write_images(path + "/" + files[2], m);
+    write_labels(path + "/" + files[3], m);
+  }
+  return path;
+}
+
+void remove_dataset(const std::string& dir) {
+  for (auto file : files) {
+    std::remove((dir + "/" + file).c_str());
+  }
+  std::remove(dir.c_str());
+}
+
+} // namespace
+
+TEST_CASE("EpochSampler") {
+  EpochSampler sampler(10, 7);
+  std::vector<size_t> idx(4);
+
+  // 3 batches of 4 cover the first epoch and half a batch of the second
+  std::multiset<size_t> first;
+  for (size_t b = 0; b < 2; ++b) {
+    sampler.next(idx.data(), idx.size());
+    first.insert(idx.begin(), idx.end());
+  }
+  REQUIRE(sampler.epoch() == 0);
+  sampler.next(idx.data(), idx.size());
+  first.insert(idx[0]);
+  first.insert(idx[1]);
+  REQUIRE(sampler.epoch() == 1);
+
+  REQUIRE(first.size() == 10);
+  REQUIRE(std::set<size_t>(first.begin(), first.end()).size() == 10);
+
+  REQUIRE_THROWS(EpochSampler().next(idx.data(), 1));
+}
+
+TEST_CASE("MNISTLoader") {
+  size_t n = 10;
+  std::string dir = write_dataset(n);
+  MNIST mnist;
+  mnist.load(dir, true);
+  remove_dataset(dir);
+  REQUIRE(mnist.train_size == n);
+
+  MNISTLoader loader(mnist, 5, 3, 1);
+  std::multiset<int> seen;
+  const float* storage = nullptr;
+  for (size_t b = 0; b < 6; ++b) {
+    const auto& batch = loader.next();
+    REQUIRE(batch.images.shape() == std::vector<size_t>({5, MNIST::img_size}));
+    REQUIRE(batch.epoch == b / 2);
+
+    for (size_t i = 0; i < 5; ++i) {
+      int label = batch.labels[i];
+      float pixel = batch.images.get({i, 0});
+      // image k has pixels k / 255 and label k % 10
+      REQUIRE(int(std::round(pixel * 255.0f)) % 10 == label);
+      REQUIRE(batch.images.get({i, MNIST::img_size - 1}) == pixel);
+      for (size_t c = 0; c < MNIST::classes; ++c) {
+        REQUIRE(batch.targets.get({i, c}) == (int(c) == label ? 1.0f : 0.0f));
+      }
+      if (b < 2) {
+        seen.insert(label);
+      }
+    }
+
+    // the ring of 3 comes around again, refilled in place
+    if (b == 0) {
+      storage = batch.images.data();
+    }
+    if (b == 3) {
+      REQUIRE(batch.images.data() == storage);
+    }
+  }
+  REQUIRE(std::set<int>(seen.begin(), seen.end()).size() == n);
+
+  auto legacy = mnist.get_train_batch(4);
+  REQUIRE(std::get<0>(legacy).size() == 4 * MNIST::img_size);
+  REQUIRE(std::get<1>(legacy).size() == 4);
+}
+
+TEST_CASE("IDXFile") {
+  char dir[] = "/tmp/uflow_idxXXXXXX";
+  REQUIRE(mkdtemp(dir) != nullptr);
+  std::string path = std::string(dir) + "/values";
+
+  GIVEN("int32 values") {
+    {
+      std::ofstream os(path, std::ios::binary);
+      write_u32(os, 0x0c02);
+      write_u32(os, 2);
+      write_u32(os, 3);
+      for (int v : {1, -2, 3, 70000, 0, -70000}) {
+        write_u32(os, static_cast<uint32_t>(v));
+      }
+    }
+
+    IDXFile file(path);
+    REQUIRE(file.type() == IDXFile::i32);
+    REQUIRE(file.dims() == std::vector<size_t>({2, 3}));
+    REQUIRE(file.items() == 2);
+    REQUIRE(file.item_size() == 3);
+    REQUIRE(file.type_size() == 4);
+    REQUIRE(file.value(1) == -2.0);
+    REQUIRE(file.value(3) == 70000.0);
+    REQUIRE(file.value(5) == -70000.0);
+    REQUIRE(file.item(1) == file.data() + 12);
+
+    IDXFile moved(std::move(file));
+    REQUIRE(file.items() == 0);
+    REQUIRE(moved.value(0) == 1.0);
+  }
+
+  GIVEN("Broken files") {
+    REQUIRE_THROWS_AS(IDXFile(path + "_missing"), const RuntimeError&);
+
+    {
+      std::ofstream os(path, std::ios::binary);
+      write_u32(os, 0x1803);
+    }
+    REQUIRE_THROWS_AS(IDXFile{path}, const ValueError&);
+
+    {
+      std::ofstream os(path, std::ios::binary);
+      write_u32(os, 0x0801);
+      write_u32(os, 5);
+      os.write("abcd", 4);
+    }
+    REQUIRE_THROWS_AS(IDXFile{path}, const ValueError&);
+
+    // 65536^4 bytes wrap around to 0 in 64 bits
+    {
+      std::ofstream os(path, std::ios::binary);
+      write_u32(os, 0x0804);
+      for (size_t i = 0; i < 4; ++i) {
+        write_u32(os, 65536);
+      }
+    }
+    REQUIRE_THROWS_AS(IDXFile{path}, const ValueError&);
+
+    // an item larger than any size_t
+    {
+      std::ofstream os(path, std::ios::binary);
+      write_u32(os, 0x0d05);
+      for (size_t i = 0; i < 5; ++i) {
+        write_u32(os, 0xffffffff);
+      }
+    }
+    REQUIRE_THROWS_AS(IDXFile{path}, const ValueError&);
+  }
+
+  std::remove(path.c_str());
+  std::remove(dir);
+}
+
+TEST_CASE("MNIST test set") {
+  std::string dir = write_dataset(20, 13);
+  MNIST mnist;
+  mnist.load(dir, false);
+  remove_dataset(dir);
+  REQUIRE(mnist.train_size == 20);
+  REQUIRE(mnist.test_size == 13);
+
+  std::vector<size_t> idx = {12, 0, 7};
+  std::vector<float> images(3 * MNIST::img_size);
+  std::vector<float> targets(3 * MNIST::classes);
+  std::vector<int> labels(3);
+  mnist.gather_test(idx.data(), 3, images.data(), targets.data(),
+      labels.data());
+  REQUIRE(labels == std::vector<int>({2, 0, 7}));
+  // not normalized
+  REQUIRE(images[0] == 12.0f);
+  REQUIRE(images[MNIST::img_size - 1] == 12.0f);
+  REQUIRE(images[2 * MNIST::img_size + 5] == 7.0f);
+  REQUIRE(targets[2] == 1.0f);
+  REQUIRE(targets[MNIST::classes] == 1.0f);
+
+  // without targets
+  mnist.gather_test(idx.data(), 3, images.data(), nullptr, labels.data());
+  REQUIRE(labels == std::vector<int>({2, 0, 7}));
+
+  auto batch = mnist.get_train_batch(4);
+  REQUIRE(std::get<0>(batch).size() == 4 * MNIST::img_size);
+
+  idx[0] = 13;
+  REQUIRE_THROWS_AS(mnist.gather_test(idx.data(), 3, images.data(),
+        targets.data(), labels.data()), const ValueError&);
+}
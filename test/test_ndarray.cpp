@@ -118,6 +118,101 @@ TEST_CASE("NDArray::mm") {
         == NDArray({2, 3}, {21, 24, 27, 47, 54, 61}));
 
   }
+
+  GIVEN("Transposed operands") {
+    NDArray a({3, 2}, {1, 2, 3, 4, 5, 6});
+    NDArray b({2, 4}, {1, 2, 3, 4, 5, 6, 7, 8});
+    NDArray c({3, 2}, {1, 2, 3, 4, 5, 6});
+
+    REQUIRE(a.mm(a, true, false) == a.transpose().mm(a));
+    REQUIRE(a.mm(a, false, true) == a.mm(a.transpose()));
+    REQUIRE(b.mm(a, true, true) == b.transpose().mm(a.transpose()));
+    REQUIRE(b.mm(c, true, true) == b.transpose().mm(c.transpose()));
+
+    CHECK_THROWS(a.mm(b, true, false));
+    CHECK_THROWS(a.mm(b, false, true));
+  }
+
+  GIVEN("A fused bias and ReLU") {
+    NDArray a({2, 2}, {1, 2, 3, 4});
+    NDArray b({2, 3}, {5, -6, 7, -8, 9, -10});
+    NDArray bias({3}, {1, -50, 2});
+
+    REQUIRE(a.mm_bias(b, bias, false) == a.mm(b).add(bias));
+    REQUIRE(a.mm_bias(b, bias, true) == a.mm(b).add(bias).max_filter(0.0f));
+    REQUIRE(a.mm_bias(b, NDArray({1, 3}, {1, -50, 2}), true)
+        == a.mm_bias(b, bias, true));
+    REQUIRE(a.mm_bias(a, NDArray({2}, {1, 1}), false, true, true)
+        == a.mm(a, true, true).add(NDArray({2}, {1, 1})));
+
+    CHECK_THROWS(a.mm_bias(b, NDArray({2}), false));
+    CHECK_THROWS(a.mm_bias(b, NDArray({2, 3}), false));
+  }
+}
+
+TEST_CASE("sgemm") {
+  auto reference = [](size_t m, size_t n, size_t k,
+      const std::vector<float>& A, const std::vector<float>& B) {
+    std::vector<float> C(m * n, 0.0f);
+    for (size_t i = 0; i < m; ++i) {
+      for (size_t j = 0; j < n; ++j) {
+        for (size_t l = 0; l < k; ++l) {
+          C[i * n + j] += A[i * k + l] * B[l * n + j];
+        }
+      }
+    }
+    return C;
+  };
+
+  GIVEN("Shapes not divisible by the block sizes") {
+    // odd edges, exact tiles and multiple KC/MC blocks
+    std::vector<std::vector<size_t>> shapes = {
+      {1, 1, 1}, {3, 5, 7}, {gemm_mr, gemm_nr, 3},
+      {gemm_mr + 1, gemm_nr + 1, 5}, {97, 33, 300}, {130, 70, 513},
+    };
+
+    for (auto& s : shapes) {
+      size_t m = s[0], n = s[1], k = s[2];
+      auto A = random_vec<float>(m * k, -1.0f, 1.0f);
+      auto B = random_vec<float>(k * n, -1.0f, 1.0f);
+      auto expected = reference(m, n, k, A, B);
+
+      NDArray res = NDArray({m, k}, A).mm(NDArray({k, n}, B));
+      auto C = res.vec();
+
+      REQUIRE(C.size() == expected.size());
+      for (size_t i = 0; i < C.size(); ++i) {
+        REQUIRE(C[i] == Approx(expected[i]).epsilon(1e-4));
+      }
+    }
+  }
+
+  GIVEN("Transposed operands not divisible by the block sizes") {
+    std::vector<std::vector<size_t>> shapes = {
+      {3, 5, 7}, {gemm_mr + 1, gemm_nr + 1, 5}, {97, 33, 300}, {130, 70, 513},
+    };
+
+    for (auto& s : shapes) {
+      size_t m = s[0], n = s[1], k = s[2];
+      NDArray A({m, k}, random_vec<float>(m * k, -1.0f, 1.0f));
+      NDArray B({k, n}, random_vec<float>(k * n, -1.0f, 1.0f));
+      auto expected = reference(m, n, k, A.vec(), B.vec());
+
+      auto A_t = A.transpose();
+      auto B_t = B.transpose();
+      std::vector<NDArray> results = {
+        A_t.mm(B, true, false), A.mm(B_t, false, true), A_t.mm(B_t, true, true),
+      };
+
+      for (auto& res : results) {
+        auto C = res.vec();
+        REQUIRE(C.size() == expected.size());
+        for (size_t i = 0; i < C.size(); ++i) {
+          REQUIRE(C[i] == Approx(expected[i]).epsilon(1e-4));
+        }
+      }
+    }
+  }
 }
 
 TEST_CASE("NDArray::bmm") {
@@ -166,15 +261,65 @@ TEST_CASE("NDArray::bmm") {
     REQUIRE(NDArray({2, 2}, {1, 2, 3, 4}).bmm(NDArray({4, 2, 3}, {5, 6, 7, 8, 9, 10}))
         == NDArray({4, 2, 3}, {21, 24, 27, 47, 54, 61}));
   }
+
+  GIVEN("Transposed operands") {
+    NDArray a({2, 3, 2}, {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12});
+    NDArray b({3, 4}, {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12});
+    NDArray c({4, 3}, {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12});
+
+    REQUIRE(a.bmm(b, true, false) == a.transpose().bmm(b));
+    REQUIRE(a.bmm(a, false, true) == a.bmm(a.transpose()));
+    REQUIRE(a.bmm(c, true, true) == a.transpose().bmm(c.transpose()));
+
+    CHECK_THROWS(a.bmm(b, false, true));
+  }
 }
 
 TEST_CASE("NDArray::reduce_max") {
+  NDArray a({2, 3, 2}, {-1, -2, -3, -4, -5, -6, 7, 8, 9, 10, 11, 12});
+
+  REQUIRE(a.reduce_max() == NDArray({1}, {12}));
+  REQUIRE(a.reduce_max(-1, true) == NDArray({1, 1, 1}, {12}));
+  REQUIRE(a.reduce_max(0) == NDArray({3, 2}, {7, 8, 9, 10, 11, 12}));
+  REQUIRE(a.reduce_max(1) == NDArray({2, 2}, {-1, -2, 11, 12}));
+  REQUIRE(a.reduce_max(2, true) == NDArray({2, 3, 1}, {-1, -3, -5, 8, 10, 12}));
+  CHECK_THROWS(a.reduce_max(3));
+
+  GIVEN("A view") {
+    REQUIRE(a.slice(0, 0, 1).reduce_max(1) == NDArray({1, 2}, {-1, -2}));
+    REQUIRE(a.slice(1, 1, 3).reduce_max(2) == NDArray({2, 2}, {-3, -5, 10, 12}));
+  }
 }
 
 TEST_CASE("NDArray::reduce_sum") {
+  NDArray a({2, 3, 2}, {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12});
+
+  REQUIRE(a.reduce_sum() == NDArray({1}, {78}));
+  REQUIRE(a.reduce_sum(0) == NDArray({3, 2}, {8, 10, 12, 14, 16, 18}));
+  REQUIRE(a.reduce_sum(2) == NDArray({2, 3}, {3, 7, 11, 15, 19, 23}));
+  REQUIRE(a.transpose().reduce_sum(1, true) ==
+      NDArray({2, 1, 3}, {3, 7, 11, 15, 19, 23}));
+
+  GIVEN("Rows longer than the vector width") {
+    size_t n = 1000;
+    NDArray b({3, n});
+    b.set({1, n - 1}, 2.0f);
+    for (size_t i = 0; i < n; ++i) {
+      b.set({2, i}, float(i));
+    }
+    REQUIRE(b.reduce_sum(1) == NDArray({3}, {0, 2, float(n * (n - 1) / 2)}));
+    REQUIRE(b.reduce_sum() == NDArray({1}, {float(n * (n - 1) / 2 + 2)}));
+  }
 }
 
 TEST_CASE("NDArray::argmax") {
+  NDArray a({2, 3, 2}, {-1, -2, -3, -4, -5, -6, 7, 8, 9, 10, 9, 1});
+
+  REQUIRE(a.argmax() == NDArray({1}, {9}));
+  REQUIRE(a.argmax(0) == NDArray({3, 2}, {1, 1, 1, 1, 1, 1}));
+  REQUIRE(a.argmax(1) == NDArray({2, 2}, {0, 0, 1, 1}));
+  REQUIRE(a.argmax(2) == NDArray({2, 3}, {0, 0, 0, 1, 1, 0}));
+  REQUIRE(a.transpose().argmax(1) == NDArray({2, 3}, {0, 0, 0, 1, 1, 0}));
 }
 
 TEST_CASE("NDArray::squeeze, NDArray::unsqueeze") {
@@ -189,3 +334,186 @@ TEST_CASE("NDArray::max_filter") {
 TEST_CASE("NDArray::minimum") {
 }
 
+
+TEST_CASE("ThreadPool") {
+  auto& pool = ThreadPool::get();
+  size_t saved = pool.num_threads();
+
+  GIVEN("parallel_for over a range") {
+    pool.set_num_threads(4);
+    std::vector<int> hits(100003, 0);
+    parallel_for(0, hits.size(), 1000, [&](size_t b, size_t e) {
+      for (size_t i = b; i < e; ++i) {
+        hits[i]++;
+      }
+    });
+    REQUIRE(std::count(hits.begin(), hits.end(), 1) == int(hits.size()));
+
+    CHECK_THROWS(parallel_for(0, 100, 1, [](size_t b, size_t e) {
+      if (b > 0) throw RuntimeError("chunk failed");
+    }));
+  }
+
+  GIVEN("NDArray ops large enough to be split") {
+    NDArray a({300, 257}, random_vec<float>(300 * 257, -1.0f, 1.0f));
+    NDArray b({300, 257}, random_vec<float>(300 * 257, -1.0f, 1.0f));
+    NDArray r({257}, random_vec<float>(257, -1.0f, 1.0f));
+    NDArray w({257, 130}, random_vec<float>(257 * 130, -1.0f, 1.0f));
+    NDArray c({4, 300, 257}, random_vec<float>(4 * 300 * 257, -1.0f, 1.0f));
+
+    auto run = [&]() {
+      return std::vector<NDArray>{
+        a.add(b), a.sub(b), a.mul(b), a.add(r), a.muls(3.0f), a.exp(),
+        a.max_filter(0.0f), a.transpose(), r.expand({300, 257}),
+        a.reduce_sum(0), a.reduce_sum(1), a.reduce_max(1, true),
+        c.reduce_sum(1), a.argmax(1), a.mm(w), c.bmm(w),
+      };
+    };
+
+    pool.set_num_threads(1);
+    auto expected = run();
+
+    for (size_t threads : {2, 3, 8}) {
+      pool.set_num_threads(threads);
+      auto res = run();
+      for (size_t i = 0; i < res.size(); ++i) {
+        REQUIRE(res[i].shape() == expected[i].shape());
+        auto v1 = res[i].vec();
+        auto v2 = expected[i].vec();
+        for (size_t j = 0; j < v1.size(); ++j) {
+          REQUIRE(v1[j] == Approx(v2[j]).epsilon(1e-4));
+        }
+      }
+    }
+  }
+
+  GIVEN("Strided reduction over a middle axis") {
+    NDArray a({2, 3, 2}, {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12});
+    REQUIRE(a.reduce_sum(1) == NDArray({2, 2}, {9, 12, 27, 30}));
+  }
+
+  pool.set_num_threads(saved);
+}
+
+TEST_CASE("NDArray views") {
+  NDArray a({2, 3}, {1, 2, 3, 4, 5, 6});
+
+  GIVEN("Copies and views share storage until written") {
+    auto b = a;
+    auto t = a.transpose();
+    REQUIRE(b.data() == a.data());
+    REQUIRE(t.data() == a.data());
+    REQUIRE_FALSE(t.is_contiguous());
+    REQUIRE(t == NDArray({3, 2}, {1, 4, 2, 5, 3, 6}));
+    REQUIRE(t.get({2, 1}) == 6);
+
+    b.muls_(2.0f);
+    t.set({0, 1}, 10.0f);
+    REQUIRE(a == NDArray({2, 3}, {1, 2, 3, 4, 5, 6}));
+    REQUIRE(b == NDArray({2, 3}, {2, 4, 6, 8, 10, 12}));
+    REQUIRE(t == NDArray({3, 2}, {1, 10, 2, 5, 3, 6}));
+    REQUIRE(t.is_contiguous());
+  }
+
+  GIVEN("Broadcast views") {
+    NDArray r({3}, {1, 2, 3});
+    auto e = r.expand({2, 2, 3});
+    REQUIRE(e.data() == r.data());
+    REQUIRE(e.strides() == std::vector<size_t>({0, 0, 1}));
+    REQUIRE(e == NDArray({2, 2, 3}, {1, 2, 3}));
+    REQUIRE(e.reduce_sum(0) == NDArray({2, 3}, {2, 4, 6}));
+    CHECK_THROWS(r.expand({2, 4}));
+  }
+
+  GIVEN("Slices") {
+    auto s = a.slice(1, 1, 3);
+    REQUIRE(s.data() == a.data() + 1);
+    REQUIRE(s == NDArray({2, 2}, {2, 3, 5, 6}));
+    REQUIRE(a.slice(0, 1, 2) == NDArray({1, 3}, {4, 5, 6}));
+    REQUIRE(s.add(s) == NDArray({2, 2}, {4, 6, 10, 12}));
+    CHECK_THROWS(a.slice(1, 2, 4));
+    CHECK_THROWS(a.slice(2, 0, 1));
+  }
+
+  GIVEN("Reshape and unsqueeze") {
+    auto b = a;
+    b.reshape({3, 2});
+    REQUIRE(b.data() == a.data());
+
+    auto t = a.transpose();
+    t.reshape({6});
+    REQUIRE(t == NDArray({6}, {1, 4, 2, 5, 3, 6}));
+
+    auto u = a.transpose();
+    u.unsqueeze(0);
+    u.unsqueeze(3);
+    REQUIRE(u.shape() == std::vector<size_t>({1, 3, 2, 1}));
+    REQUIRE(u.data() == a.data());
+    REQUIRE(u.vec() == std::vector<float>({1, 4, 2, 5, 3, 6}));
+  }
+
+  GIVEN("Matrix products of views") {
+    NDArray w({3, 2}, {1, 2, 3, 4, 5, 6});
+    auto expected = a.mm(a.transpose().clone());
+    REQUIRE(a.mm(a.transpose()) == expected);
+    REQUIRE(a.transpose().mm(a.transpose(), true, false) == expected);
+    REQUIRE(a.slice(1, 0, 2).mm(w.slice(0, 1, 3))
+        == NDArray({2, 2}, {13, 16, 37, 46}));
+    REQUIRE(a.expand({4, 2, 3}).bmm(w) == a.mm(w).expand({4, 2, 2}));
+  }
+}
+
+TEST_CASE("NDArray broadcasting") {
+  // reference: materialize both sides, then combine elementwise
+  auto reference = [](const NDArray& a, const NDArray& b, int op) {
+    auto shape = a.get_common_shape(b);
+    auto x = a.expand(shape).vec();
+    auto y = b.expand(shape).vec();
+    for (size_t i = 0; i < x.size(); ++i) {
+      x[i] = op == 0 ? x[i] + y[i] : (op == 1 ? x[i] - y[i] : x[i] * y[i]);
+    }
+    return NDArray(shape, x);
+  };
+
+  NDArray m({4, 3, 5}, random_vec<float>(60, -1.0f, 1.0f));
+  std::vector<NDArray> others = {
+    NDArray({1}, {2.5f}),
+    NDArray({5}, random_vec<float>(5, -1.0f, 1.0f)),
+    NDArray({3, 1}, random_vec<float>(3, -1.0f, 1.0f)),
+    NDArray({4, 1, 5}, random_vec<float>(20, -1.0f, 1.0f)),
+    NDArray({4, 3, 1}, random_vec<float>(12, -1.0f, 1.0f)),
+    NDArray({2, 4, 3, 5}, random_vec<float>(120, -1.0f, 1.0f)),
+    NDArray({4, 5, 3}, random_vec<float>(60, -1.0f, 1.0f)).transpose(),
+  };
+
+  GIVEN("Operands of different shapes") {
+    for (auto& o : others) {
+      REQUIRE(m.add(o) == reference(m, o, 0));
+      REQUIRE(m.sub(o) == reference(m, o, 1));
+      REQUIRE(m.mul(o) == reference(m, o, 2));
+      REQUIRE(o.add(m) == reference(o, m, 0));
+      REQUIRE(o.sub(m) == reference(o, m, 1));
+    }
+
+    CHECK_THROWS(m.add(NDArray({3})));
+    CHECK_THROWS(m.mul(NDArray({4, 5})));
+  }
+
+  GIVEN("Strided operands") {
+    NDArray t({5, 3}, random_vec<float>(15, -1.0f, 1.0f));
+    REQUIRE(m.add(t.transpose()) == reference(m, t.transpose().clone(), 0));
+    REQUIRE(t.transpose().mul(m) == reference(t.transpose().clone(), m, 2));
+  }
+
+  GIVEN("In-place ops keep copies intact") {
+    auto a = m;
+    auto b = m;
+    a.add_(others[1]);
+    REQUIRE(b == m);
+    REQUIRE(a == reference(m, others[1], 0));
+
+    auto c = m.clone();
+    c.sub_(c);
+    REQUIRE(c == NDArray({4, 3, 5}));
+  }
+}
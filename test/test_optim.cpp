@@ -0,0 +1,181 @@
+#include <cmath>
+
+#include "catch.hpp"
+#include "../graph.h"
+#include "../kernel.h"
+#include "../optim.h"
+
+TEST_CASE("Optimizers") {
+  GraphRef g = std::make_shared<Graph>();
+  auto x = Variable::create(g, {3});
+  auto y = Variable::create(g, {2});
+  auto W = Variable::create(g, Shape({3, 2}), true);
+  auto b = Variable::create(g, {2}, true);
+  // requires a gradient but does not lead to out
+  auto unused = Variable::create(g, {2}, true);
+  x->set_value(NDArray({2, 3}, {1, -2, 3, 0.5f, 1, -1}));
+  y->set_value(NDArray({2, 2}, {1, 0, 0, 1}));
+  W->set_value(NDArray({3, 2}, {0.1f, -0.2f, 0.3f, 0.4f, -0.5f, 0.6f}));
+  b->set_value(NDArray({2}, {0.5f, -0.5f}));
+  unused->set_value(NDArray({2}, {1, 2}));
+
+  auto out = x->mm(W)->add(b);
+  auto loss = out->softmax_ce(y);
+  auto other = unused->relu();
+
+  std::vector<VariableRef> params = {W, b};
+  std::vector<std::vector<float>> values, grads;
+
+  // runs a step and keeps values and gradients before the update
+  auto backward = [&]() {
+    g->forward();
+    g->backward(loss);
+    values.clear();
+    grads.clear();
+    for (const auto& p : params) {
+      values.push_back(p->get_value().vec());
+      grads.push_back(g->gradient(p).vec());
+    }
+  };
+
+  GIVEN("SGD") {
+    SGD sgd(g, 0.1f);
+    backward();
+    sgd.step();
+    for (size_t k = 0; k < params.size(); ++k) {
+      auto v = params[k]->get_value().vec();
+      for (size_t i = 0; i < v.size(); ++i) {
+        REQUIRE(v[i] == Approx(values[k][i] - 0.1f * grads[k][i]));
+      }
+    }
+    REQUIRE(unused->get_value() == NDArray({2}, {1, 2}));
+    REQUIRE(sgd.steps() == 1);
+
+    // the new values are picked up by the next forward()
+    g->forward();
+    REQUIRE(out->get_value() ==
+        x->get_value().mm(W->get_value()).add(b->get_value()));
+  }
+
+  GIVEN("SGD with momentum") {
+    SGD sgd(g, 0.1f, 0.9f);
+    backward();
+    auto first = grads;
+    sgd.step();
+    backward();
+    sgd.step();
+    for (size_t k = 0; k < params.size(); ++k) {
+      auto v = params[k]->get_value().vec();
+      for (size_t i = 0; i < v.size(); ++i) {
+        float velocity = 0.9f * first[k][i] + grads[k][i];
+        REQUIRE(v[i] == Approx(values[k][i] - 0.1f * velocity));
+      }
+    }
+  }
+
+  GIVEN("Adam and AdamW") {
+    Adam adam(g, 0.01f);
+    backward();
+    adam.step();
+    // the first bias corrected step is lr * sign(g)
+    for (size_t k = 0; k < params.size(); ++k) {
+      auto v = params[k]->get_value().vec();
+      for (size_t i = 0; i < v.size(); ++i) {
+        float sign = grads[k][i] > 0 ? 1.0f : -1.0f;
+        REQUIRE(v[i] == Approx(values[k][i] - 0.01f * sign));
+      }
+    }
+
+    AdamW adamw(g, 0.01f, 0.9f, 0.999f, 1e-8f, 0.1f);
+    backward();
+    adamw.step();
+    for (size_t k = 0; k < params.size(); ++k) {
+      auto v = params[k]->get_value().vec();
+      for (size_t i = 0; i < v.size(); ++i) {
+        float sign = grads[k][i] > 0 ? 1.0f : -1.0f;
+        float decay = 0.01f * 0.1f * values[k][i];
+        REQUIRE(v[i] == Approx(values[k][i] - 0.01f * sign - decay));
+      }
+    }
+  }
+
+  GIVEN("A value held across the step") {
+    SGD sgd(g, 0.1f);
+    backward();
+    auto held = W->get_value();
+    sgd.step();
+    REQUIRE(held.vec() == values[0]);
+    REQUIRE(W->get_value().vec() != values[0]);
+  }
+}
+
+TEST_CASE("Flat parameters") {
+  auto build = [](GraphRef g, std::vector<VariableRef>& params) {
+    auto x = Variable::create(g, {3});
+    auto y = Variable::create(g, {2});
+    auto W1 = Variable::create(g, Shape({3, 4}), true);
+    auto b1 = Variable::create(g, {4}, true);
+    auto W2 = Variable::create(g, Shape({4, 2}), true);
+    x->set_value(NDArray({2, 3}, {1, -2, 3, 0.5f, 1, -1}));
+    y->set_value(NDArray({2, 2}, {1, 0, 0, 1}));
+    W1->set_value(NDArray({3, 4}, {0.1f, -0.2f, 0.3f, 0.4f, -0.5f, 0.6f}));
+    b1->set_value(NDArray({4}, {0.1f, -0.1f}));
+    W2->set_value(NDArray({4, 2}, {0.3f, -0.3f, 0.2f}));
+    params = {W1, b1, W2};
+    return x->mm(W1)->add(b1)->relu()->mm(W2)->softmax_ce(y);
+  };
+
+  GraphRef plain = std::make_shared<Graph>();
+  GraphRef flat = std::make_shared<Graph>();
+  std::vector<VariableRef> plain_params, params;
+  auto plain_loss = build(plain, plain_params);
+  auto loss = build(flat, params);
+  REQUIRE(flat->flat_parameters().size() == 0);
+  flat->flatten_parameters();
+
+  const auto& buffer = flat->flat_parameters();
+  const float* begin = buffer.data();
+  REQUIRE(reinterpret_cast<uintptr_t>(begin) % 64 == 0);
+  REQUIRE(flat->flat_gradients().size() == buffer.size());
+  for (size_t k = 0; k < params.size(); ++k) {
+    const float* data = params[k]->get_value().data();
+    REQUIRE(data >= begin);
+    REQUIRE(data + params[k]->get_value().size() <= begin + buffer.size());
+    REQUIRE(reinterpret_cast<uintptr_t>(data) % 64 == 0);
+    REQUIRE(params[k]->get_value() == plain_params[k]->get_value());
+  }
+
+  SGD plain_sgd(plain, 0.5f, 0.9f);
+  SGD sgd(flat, 0.5f, 0.9f);
+  for (size_t step = 0; step < 3; ++step) {
+    plain->forward();
+    plain->backward(plain_loss);
+    flat->forward();
+    flat->backward(loss);
+    REQUIRE(loss->get_value() == plain_loss->get_value());
+
+    for (size_t k = 0; k < params.size(); ++k) {
+      REQUIRE(flat->gradient(params[k]) == plain->gradient(plain_params[k]));
+    }
+    REQUIRE(flat->clip_gradients(0.1f) ==
+        Approx(plain->clip_gradients(0.1f)));
+    for (size_t k = 0; k < params.size(); ++k) {
+      REQUIRE(flat->gradient(params[k]) == plain->gradient(plain_params[k]));
+    }
+
+    plain_sgd.step();
+    sgd.step();
+    for (size_t k = 0; k < params.size(); ++k) {
+      REQUIRE(params[k]->get_value() == plain_params[k]->get_value());
+    }
+  }
+  // still views into the buffer
+  REQUIRE(params[0]->get_value().data() == begin);
+
+  GIVEN("set_value of a flattened variable") {
+    params[1]->set_value(NDArray({4}, {1, 2, 3, 4}));
+    REQUIRE(params[1]->get_value().data() != nullptr);
+    REQUIRE(params[1]->get_value() == NDArray({4}, {1, 2, 3, 4}));
+    REQUIRE_THROWS(params[1]->set_value(NDArray({2, 4})));
+  }
+}
@@ -0,0 +1,113 @@
+#include <cstring>
+#include <random>
+
+#include "catch.hpp"
+#include "../vmath.h"
+
+namespace {
+
+// distance in representable floats, both values finite
+int64_t ulp_distance(float a, float b) {
+  auto ordered = [](float x) {
+    int32_t i;
+    std::memcpy(&i, &x, sizeof(i));
+    return i < 0 ? int64_t(INT32_MIN) - i : int64_t(i);
+  };
+  return std::abs(ordered(a) - ordered(b));
+}
+
+std::vector<float> uniform(size_t n, float lo, float hi) {
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<float> dist(lo, hi);
+  std::vector<float> v(n);
+  for (auto& x : v) {
+    x = dist(rng);
+  }
+  return v;
+}
+
+// max ULP error of fn against the scalar version over in
+template <class F>
+int64_t max_ulp(const F& fn, SimdIsa isa, const std::vector<float>& in) {
+  std::vector<float> ref(in.size()), out(in.size());
+  fn(in.data(), ref.data(), in.size(), SimdIsa::scalar);
+  fn(in.data(), out.data(), in.size(), isa);
+
+  int64_t max_err = 0;
+  for (size_t i = 0; i < in.size(); ++i) {
+    max_err = std::max(max_err, ulp_distance(ref[i], out[i]));
+  }
+  return max_err;
+}
+
+} // namespace
+
+TEST_CASE("vmath accuracy") {
+  // odd length so the tails are covered too
+  size_t n = 100003;
+  auto wide = uniform(n, -87.0f, 88.0f);
+  auto softmax_range = uniform(n, -20.0f, 0.0f);
+  auto positive = uniform(n, 1e-30f, 1e30f);
+  auto near_one = uniform(n, 0.5f, 2.0f);
+
+  for (auto isa : {SimdIsa::scalar, SimdIsa::avx2, SimdIsa::avx512}) {
+    if (!simd_supported(isa)) {
+      continue;
+    }
+
+    REQUIRE(max_ulp(vexp, isa, wide) <= 2);
+    REQUIRE(max_ulp(vexp, isa, softmax_range) <= 2);
+    REQUIRE(max_ulp(vlog, isa, positive) <= 2);
+    REQUIRE(max_ulp(vlog, isa, near_one) <= 2);
+    REQUIRE(max_ulp(vrecip, isa, wide) == 0);
+
+    GIVEN("Special values") {
+      float inf = std::numeric_limits<float>::infinity();
+      float flt_min = std::numeric_limits<float>::min();
+      std::vector<float> in = {0.0f, -0.0f, 1.0f, 200.0f, -200.0f, inf, -inf};
+      std::vector<float> out(in.size());
+
+      vexp(in.data(), out.data(), in.size(), isa);
+      REQUIRE(out[0] == 1.0f);
+      REQUIRE(out[2] == Approx(std::exp(1.0f)));
+      REQUIRE(out[3] == inf);
+      REQUIRE(out[4] == 0.0f);
+      REQUIRE(out[5] == inf);
+      REQUIRE(out[6] == 0.0f);
+
+      vlog(in.data(), out.data(), in.size(), isa);
+      REQUIRE(out[0] == Approx(std::log(flt_min)));
+      REQUIRE(out[1] == Approx(std::log(flt_min)));
+      REQUIRE(out[2] == 0.0f);
+      REQUIRE(out[4] == Approx(std::log(flt_min)));
+      REQUIRE(out[5] == inf);
+
+      // in place
+      vrecip(in.data() + 2, in.data() + 2, 2, isa);
+      REQUIRE(in[2] == 1.0f);
+      REQUIRE(in[3] == 1.0f / 200.0f);
+    }
+  }
+}
+
+TEST_CASE("vmath byte conversion") {
+  // odd length for the tails
+  std::vector<uint8_t> in(1003);
+  for (size_t i = 0; i < in.size(); ++i) {
+    in[i] = static_cast<uint8_t>(i * 7);
+  }
+  std::vector<float> ref(in.size()), out(in.size());
+  vscale_u8(in.data(), ref.data(), in.size(), 1.0f / 255.0f, SimdIsa::scalar);
+
+  for (auto isa : {SimdIsa::scalar, SimdIsa::avx2, SimdIsa::avx512}) {
+    if (!simd_supported(isa)) {
+      continue;
+    }
+    vscale_u8(in.data(), out.data(), in.size(), 1.0f / 255.0f, isa);
+    REQUIRE(out == ref);
+    REQUIRE(out[0] == 0.0f);
+    REQUIRE(out[1] == 7.0f * (1.0f / 255.0f));
+    // 37 * 7 wraps to 3
+    REQUIRE(out[37] == 3.0f * (1.0f / 255.0f));
+  }
+}
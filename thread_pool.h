@@ -0,0 +1,221 @@
+#ifndef _thread_pool_h_
+#define _thread_pool_h_
+
+#include <mutex>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstddef>
+#include <cstdlib>
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <condition_variable>
+
+/*
+ * Process wide intra-op thread pool.
+ *
+ * The pool owns num_threads() - 1 workers, the thread calling
+ * parallel_for() always runs one chunk itself and then helps draining the
+ * queue until its chunks are done, so a pool of size 1 is fully serial.
+ *
+ * Nested parallel_for() calls (e.g. sgemm inside a parallel bmm) run
+ * serially on the calling thread, the outer loop already keeps everyone
+ * busy and this way no thread ever blocks waiting on a queued task.
+ *
+ * The thread count defaults to UFLOW_NUM_THREADS or to the number of
+ * hardware threads and can be changed with set_num_threads() as long as
+ * no parallel work is in flight.
+ */
+
+// smallest number of elements worth handing to another thread for
+// simple elementwise loops
+static const size_t parallel_grain = 1 << 15;
+
+class ThreadPool {
+  public:
+    static ThreadPool& get() {
+      static ThreadPool pool(default_num_threads());
+      return pool;
+    }
+
+    ~ThreadPool() {
+      stop();
+    }
+
+    size_t num_threads() const {
+      return workers_.size() + 1;
+    }
+
+    void set_num_threads(size_t n) {
+      stop();
+      start(std::max<size_t>(n, 1));
+    }
+
+    // true while executing a chunk of a parallel_for() on any thread
+    static bool in_parallel() {
+      return depth() > 0;
+    }
+
+    void submit(std::function<void()> task) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks_.push_back(std::move(task));
+      }
+      cv_.notify_one();
+    }
+
+    // fn(chunk_begin, chunk_end) over [begin, end), chunks are at least
+    // grain long, exceptions thrown by fn are rethrown on the caller
+    template <class F>
+    void parallel_for(size_t begin, size_t end, size_t grain, const F& fn) {
+      if (end <= begin) {
+        return;
+      }
+
+      size_t n = end - begin;
+      grain = std::max<size_t>(grain, 1);
+      size_t chunks = std::min(num_threads(), (n + grain - 1) / grain);
+
+      if (chunks <= 1 || in_parallel()) {
+        fn(begin, end);
+        return;
+      }
+
+      size_t chunk_size = (n + chunks - 1) / chunks;
+      size_t pending = chunks - 1;
+      std::exception_ptr error;
+      std::mutex done_mutex;
+      std::condition_variable done;
+
+      auto run = [&](size_t c) {
+        size_t b = begin + c * chunk_size;
+        size_t e = std::min(end, b + chunk_size);
+        depth()++;
+        try {
+          if (b < e) {
+            fn(b, e);
+          }
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(done_mutex);
+          if (!error) {
+            error = std::current_exception();
+          }
+        }
+        depth()--;
+      };
+
+      for (size_t c = 1; c < chunks; ++c) {
+        submit([&, c]() {
+          run(c);
+          std::lock_guard<std::mutex> lock(done_mutex);
+          if (--pending == 0) {
+            done.notify_one();
+          }
+        });
+      }
+
+      run(0);
+
+      // help with whatever is queued instead of sleeping
+      while (run_one()) {
+        std::lock_guard<std::mutex> lock(done_mutex);
+        if (pending == 0) {
+          break;
+        }
+      }
+
+      std::unique_lock<std::mutex> lock(done_mutex);
+      done.wait(lock, [&]() { return pending == 0; });
+
+      if (error) {
+        std::rethrow_exception(error);
+      }
+    }
+
+    // runs one queued task on the calling thread, false if there was none
+    bool run_one() {
+      std::function<void()> task;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (tasks_.empty()) {
+          return false;
+        }
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+      }
+      task();
+      return true;
+    }
+
+  private:
+    explicit ThreadPool(size_t n) {
+      start(n);
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    const ThreadPool& operator=(const ThreadPool&) = delete;
+
+    static size_t default_num_threads() {
+      const char* env = std::getenv("UFLOW_NUM_THREADS");
+      if (env != nullptr && std::atoi(env) > 0) {
+        return std::atoi(env);
+      }
+      return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    static int& depth() {
+      thread_local int depth = 0;
+      return depth;
+    }
+
+    void start(size_t n) {
+      stopping_ = false;
+      for (size_t i = 1; i < n; ++i) {
+        workers_.emplace_back([this]() { work(); });
+      }
+    }
+
+    void stop() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+      }
+      cv_.notify_all();
+
+      for (auto& worker : workers_) {
+        worker.join();
+      }
+      workers_.clear();
+    }
+
+    void work() {
+      while (true) {
+        std::function<void()> task;
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          cv_.wait(lock, [this]() { return stopping_ || !tasks_.empty(); });
+          if (tasks_.empty()) {
+            return;
+          }
+          task = std::move(tasks_.front());
+          tasks_.pop_front();
+        }
+        task();
+      }
+    }
+
+    std::vector<std::thread> workers_;
+    std::deque<std::function<void()>> tasks_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_ = false;
+};
+
+template <class F>
+inline void parallel_for(size_t begin, size_t end, size_t grain, const F& fn) {
+  ThreadPool::get().parallel_for(begin, end, grain, fn);
+}
+
+#endif // _thread_pool_h_
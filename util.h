@@ -2,6 +2,7 @@
 #define _util_h_
 
 #include <vector>
+#include <algorithm>
 #include <ostream>
 #include <sstream>
 #include <random>
@@ -0,0 +1,375 @@
+#ifndef _vmath_h_
+#define _vmath_h_
+
+#include <cmath>
+#include <limits>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define UFLOW_VMATH_X86 1
+#endif
+
+/*
+ * Vectorized exp, log and reciprocal over float spans, and the conversion
+ * of bytes to scaled floats.
+ *
+ * Each function has a scalar version (the libm call, used on non-x86
+ * targets and CPUs without AVX2/FMA), an AVX2+FMA and an AVX-512F version.
+ * The SIMD versions are compiled with per function target attributes, so
+ * the binary does not need -mavx2 / -march=native, and the widest one the
+ * CPU supports is picked at runtime.
+ *
+ * The exp and log kernels are the Cephes single precision algorithms:
+ *
+ * - exp(x) = 2^n * p(r) with n = round(x / ln 2) and a degree 6
+ *   polynomial on |r| <= ln 2 / 2. Max error 2 ULP against libm for
+ *   normal results. Inputs are clamped to [-104, 89], larger inputs give
+ *   +inf and results below FLT_MIN are rounded to denormals or 0 (these
+ *   are off by at most one denormal step).
+ * - log(x) = e * ln 2 + p(m - 1) with m in [sqrt(0.5), sqrt(2)) and a
+ *   degree 9 polynomial. Max error 2 ULP against libm. Like
+ *   NDArray::log_ the input is clamped to FLT_MIN, so x <= 0 gives
+ *   log(FLT_MIN), and log(+inf) is +inf.
+ * - recip(x) = 1 / x is a vector division, which is correctly rounded
+ *   and matches the scalar version exactly.
+ *
+ * NaN inputs are not propagated by the SIMD versions.
+ *
+ * scale_u8(x) = float(x) * scale converts exactly and rounds once, like
+ * the scalar version.
+ */
+
+enum class SimdIsa { scalar, avx2, avx512 };
+
+inline bool simd_supported(SimdIsa isa) {
+  switch (isa) {
+    case SimdIsa::scalar:
+      return true;
+#ifdef UFLOW_VMATH_X86
+    case SimdIsa::avx2:
+      return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    case SimdIsa::avx512:
+      return __builtin_cpu_supports("avx512f");
+#endif
+    default:
+      return false;
+  }
+}
+
+// widest instruction set supported by the CPU
+inline SimdIsa simd_isa() {
+  static const SimdIsa isa =
+    simd_supported(SimdIsa::avx512) ? SimdIsa::avx512 :
+    simd_supported(SimdIsa::avx2) ? SimdIsa::avx2 : SimdIsa::scalar;
+  return isa;
+}
+
+namespace vmath {
+
+inline void exp_scalar(const float* in, float* out, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = std::exp(in[i]);
+  }
+}
+
+inline void log_scalar(const float* in, float* out, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = std::log(std::max(in[i], std::numeric_limits<float>::min()));
+  }
+}
+
+inline void recip_scalar(const float* in, float* out, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = 1.0f / in[i];
+  }
+}
+
+inline void scale_u8_scalar(const uint8_t* in, float* out, size_t n,
+    float scale) {
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = static_cast<float>(in[i]) * scale;
+  }
+}
+
+// Cephes constants
+static const float exp_lo = -104.0f;
+static const float exp_hi = 89.0f;
+static const float log2e = 1.44269504088896341f;
+static const float ln2_hi = 0.693359375f;
+static const float ln2_lo = -2.12194440e-4f;
+static const float exp_p[] = {
+  1.9875691500e-4f, 1.3981999507e-3f, 8.3334519073e-3f,
+  4.1665795894e-2f, 1.6666665459e-1f, 5.0000001201e-1f,
+};
+static const float sqrt_half = 0.707106781186547524f;
+static const float log_p[] = {
+  7.0376836292e-2f, -1.1514610310e-1f, 1.1676998740e-1f,
+  -1.2420140846e-1f, 1.4249322787e-1f, -1.6668057665e-1f,
+  2.0000714765e-1f, -2.4999993993e-1f, 3.3333331174e-1f,
+};
+
+#ifdef UFLOW_VMATH_X86
+
+#define UFLOW_AVX2 __attribute__((target("avx2,fma")))
+#define UFLOW_AVX512 __attribute__((target("avx512f")))
+
+UFLOW_AVX2 inline __m256 exp8(__m256 x) {
+  x = _mm256_max_ps(x, _mm256_set1_ps(exp_lo));
+  x = _mm256_min_ps(x, _mm256_set1_ps(exp_hi));
+
+  __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(log2e)),
+      _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(ln2_hi), x);
+  r = _mm256_fnmadd_ps(n, _mm256_set1_ps(ln2_lo), r);
+
+  __m256 p = _mm256_set1_ps(exp_p[0]);
+  for (size_t i = 1; i < 6; ++i) {
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(exp_p[i]));
+  }
+  p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), r);
+  p = _mm256_add_ps(p, _mm256_set1_ps(1.0f));
+
+  // 2^n as 2^(n/2) * 2^(n - n/2), so both factors stay normal
+  __m256i ni = _mm256_cvtps_epi32(n);
+  __m256i n1 = _mm256_srai_epi32(ni, 1);
+  __m256i n2 = _mm256_sub_epi32(ni, n1);
+  __m256i bias = _mm256_set1_epi32(127);
+  __m256 s1 = _mm256_castsi256_ps(
+      _mm256_slli_epi32(_mm256_add_epi32(n1, bias), 23));
+  __m256 s2 = _mm256_castsi256_ps(
+      _mm256_slli_epi32(_mm256_add_epi32(n2, bias), 23));
+
+  return _mm256_mul_ps(_mm256_mul_ps(p, s1), s2);
+}
+
+UFLOW_AVX2 inline __m256 log8(__m256 x) {
+  __m256 inf = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+  __m256 is_inf = _mm256_cmp_ps(x, inf, _CMP_EQ_OQ);
+  x = _mm256_max_ps(x, _mm256_set1_ps(std::numeric_limits<float>::min()));
+
+  // x = m * 2^e with m in [0.5, 1)
+  __m256i bits = _mm256_castps_si256(x);
+  __m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(
+        _mm256_srli_epi32(bits, 23), _mm256_set1_epi32(126)));
+  __m256 m = _mm256_castsi256_ps(_mm256_or_si256(
+        _mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff)),
+        _mm256_set1_epi32(0x3f000000)));
+
+  // move m into [sqrt(0.5), sqrt(2)) and take m - 1
+  __m256 one = _mm256_set1_ps(1.0f);
+  __m256 small = _mm256_cmp_ps(m, _mm256_set1_ps(sqrt_half), _CMP_LT_OQ);
+  e = _mm256_sub_ps(e, _mm256_and_ps(small, one));
+  m = _mm256_add_ps(_mm256_sub_ps(m, one), _mm256_and_ps(small, m));
+
+  __m256 z = _mm256_mul_ps(m, m);
+  __m256 p = _mm256_set1_ps(log_p[0]);
+  for (size_t i = 1; i < 9; ++i) {
+    p = _mm256_fmadd_ps(p, m, _mm256_set1_ps(log_p[i]));
+  }
+  __m256 y = _mm256_mul_ps(_mm256_mul_ps(p, m), z);
+  y = _mm256_fmadd_ps(e, _mm256_set1_ps(ln2_lo), y);
+  y = _mm256_fnmadd_ps(_mm256_set1_ps(0.5f), z, y);
+  __m256 res = _mm256_add_ps(m, y);
+  res = _mm256_fmadd_ps(e, _mm256_set1_ps(ln2_hi), res);
+
+  return _mm256_blendv_ps(res, inf, is_inf);
+}
+
+UFLOW_AVX2 inline __m256 recip8(__m256 x) {
+  return _mm256_div_ps(_mm256_set1_ps(1.0f), x);
+}
+
+// the tail goes through a padded buffer
+#define UFLOW_VMATH_AVX2_LOOP(fn8)                         \
+  size_t i = 0;                                            \
+  for (; i + 8 <= n; i += 8) {                             \
+    _mm256_storeu_ps(out + i, fn8(_mm256_loadu_ps(in + i))); \
+  }                                                        \
+  if (i < n) {                                             \
+    alignas(32) float buf[8] = {1, 1, 1, 1, 1, 1, 1, 1};   \
+    std::copy(in + i, in + n, buf);                        \
+    _mm256_store_ps(buf, fn8(_mm256_load_ps(buf)));        \
+    std::copy(buf, buf + (n - i), out + i);                \
+  }
+
+UFLOW_AVX2 inline void exp_avx2(const float* in, float* out, size_t n) {
+  UFLOW_VMATH_AVX2_LOOP(exp8)
+}
+
+UFLOW_AVX2 inline void log_avx2(const float* in, float* out, size_t n) {
+  UFLOW_VMATH_AVX2_LOOP(log8)
+}
+
+UFLOW_AVX2 inline void recip_avx2(const float* in, float* out, size_t n) {
+  UFLOW_VMATH_AVX2_LOOP(recip8)
+}
+
+#undef UFLOW_VMATH_AVX2_LOOP
+
+UFLOW_AVX2 inline void scale_u8_avx2(const uint8_t* in, float* out,
+    size_t n, float scale) {
+  __m256 s = _mm256_set1_ps(scale);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + i));
+    __m256 x = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes));
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(x, s));
+  }
+  scale_u8_scalar(in + i, out + i, n - i, scale);
+}
+
+UFLOW_AVX512 inline __m512 exp16(__m512 x) {
+  x = _mm512_max_ps(x, _mm512_set1_ps(exp_lo));
+  x = _mm512_min_ps(x, _mm512_set1_ps(exp_hi));
+
+  __m512 n = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(log2e)),
+      _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m512 r = _mm512_fnmadd_ps(n, _mm512_set1_ps(ln2_hi), x);
+  r = _mm512_fnmadd_ps(n, _mm512_set1_ps(ln2_lo), r);
+
+  __m512 p = _mm512_set1_ps(exp_p[0]);
+  for (size_t i = 1; i < 6; ++i) {
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(exp_p[i]));
+  }
+  p = _mm512_fmadd_ps(p, _mm512_mul_ps(r, r), r);
+  p = _mm512_add_ps(p, _mm512_set1_ps(1.0f));
+
+  // scalef computes p * 2^n without the split the AVX2 version needs
+  return _mm512_scalef_ps(p, n);
+}
+
+UFLOW_AVX512 inline __m512 log16(__m512 x) {
+  __m512 inf = _mm512_set1_ps(std::numeric_limits<float>::infinity());
+  __mmask16 is_inf = _mm512_cmp_ps_mask(x, inf, _CMP_EQ_OQ);
+  x = _mm512_max_ps(x, _mm512_set1_ps(std::numeric_limits<float>::min()));
+
+  __m512i bits = _mm512_castps_si512(x);
+  __m512 e = _mm512_cvtepi32_ps(_mm512_sub_epi32(
+        _mm512_srli_epi32(bits, 23), _mm512_set1_epi32(126)));
+  __m512 m = _mm512_castsi512_ps(_mm512_or_si512(
+        _mm512_and_si512(bits, _mm512_set1_epi32(0x007fffff)),
+        _mm512_set1_epi32(0x3f000000)));
+
+  __m512 one = _mm512_set1_ps(1.0f);
+  __mmask16 small = _mm512_cmp_ps_mask(m, _mm512_set1_ps(sqrt_half),
+      _CMP_LT_OQ);
+  e = _mm512_mask_sub_ps(e, small, e, one);
+  m = _mm512_mask_add_ps(_mm512_sub_ps(m, one), small,
+      _mm512_sub_ps(m, one), m);
+
+  __m512 z = _mm512_mul_ps(m, m);
+  __m512 p = _mm512_set1_ps(log_p[0]);
+  for (size_t i = 1; i < 9; ++i) {
+    p = _mm512_fmadd_ps(p, m, _mm512_set1_ps(log_p[i]));
+  }
+  __m512 y = _mm512_mul_ps(_mm512_mul_ps(p, m), z);
+  y = _mm512_fmadd_ps(e, _mm512_set1_ps(ln2_lo), y);
+  y = _mm512_fnmadd_ps(_mm512_set1_ps(0.5f), z, y);
+  __m512 res = _mm512_add_ps(m, y);
+  res = _mm512_fmadd_ps(e, _mm512_set1_ps(ln2_hi), res);
+
+  return _mm512_mask_mov_ps(res, is_inf, inf);
+}
+
+UFLOW_AVX512 inline __m512 recip16(__m512 x) {
+  return _mm512_div_ps(_mm512_set1_ps(1.0f), x);
+}
+
+// the tail uses masked loads and stores, masked out lanes compute on 1
+#define UFLOW_VMATH_AVX512_LOOP(fn16)                               \
+  size_t i = 0;                                                     \
+  for (; i + 16 <= n; i += 16) {                                    \
+    _mm512_storeu_ps(out + i, fn16(_mm512_loadu_ps(in + i)));       \
+  }                                                                 \
+  if (i < n) {                                                      \
+    __mmask16 mask = static_cast<__mmask16>((1u << (n - i)) - 1);   \
+    __m512 x = _mm512_mask_loadu_ps(_mm512_set1_ps(1.0f), mask, in + i); \
+    _mm512_mask_storeu_ps(out + i, mask, fn16(x));                  \
+  }
+
+UFLOW_AVX512 inline void exp_avx512(const float* in, float* out, size_t n) {
+  UFLOW_VMATH_AVX512_LOOP(exp16)
+}
+
+UFLOW_AVX512 inline void log_avx512(const float* in, float* out, size_t n) {
+  UFLOW_VMATH_AVX512_LOOP(log16)
+}
+
+UFLOW_AVX512 inline void recip_avx512(const float* in, float* out, size_t n) {
+  UFLOW_VMATH_AVX512_LOOP(recip16)
+}
+
+#undef UFLOW_VMATH_AVX512_LOOP
+
+UFLOW_AVX512 inline void scale_u8_avx512(const uint8_t* in, float* out,
+    size_t n, float scale) {
+  __m512 s = _mm512_set1_ps(scale);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+    __m512 x = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(bytes));
+    _mm512_storeu_ps(out + i, _mm512_mul_ps(x, s));
+  }
+  scale_u8_scalar(in + i, out + i, n - i, scale);
+}
+#undef UFLOW_AVX2
+#undef UFLOW_AVX512
+
+#define UFLOW_VMATH_DISPATCH(name)                          \
+  switch (isa) {                                            \
+    case SimdIsa::avx512: return name##_avx512(in, out, n); \
+    case SimdIsa::avx2: return name##_avx2(in, out, n);     \
+    default: return name##_scalar(in, out, n);              \
+  }
+
+#else
+
+#define UFLOW_VMATH_DISPATCH(name) \
+  (void) isa;                      \
+  return name##_scalar(in, out, n);
+
+#endif // UFLOW_VMATH_X86
+
+} // namespace vmath
+
+// out[i] = exp(in[i]) for i < n, in and out may be the same span, isa must
+// be supported by the CPU
+inline void vexp(const float* in, float* out, size_t n,
+    SimdIsa isa = simd_isa()) {
+  using namespace vmath;
+  UFLOW_VMATH_DISPATCH(exp)
+}
+
+// out[i] = log(max(in[i], FLT_MIN))
+inline void vlog(const float* in, float* out, size_t n,
+    SimdIsa isa = simd_isa()) {
+  using namespace vmath;
+  UFLOW_VMATH_DISPATCH(log)
+}
+
+// out[i] = 1 / in[i]
+inline void vrecip(const float* in, float* out, size_t n,
+    SimdIsa isa = simd_isa()) {
+  using namespace vmath;
+  UFLOW_VMATH_DISPATCH(recip)
+}
+
+#undef UFLOW_VMATH_DISPATCH
+
+// out[i] = float(in[i]) * scale
+inline void vscale_u8(const uint8_t* in, float* out, size_t n, float scale,
+    SimdIsa isa = simd_isa()) {
+  using namespace vmath;
+  switch (isa) {
+#ifdef UFLOW_VMATH_X86
+    case SimdIsa::avx512: return scale_u8_avx512(in, out, n, scale);
+    case SimdIsa::avx2: return scale_u8_avx2(in, out, n, scale);
+#endif
+    default: return scale_u8_scalar(in, out, n, scale);
+  }
+}
+
+#endif // _vmath_h_